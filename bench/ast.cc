@@ -0,0 +1,108 @@
+// Compares reading a program back from its binary AST (kali --emit=ast)
+// against lexing and parsing its source, on generated programs of growing
+// size.
+//
+//     bench-ast [repetitions]
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/ast_file.h"
+#include "kaleidoscope/lexer.h"
+#include "kaleidoscope/parser.h"
+
+namespace {
+
+/// A program of functions definitions, each with a loop, a conditional, calls
+/// and some arithmetic.
+std::string generate(size_t functions) {
+  std::ostringstream source;
+  source << "def f0(x) x;\n";
+  for (size_t i = 1; i < functions; i++) {
+    source << "def f" << i << "(x y)\n"
+           << "  var a = x * " << i << ", b = y + 1 in\n"
+           << "    if a < b then f" << i - 1 << "(a - b) + 3\n"
+           << "    else for j = 0, j < a in a * b - j / " << i + 1 << ";\n";
+  }
+  return source.str();
+}
+
+using Clock = std::chrono::steady_clock;
+
+template <class Fn>
+double median_ms(Fn &&fn, int repetitions) {
+  std::vector<double> times;
+  for (int r = 0; r < repetitions; r++) {
+    Clock::time_point start = Clock::now();
+    fn();
+    times.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int repetitions = argc > 1 ? atoi(argv[1]) : 5;
+
+  std::string prefix = "/tmp/bench-ast." + std::to_string(getpid());
+  std::string source_path = prefix + ".kl";
+  std::string ast_path = prefix + ".ast";
+
+  printf("%10s %12s %12s %12s %12s %8s\n", "functions", "source (KB)",
+         "ast (KB)", "parse (ms)", "load (ms)", "speedup");
+  for (size_t functions : {1000, 10000, 100000}) {
+    std::string source = generate(functions);
+    std::ofstream(source_path) << source;
+
+    Program program;
+    {
+      Lexer lexer(source_path);
+      Parser parser;
+      program = parser.program(lexer);
+    }
+    if (program.size() != functions) {
+      fprintf(stderr, "Error: parsed %zu of %zu functions\n", program.size(),
+              functions);
+      return 1;
+    }
+    if (!ast_file::Writer::write(program, ast_path)) return 1;
+    std::ifstream ast(ast_path, std::ios::ate | std::ios::binary);
+    size_t ast_size = ast.tellg();
+
+    // From the file each time, as kali would.
+    double parse_ms = median_ms(
+        [&]() {
+          Lexer lexer(source_path);
+          Parser parser;
+          program = parser.program(lexer);
+        },
+        repetitions);
+    double load_ms = median_ms(
+        [&]() {
+          std::unique_ptr<ast_file::File> file = ast_file::File::open(ast_path);
+          if (!file) exit(1);
+          program = file->program();
+        },
+        repetitions);
+
+    printf("%10zu %12zu %12zu %12.2f %12.2f %8.1f\n", functions,
+           source.size() / 1024, ast_size / 1024, parse_ms, load_ms,
+           parse_ms / load_ms);
+  }
+
+  remove(source_path.c_str());
+  remove(ast_path.c_str());
+  return 0;
+}
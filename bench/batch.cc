@@ -0,0 +1,144 @@
+// Compares evaluating a def over columns of rows with its batch kernel
+// (EngineOptions::batch_kernels), on the calling thread and split into chunks
+// across the parfor pool, against calling the compiled def once per row
+// through its function pointer. Prints the median rows per second of each.
+//
+//     bench-batch [rows] [repetitions]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/batch.h"
+#include "kaleidoscope/engine.h"
+
+namespace {
+
+struct Workload {
+  const char *name;
+  const char *source;
+  size_t arity;
+};
+
+const Workload kWorkloads[] = {
+    {"average", "def average(x y) (x + y) * 0.5;", 2},
+    {"max", "def max(a b) if a < b then a else b;", 2},
+    {"norm", "def norm(x y z) sqrt(x * x + y * y + z * z);", 3},
+    {"poly",
+     "def poly(x) var y = x * x, z = y * x in "
+     "z * z - 3 * y * z + 2 * y - x / 7 + 11;",
+     1},
+};
+
+/// Rows per chunk of the threaded kernels: enough for a chunk to outweigh
+/// taking it, few enough for the pool to balance.
+constexpr uint64_t kChunkRows = 1 << 16;
+
+using Clock = std::chrono::steady_clock;
+
+/// Median rows per second of repetitions runs of fn over rows rows.
+template <class Fn>
+double rows_per_second(Fn &&fn, size_t rows, int repetitions) {
+  std::vector<double> rates;
+  for (int r = 0; r < repetitions; r++) {
+    Clock::time_point start = Clock::now();
+    fn();
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    rates.push_back(static_cast<double>(rows) / seconds);
+  }
+  std::sort(rates.begin(), rates.end());
+  return rates[rates.size() / 2];
+}
+
+/// Evaluates fn, of arity arguments, once per row.
+void per_call(uint64_t address, size_t arity, const double *const *cols,
+              double *out, size_t rows) {
+  switch (arity) {
+    case 1: {
+      auto *fn = reinterpret_cast<double (*)(double)>(address);
+      for (size_t i = 0; i < rows; i++) out[i] = fn(cols[0][i]);
+      return;
+    }
+    case 2: {
+      auto *fn = reinterpret_cast<double (*)(double, double)>(address);
+      for (size_t i = 0; i < rows; i++) out[i] = fn(cols[0][i], cols[1][i]);
+      return;
+    }
+    case 3: {
+      auto *fn = reinterpret_cast<double (*)(double, double, double)>(address);
+      for (size_t i = 0; i < rows; i++) {
+        out[i] = fn(cols[0][i], cols[1][i], cols[2][i]);
+      }
+      return;
+    }
+  }
+  abort();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t rows = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1 << 22;
+  int repetitions = argc > 2 ? atoi(argv[2]) : 11;
+
+  EngineOptions serial_options;
+  serial_options.batch_kernels = true;
+  EngineOptions chunked_options = serial_options;
+  chunked_options.batch_chunk_rows = kChunkRows;
+  Engine serial_engine(serial_options);
+  Engine chunked_engine(chunked_options);
+
+  std::vector<std::vector<double>> columns(3, std::vector<double>(rows));
+  for (size_t i = 0; i < rows; i++) {
+    columns[0][i] = static_cast<double>(i % 1000) - 500;
+    columns[1][i] = std::sin(static_cast<double>(i));
+    columns[2][i] = static_cast<double>(i % 7) * 0.25;
+  }
+  const double *cols[] = {columns[0].data(), columns[1].data(),
+                          columns[2].data()};
+  std::vector<double> expected(rows);
+  std::vector<double> out(rows);
+
+  printf("%zu rows\n", rows);
+  printf("%-8s %16s %16s %16s %10s %10s\n", "", "call (Mrows/s)",
+         "batch (Mrows/s)", "chunked (Mrows/s)", "batch/call",
+         "chunked/call");
+  for (const Workload &workload : kWorkloads) {
+    Engine::HandlePtr serial = serial_engine.compile(workload.source);
+    Engine::HandlePtr chunked = chunked_engine.compile(workload.source);
+    if (!serial || !chunked) return 1;
+    uint64_t address = serial->address(workload.name);
+    std::string batch = batch_name(workload.name);
+    auto *serial_batch = serial->lookup<Engine::BatchKernel>(batch);
+    auto *chunked_batch = chunked->lookup<Engine::BatchKernel>(batch);
+
+    per_call(address, workload.arity, cols, expected.data(), rows);
+    for (Engine::BatchKernel *kernel : {serial_batch, chunked_batch}) {
+      std::fill(out.begin(), out.end(), NAN);
+      kernel(cols, out.data(), rows);
+      if (out != expected) {
+        fprintf(stderr, "Error: %s: batch kernel differs from calls\n",
+                workload.name);
+        return 1;
+      }
+    }
+
+    double call_rate = rows_per_second(
+        [&]() { per_call(address, workload.arity, cols, out.data(), rows); },
+        rows, repetitions);
+    double serial_rate = rows_per_second(
+        [&]() { serial_batch(cols, out.data(), rows); }, rows, repetitions);
+    double chunked_rate = rows_per_second(
+        [&]() { chunked_batch(cols, out.data(), rows); }, rows, repetitions);
+
+    printf("%-8s %16.1f %16.1f %16.1f %10.1f %10.1f\n", workload.name,
+           call_rate / 1e6, serial_rate / 1e6, chunked_rate / 1e6,
+           serial_rate / call_rate, chunked_rate / call_rate);
+  }
+  return 0;
+}
@@ -0,0 +1,428 @@
+// Measures kali end to end, from source to output.o, at each optimization
+// level, on corpora of growing scale: the examples, and generated programs
+// that vary in the number and size of functions, the depth of expressions,
+// the nesting of loops and the use of var. Prints, as JSON, the median wall
+// time of each run, functions and lines compiled per second, peak RSS and the
+// size of the object.
+//
+//     bench-compile [repetitions] [max scale] [kali]
+//
+// Scales go 1, 10, 100, ... up to max scale (100 by default); the programs
+// are the same on every run and every machine.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/lexer.h"
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/vm.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+/// xorshift64*, rather than <random>, whose distributions differ between
+/// standard libraries.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed) {}
+
+  /// below - Uniform in [0, n).
+  size_t below(size_t n) {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return (state_ * 0x2545F4914F6CDD1DULL >> 32) % n;
+  }
+
+ private:
+  uint64_t state_;
+};
+
+/// The shape of a generated program, at scale 1.
+struct Shape {
+  const char *name;
+  size_t functions;
+  /// Terms summed in the body of each function.
+  size_t terms;
+  /// Operators nested in each term, and in each var initializer.
+  size_t depth;
+  /// sum loops nested around the terms.
+  size_t loops;
+  /// Variables bound by a var around the loops.
+  size_t vars;
+};
+
+const Shape kShapes[] = {
+    {"small", 10, 2, 2, 0, 0},  {"large", 10, 64, 2, 0, 0},
+    {"deep", 10, 1, 64, 0, 0},  {"loops", 10, 4, 2, 3, 0},
+    {"vars", 10, 4, 2, 0, 16},
+};
+
+/// Writes programs of a shape. Each function f<i>(x y z) may call those
+/// before it, so that nothing is left undefined.
+class Generator {
+ public:
+  explicit Generator(const Shape &shape)
+      : shape_(shape), random_(0x9E3779B97F4A7C15ULL) {}
+
+  std::string program(size_t functions) {
+    out_.str("");
+    for (index_ = 0; index_ < functions; index_++) function();
+    return out_.str();
+  }
+
+ private:
+  void function() {
+    out_ << "def f" << index_ << "(x y z)\n";
+    scope_ = {"x", "y", "z"};
+    for (size_t v = 0; v < shape_.vars; v++) {
+      out_ << (v ? ",\n      " : "  var ") << 'v' << v << " = ";
+      expression(shape_.depth);
+      // Initializers see the variables before them.
+      scope_.push_back("v" + std::to_string(v));
+    }
+    if (shape_.vars) out_ << " in\n";
+    for (size_t l = 0; l < shape_.loops; l++) {
+      // A sum, rather than a for, so that the body is not dead code.
+      std::string i = "i" + std::to_string(l);
+      out_ << "  sum " << i << " = 0, " << 4 + random_.below(8) << " in\n";
+      scope_.push_back(i);
+    }
+    for (size_t t = 0; t < shape_.terms; t++) {
+      out_ << (t ? " +\n    " : "    ");
+      expression(shape_.depth);
+    }
+    out_ << ";\n";
+  }
+
+  /// A chain of depth operators, each with a leaf on one side, or a call of
+  /// an earlier function.
+  void expression(size_t depth) {
+    if (depth == 0) {
+      leaf();
+      return;
+    }
+    static const char kOps[] = {'+', '-', '*', '+', '<'};
+    char op = kOps[random_.below(sizeof(kOps))];
+    switch (random_.below(index_ ? 8 : 7)) {
+      case 7:
+        out_ << 'f' << random_.below(index_) << '(';
+        expression(depth - 1);
+        out_ << ", ";
+        leaf();
+        out_ << ", ";
+        leaf();
+        out_ << ')';
+        return;
+      case 6:
+        out_ << "(if ";
+        leaf();
+        out_ << " < ";
+        leaf();
+        out_ << " then ";
+        expression(depth - 1);
+        out_ << " else ";
+        leaf();
+        out_ << ')';
+        return;
+      case 0:
+      case 1:
+      case 2:
+        out_ << '(';
+        leaf();
+        out_ << ' ' << op << ' ';
+        expression(depth - 1);
+        out_ << ')';
+        return;
+      default:
+        out_ << '(';
+        expression(depth - 1);
+        out_ << ' ' << op << ' ';
+        leaf();
+        out_ << ')';
+        return;
+    }
+  }
+
+  void leaf() {
+    if (random_.below(4) == 0) {
+      out_ << random_.below(100) << '.' << random_.below(10);
+    } else {
+      out_ << scope_[random_.below(scope_.size())];
+    }
+  }
+
+  const Shape &shape_;
+  Random random_;
+  std::ostringstream out_;
+  std::vector<std::string> scope_;
+  size_t index_ = 0;
+};
+
+/// A program, and what it is made of.
+struct Corpus {
+  std::string source;
+  size_t functions = 0;
+  size_t lines = 0;
+};
+
+/// An example, parsed for the names it defines, so that copies of it can be
+/// put together in one program.
+struct Example {
+  std::string source;
+  std::set<std::string> definitions;
+};
+
+std::optional<Example> read_example(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "Error: Could not read %s\n", path.c_str());
+    return std::nullopt;
+  }
+  Example example;
+  example.source.assign(std::istreambuf_iterator<char>(in), {});
+
+  Lexer lexer(path);
+  Parser parser;
+  for (const TopLevel &item : parser.program(lexer)) {
+    if (item.kind() == TopLevel::Kind::definition) {
+      example.definitions.insert(item.prototype()->name());
+    }
+  }
+  return example;
+}
+
+/// A copy of example, its definitions renamed with suffix, apart from those
+/// of every other copy. Externs are declared only in the copy with externs;
+/// an extern takes a line of its own in the examples.
+std::string copy_example(const Example &example, const std::string &suffix,
+                         bool externs) {
+  std::string out;
+  const std::string &source = example.source;
+  for (size_t i = 0; i < source.size();) {
+    if (!externs && source.compare(i, 7, "extern ") == 0 &&
+        (i == 0 || source[i - 1] == '\n')) {
+      size_t end = source.find('\n', i);
+      i = end == std::string::npos ? source.size() : end + 1;
+      continue;
+    }
+    // Identifiers, as the lexer reads them.
+    if (isalpha(source[i])) {
+      size_t end = i;
+      while (end < source.size() && isalnum(source[end])) end++;
+      std::string identifier = source.substr(i, end - i);
+      out += identifier;
+      if (example.definitions.count(identifier)) out += suffix;
+      i = end;
+      continue;
+    }
+    out += source[i++];
+  }
+  return out;
+}
+
+Corpus scale_examples(const std::vector<Example> &examples, size_t scale) {
+  Corpus corpus;
+  for (size_t copy = 0; copy < scale; copy++) {
+    for (size_t e = 0; e < examples.size(); e++) {
+      std::string suffix = "e" + std::to_string(e) + "c" + std::to_string(copy);
+      corpus.source += copy_example(examples[e], suffix, copy == 0) + '\n';
+      corpus.functions += examples[e].definitions.size();
+    }
+  }
+  corpus.lines = std::count(corpus.source.begin(), corpus.source.end(), '\n');
+  return corpus;
+}
+
+Corpus generate(const Shape &shape, size_t scale) {
+  Corpus corpus;
+  corpus.functions = shape.functions * scale;
+  corpus.source = Generator(shape).program(corpus.functions);
+  corpus.lines = std::count(corpus.source.begin(), corpus.source.end(), '\n');
+  return corpus;
+}
+
+/// check - Whether the program at path parses and refers to nothing
+/// undefined. kali logs such errors, but still writes an object, and exits
+/// with 0.
+bool check(const std::string &path) {
+  Lexer lexer(path);
+  Parser parser;
+  Program program = parser.program(lexer);
+  if (parser.errors() || !vm::Compiler::compile(program)) {
+    fprintf(stderr, "Error: %s does not compile\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct Run {
+  double wall_ms;
+  /// In KiB.
+  long peak_rss;
+  size_t object_size;
+};
+
+/// run - Runs kali -O<level> on source in directory, which it writes output.o
+/// to. Returns nullopt, after logging, if kali fails.
+std::optional<Run> run(const std::string &kali, const std::string &directory,
+                       const std::string &source, unsigned level) {
+  std::string object = directory + "/output.o";
+  remove(object.c_str());
+
+  std::string option = "-O" + std::to_string(level);
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // kali prints the module to stderr.
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if (chdir(directory.c_str()) == 0) {
+      execl(kali.c_str(), kali.c_str(), option.c_str(), source.c_str(),
+            nullptr);
+    }
+    _exit(127);
+  }
+  if (pid < 0) {
+    perror("Error: fork");
+    return std::nullopt;
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("Error: wait4");
+    return std::nullopt;
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: %s %s %s failed\n", kali.c_str(), option.c_str(),
+            source.c_str());
+    return std::nullopt;
+  }
+
+  struct stat object_stat;
+  if (stat(object.c_str(), &object_stat) != 0) {
+    fprintf(stderr, "Error: %s %s wrote no %s\n", kali.c_str(), option.c_str(),
+            object.c_str());
+    return std::nullopt;
+  }
+
+  Run result;
+  result.wall_ms =
+      std::chrono::duration<double, std::milli>(end - start).count();
+  result.peak_rss = usage.ru_maxrss;
+  result.object_size = object_stat.st_size;
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int repetitions = argc > 1 ? atoi(argv[1]) : 3;
+  size_t max_scale = argc > 2 ? atol(argv[2]) : 100;
+  std::string kali = argc > 3 ? argv[3] : KALI;
+  if (repetitions < 1) repetitions = 1;
+
+  char directory_template[] = "/tmp/bench-compile.XXXXXX";
+  if (!mkdtemp(directory_template)) {
+    perror("Error: mkdtemp");
+    return 1;
+  }
+  std::string directory = directory_template;
+  std::string source_path = directory + "/input.kl";
+
+  std::vector<Example> example_files;
+  for (const char *name : {"ch03", "ch05", "ch07", "ch08", "lang", "max"}) {
+    std::optional<Example> example =
+        read_example(std::string(EXAMPLES_DIR) + "/" + name + ".kl");
+    if (!example) return 1;
+    example_files.push_back(std::move(*example));
+  }
+
+  int status = 0;
+  llvm::json::OStream json(llvm::outs(), 2);
+  json.objectBegin();
+  json.attribute("kali", kali);
+  json.attribute("repetitions", repetitions);
+  json.attributeBegin("runs");
+  json.arrayBegin();
+
+  // The examples first, as the baseline.
+  for (size_t s = 0; s <= std::size(kShapes) && status == 0; s++) {
+    const char *name = s == 0 ? "examples" : kShapes[s - 1].name;
+    for (size_t scale = 1; scale <= max_scale && status == 0; scale *= 10) {
+      Corpus corpus = s == 0 ? scale_examples(example_files, scale)
+                             : generate(kShapes[s - 1], scale);
+      std::ofstream(source_path) << corpus.source;
+      if (!check(source_path)) {
+        status = 1;
+        break;
+      }
+
+      for (unsigned level = 0; level <= 3 && status == 0; level++) {
+        fprintf(stderr, "%s x%zu -O%u\n", name, scale, level);
+        std::vector<Run> runs;
+        for (int r = 0; r < repetitions; r++) {
+          std::optional<Run> result = run(kali, directory, source_path, level);
+          if (!result) {
+            status = 1;
+            break;
+          }
+          runs.push_back(*result);
+        }
+        if (status) break;
+
+        std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+          return a.wall_ms < b.wall_ms;
+        });
+        const Run &median = runs[runs.size() / 2];
+        double seconds = median.wall_ms / 1000;
+        long peak_rss = 0;
+        for (const Run &r : runs) peak_rss = std::max(peak_rss, r.peak_rss);
+
+        json.object([&] {
+          json.attribute("corpus", name);
+          json.attribute("scale", int64_t(scale));
+          json.attribute("level", int64_t(level));
+          json.attribute("functions", int64_t(corpus.functions));
+          json.attribute("lines", int64_t(corpus.lines));
+          json.attribute("source_bytes", int64_t(corpus.source.size()));
+          json.attribute("wall_ms", median.wall_ms);
+          json.attribute("functions_per_sec", corpus.functions / seconds);
+          json.attribute("lines_per_sec", corpus.lines / seconds);
+          json.attribute("peak_rss_kb", int64_t(peak_rss));
+          json.attribute("object_bytes", int64_t(median.object_size));
+        });
+      }
+    }
+  }
+
+  json.arrayEnd();
+  json.attributeEnd();
+  json.objectEnd();
+  llvm::outs() << '\n';
+
+  remove(source_path.c_str());
+  remove((directory + "/output.o").c_str());
+  rmdir(directory.c_str());
+  return status;
+}
@@ -0,0 +1,39 @@
+// The C++ equivalents of the Kaleidoscope kernels, statement for statement.
+// KERNELS names the CxxKernels that this build defines.
+
+#include "kernels.h"
+
+namespace {
+
+// lang.kl
+double fib(double n) { return n < 2 ? 1 : fib(n - 1) + fib(n - 2); }
+
+// ch05.kl. A Kaleidoscope for runs its body before it tests the condition,
+// and tests it on the next value of the variable.
+double printstar(double n) {
+  double i = 1;
+  do {
+    bench_putchard(42);
+    i += 1;
+  } while (i < n);
+  return 0;
+}
+
+// max.kl, which, despite its name, returns the lesser.
+double max(double a, double b) { return a < b ? a : b; }
+
+// ch08.kl
+double average(double x, double y) { return (x + y) * 0.5; }
+
+// The sum of the term over i in [0, n).
+double arith(double x, double n) {
+  double sum = 0;
+  for (double i = 0; i < n; i += 1) {
+    sum += BENCH_ARITH_TERM;
+  }
+  return sum;
+}
+
+}  // namespace
+
+const CxxKernels KERNELS = {fib, printstar, max, average, arith};
@@ -0,0 +1,31 @@
+#pragma once
+
+/// The kernels bench-run times, in C++, to compare with those kali compiles.
+/// kernels.cc is built once per optimization level, each build defining the
+/// CxxKernels of its level.
+
+/// The arithmetic kernel's term, in x and the loop variable i: both a
+/// Kaleidoscope and a C++ expression, so that the two kernels compute the
+/// same thing. No literal is divided by a literal, which C++ would do in
+/// integers.
+#define BENCH_ARITH_TERM                                                \
+  ((x + i) * (x - i * 0.5) + (i * i - x) / (x * x + 1.0) -              \
+   (x * 0.25 + i) * (i + 3.0) / (i + x + 2.0) + (x - 1.5) * (i - 2.5) * \
+                                                    (x + i * 0.125))
+
+/// Stands for libkl's putchard in both kernels: counts calls, instead of
+/// writing.
+extern "C" double bench_putchard(double c);
+
+struct CxxKernels {
+  double (*fib)(double);
+  double (*printstar)(double);
+  double (*max)(double, double);
+  double (*average)(double, double);
+  double (*arith)(double, double);
+};
+
+extern const CxxKernels kernels_O0;
+extern const CxxKernels kernels_O1;
+extern const CxxKernels kernels_O2;
+extern const CxxKernels kernels_O3;
@@ -0,0 +1,103 @@
+// Compares the output of the libkl runtime, buffered per thread, against the
+// fputc and fprintf(stderr, "%f\n") it replaced, writing to an unbuffered
+// stream as stderr is. Both write to /dev/null, so only the cost of getting
+// the characters out of the process is measured. Prints the median calls per
+// second of each.
+//
+//     bench-output [calls] [repetitions]
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "kaleidoscope/libkl.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/// Median calls per second of repetitions runs of fn making calls calls.
+template <class Fn>
+double calls_per_second(Fn &&fn, size_t calls, int repetitions) {
+  std::vector<double> rates;
+  for (int r = 0; r < repetitions; r++) {
+    Clock::time_point start = Clock::now();
+    fn();
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    rates.push_back(static_cast<double>(calls) / seconds);
+  }
+  std::sort(rates.begin(), rates.end());
+  return rates[rates.size() / 2];
+}
+
+const char kLine[] = "The quick brown fox jumps over the lazy dog.\n";
+
+/// The value printed by the i-th call: integers, then fractions.
+double value(size_t i) {
+  return i % 2 ? static_cast<double>(i) : static_cast<double>(i) / 7;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t calls = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1 << 20;
+  int repetitions = argc > 2 ? atoi(argv[2]) : 11;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  FILE *null_file = fopen("/dev/null", "w");
+  if (null_fd < 0 || !null_file) {
+    fprintf(stderr, "Error: Could not open /dev/null\n");
+    return 1;
+  }
+  setvbuf(null_file, nullptr, _IONBF, 0);
+  int previous_fd = kl_set_output(null_fd);
+
+  // Flushing is part of the cost of the runtime's output.
+  double putchard_rate = calls_per_second(
+      [&]() {
+        for (size_t i = 0; i < calls; i++) {
+          putchard(kLine[i % (sizeof(kLine) - 1)]);
+        }
+        kl_flush();
+      },
+      calls, repetitions);
+  double fputc_rate = calls_per_second(
+      [&]() {
+        for (size_t i = 0; i < calls; i++) {
+          fputc(kLine[i % (sizeof(kLine) - 1)], null_file);
+        }
+      },
+      calls, repetitions);
+  double printd_rate = calls_per_second(
+      [&]() {
+        for (size_t i = 0; i < calls; i++) printd(value(i));
+        kl_flush();
+      },
+      calls, repetitions);
+  double fprintf_rate = calls_per_second(
+      [&]() {
+        for (size_t i = 0; i < calls; i++) {
+          fprintf(null_file, "%f\n", value(i));
+        }
+      },
+      calls, repetitions);
+
+  kl_set_output(previous_fd);
+  fclose(null_file);
+  close(null_fd);
+
+  printf("%zu calls\n", calls);
+  printf("%-10s %16s %16s %10s\n", "", "libkl (Mcalls/s)", "stdio (Mcalls/s)",
+         "libkl/stdio");
+  printf("%-10s %16.1f %16.1f %10.1f\n", "putchard", putchard_rate / 1e6,
+         fputc_rate / 1e6, putchard_rate / fputc_rate);
+  printf("%-10s %16.1f %16.1f %10.1f\n", "printd", printd_rate / 1e6,
+         fprintf_rate / 1e6, printd_rate / fprintf_rate);
+  return 0;
+}
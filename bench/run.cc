@@ -0,0 +1,393 @@
+// Times the code kali generates, at each optimization level, against the
+// same kernels in C++, built by the compiler of this build at the same levels
+// (kernels.cc). kali's object is loaded into this process with ORC, and each
+// kernel called through a function pointer, as the C++ one is. Prints, as
+// JSON, the median wall time of each kernel, with the cycles, instructions,
+// IPC, branch misses and cache misses perf_event_open counted over it; null
+// where the system does not allow counting (see perf_event_paranoid).
+//
+//     bench-run [repetitions] [kali]
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bench/kernels.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace orc = llvm::orc;
+
+namespace {
+
+size_t putchard_calls = 0;
+
+}  // namespace
+
+extern "C" double bench_putchard(double /*c*/) {
+  putchard_calls++;
+  return 0;
+}
+
+namespace {
+
+#define STRINGIFY(...) #__VA_ARGS__
+#define EXPAND_AND_STRINGIFY(x) STRINGIFY(x)
+
+const char *kArithSource =
+    "def arith(x n)\n"
+    "  sum i = 0, n in\n"
+    "    " EXPAND_AND_STRINGIFY(BENCH_ARITH_TERM) ";\n";
+
+template <auto member>
+llvm::JITTargetAddress cxx(const CxxKernels &kernels) {
+  return llvm::pointerToJITTargetAddress(kernels.*member);
+}
+
+/// A kernel: a function of the examples, or the arithmetic kernel, called
+/// calls times with a and b; a goes up by 1 from one call to the next.
+struct Kernel {
+  const char *name;
+  /// The example that defines it; nullptr for kArithSource.
+  const char *example;
+  size_t arity;
+  double a;
+  double b;
+  size_t calls;
+  /// Its equivalent in C++.
+  llvm::JITTargetAddress (*cxx)(const CxxKernels &kernels);
+};
+
+const Kernel kKernels[] = {
+    {"fib", "lang.kl", 1, 27, 0, 10, cxx<&CxxKernels::fib>},
+    {"printstar", "ch05.kl", 1, 1e6, 0, 20, cxx<&CxxKernels::printstar>},
+    {"max", "max.kl", 2, 0, 5e6, 10000000, cxx<&CxxKernels::max>},
+    {"average", "ch08.kl", 2, 0, 1, 10000000, cxx<&CxxKernels::average>},
+    {"arith", nullptr, 2, 0.5, 1e5, 50, cxx<&CxxKernels::arith>},
+};
+
+const CxxKernels *const kCxxKernels[] = {&kernels_O0, &kernels_O1, &kernels_O2,
+                                         &kernels_O3};
+
+/// Cycles, instructions, branch misses and cache misses of this thread, in
+/// user space, counted as one perf_event_open group.
+class Counters {
+ public:
+  static constexpr size_t kCount = 4;
+  using Counts = std::array<std::optional<uint64_t>, kCount>;
+
+  Counters() {
+    const uint64_t events[kCount] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+    for (size_t i = 0; i < kCount; i++) {
+      struct perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = events[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      int leader = i == 0 ? -1 : fds_[0];
+      if (i > 0 && leader < 0) break;
+      fds_[i] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+    }
+  }
+
+  ~Counters() {
+    for (int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  bool available() const { return fds_[0] >= 0; }
+
+  void start() {
+    if (!available()) return;
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  /// stop - Returns the counts since start(); nullopt for events that could
+  /// not be opened.
+  Counts stop() {
+    Counts counts;
+    if (!available()) return counts;
+    ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    // The number of events, then their counts, in the order they were added.
+    uint64_t values[1 + kCount];
+    if (read(fds_[0], values, sizeof(values)) < 0) return counts;
+    size_t next = 1;
+    for (size_t i = 0; i < kCount && next <= values[0]; i++) {
+      if (fds_[i] >= 0) counts[i] = values[next++];
+    }
+    return counts;
+  }
+
+ private:
+  std::array<int, kCount> fds_ = {-1, -1, -1, -1};
+};
+
+struct Measurement {
+  double wall_ms;
+  Counters::Counts counts;
+  /// What the calls returned, plus the putchard calls they made, to check
+  /// the kernels against each other.
+  double result;
+};
+
+Measurement measure(const Kernel &kernel, llvm::JITTargetAddress address,
+                    Counters &counters) {
+  size_t calls_before = putchard_calls;
+  double total = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  counters.start();
+  if (kernel.arity == 1) {
+    auto *fn = llvm::jitTargetAddressToFunction<double (*)(double)>(address);
+    for (size_t c = 0; c < kernel.calls; c++) total += fn(kernel.a);
+  } else {
+    auto *fn =
+        llvm::jitTargetAddressToFunction<double (*)(double, double)>(address);
+    for (size_t c = 0; c < kernel.calls; c++) {
+      total += fn(kernel.a + c, kernel.b);
+    }
+  }
+  Measurement measurement;
+  measurement.counts = counters.stop();
+  auto end = std::chrono::steady_clock::now();
+
+  measurement.wall_ms =
+      std::chrono::duration<double, std::milli>(end - start).count();
+  measurement.result = total + (putchard_calls - calls_before);
+  return measurement;
+}
+
+/// The median of repetitions measurements, after one to warm up.
+Measurement median(const Kernel &kernel, llvm::JITTargetAddress address,
+                   Counters &counters, int repetitions) {
+  measure(kernel, address, counters);
+  std::vector<Measurement> measurements;
+  for (int r = 0; r < repetitions; r++) {
+    measurements.push_back(measure(kernel, address, counters));
+  }
+  std::sort(measurements.begin(), measurements.end(),
+            [](const Measurement &a, const Measurement &b) {
+              return a.wall_ms < b.wall_ms;
+            });
+  return measurements[measurements.size() / 2];
+}
+
+/// compile - Runs kali -O<level> on source in directory, and returns the
+/// object it writes. Returns nullptr, after logging, if kali fails.
+std::unique_ptr<llvm::MemoryBuffer> compile(const std::string &kali,
+                                            const std::string &directory,
+                                            const std::string &source,
+                                            unsigned level) {
+  std::string object = directory + "/output.o";
+  remove(object.c_str());
+
+  std::string option = "-O" + std::to_string(level);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // kali prints the module to stderr.
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if (chdir(directory.c_str()) == 0) {
+      execl(kali.c_str(), kali.c_str(), option.c_str(), source.c_str(),
+            nullptr);
+    }
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: %s %s %s failed\n", kali.c_str(), option.c_str(),
+            source.c_str());
+    return nullptr;
+  }
+
+  auto buffer = llvm::MemoryBuffer::getFile(object);
+  if (!buffer) {
+    fprintf(stderr, "Error: Could not read %s: %s\n", object.c_str(),
+            buffer.getError().message().c_str());
+    return nullptr;
+  }
+  return std::move(*buffer);
+}
+
+/// load - Links object into a JIT of its own, with putchard standing for
+/// libkl's, and the C library for the rest. Returns nullptr, after logging,
+/// if it cannot.
+std::unique_ptr<orc::LLJIT> load(std::unique_ptr<llvm::MemoryBuffer> object) {
+  auto jit = orc::LLJITBuilder().create();
+  if (!jit) {
+    llvm::logAllUnhandledErrors(jit.takeError(), llvm::errs(), "Error: ");
+    return nullptr;
+  }
+
+  orc::JITDylib &main = (*jit)->getMainJITDylib();
+  orc::MangleAndInterner mangle((*jit)->getExecutionSession(),
+                                (*jit)->getDataLayout());
+  orc::SymbolMap symbols;
+  symbols[mangle("putchard")] = llvm::JITEvaluatedSymbol(
+      llvm::pointerToJITTargetAddress(&bench_putchard),
+      llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+  llvm::Error error = main.define(orc::absoluteSymbols(std::move(symbols)));
+  if (!error) {
+    auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        (*jit)->getDataLayout().getGlobalPrefix());
+    if (generator) {
+      main.addGenerator(std::move(*generator));
+    } else {
+      error = generator.takeError();
+    }
+  }
+  if (!error) error = (*jit)->addObjectFile(std::move(object));
+  if (error) {
+    llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "Error: ");
+    return nullptr;
+  }
+  return std::move(*jit);
+}
+
+/// Looks name up in jit; 0, after logging, if it is not there.
+llvm::JITTargetAddress lookup(orc::LLJIT &jit, const std::string &name) {
+  orc::ExecutionSession &session = jit.getExecutionSession();
+  orc::MangleAndInterner mangle(session, jit.getDataLayout());
+  auto found = session.lookup({&jit.getMainJITDylib()}, mangle(name));
+  if (!found) {
+    llvm::logAllUnhandledErrors(found.takeError(), llvm::errs(), "Error: ");
+    return 0;
+  }
+  return found->getAddress();
+}
+
+void write(llvm::json::OStream &json, const Kernel &kernel, unsigned level,
+           const char *compiler, const Measurement &measurement) {
+  auto count = [](const std::optional<uint64_t> &value) -> llvm::json::Value {
+    if (!value) return nullptr;
+    return static_cast<int64_t>(*value);
+  };
+  const Counters::Counts &counts = measurement.counts;
+
+  json.object([&] {
+    json.attribute("kernel", kernel.name);
+    json.attribute("compiler", compiler);
+    json.attribute("level", int64_t(level));
+    json.attribute("wall_ms", measurement.wall_ms);
+    json.attribute("cycles", count(counts[0]));
+    json.attribute("instructions", count(counts[1]));
+    if (counts[0] && counts[1] && *counts[0]) {
+      json.attribute("ipc", double(*counts[1]) / double(*counts[0]));
+    } else {
+      json.attribute("ipc", nullptr);
+    }
+    json.attribute("branch_misses", count(counts[2]));
+    json.attribute("cache_misses", count(counts[3]));
+    json.attribute("result", measurement.result);
+  });
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int repetitions = argc > 1 ? atoi(argv[1]) : 5;
+  std::string kali = argc > 2 ? argv[2] : KALI;
+  if (repetitions < 1) repetitions = 1;
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  char directory_template[] = "/tmp/bench-run.XXXXXX";
+  if (!mkdtemp(directory_template)) {
+    perror("Error: mkdtemp");
+    return 1;
+  }
+  std::string directory = directory_template;
+  std::string arith_path = directory + "/arith.kl";
+  std::ofstream(arith_path) << kArithSource;
+
+  Counters counters;
+  if (!counters.available()) {
+    fprintf(stderr,
+            "Warning: perf_event_open is not allowed; counting nothing\n");
+  }
+
+  int status = 0;
+  llvm::json::OStream json(llvm::outs(), 2);
+  json.objectBegin();
+  json.attribute("kali", kali);
+#ifdef __clang__
+  json.attribute("c++", "clang " __clang_version__);
+#else
+  json.attribute("c++", "gcc " __VERSION__);
+#endif
+  json.attribute("repetitions", repetitions);
+  json.attributeBegin("runs");
+  json.arrayBegin();
+
+  for (const Kernel &kernel : kKernels) {
+    std::string source = kernel.example ? std::string(EXAMPLES_DIR) + "/" +
+                                              kernel.example
+                                        : arith_path;
+    for (unsigned level = 0; level <= 3; level++) {
+      fprintf(stderr, "%s -O%u\n", kernel.name, level);
+      std::unique_ptr<llvm::MemoryBuffer> object =
+          compile(kali, directory, source, level);
+      std::unique_ptr<orc::LLJIT> jit;
+      if (object) jit = load(std::move(object));
+      llvm::JITTargetAddress address = jit ? lookup(*jit, kernel.name) : 0;
+      if (!address) {
+        status = 1;
+        break;
+      }
+
+      Measurement kali_run = median(kernel, address, counters, repetitions);
+      Measurement cxx_run = median(kernel, kernel.cxx(*kCxxKernels[level]),
+                                   counters, repetitions);
+      write(json, kernel, level, "kali", kali_run);
+      write(json, kernel, level, "c++", cxx_run);
+
+      double difference = std::fabs(kali_run.result - cxx_run.result);
+      if (difference > 1e-9 * std::fabs(cxx_run.result)) {
+        fprintf(stderr, "Warning: %s -O%u computes %.17g, and in C++ %.17g\n",
+                kernel.name, level, kali_run.result, cxx_run.result);
+      }
+    }
+    if (status) break;
+  }
+
+  json.arrayEnd();
+  json.attributeEnd();
+  json.objectEnd();
+  llvm::outs() << '\n';
+
+  remove(arith_path.c_str());
+  remove((directory + "/output.o").c_str());
+  rmdir(directory.c_str());
+  return status;
+}
@@ -0,0 +1,128 @@
+// Compares the bytecode VM (kali --backend=vm) against the LLVM JIT (Engine)
+// on small programs: time from source to the first result, and the time per
+// call once both are warm.
+//
+//     bench-vm [repetitions]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/engine.h"
+#include "kaleidoscope/lexer.h"
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/vm.h"
+
+namespace {
+
+struct Workload {
+  const char *name;
+  const char *source;
+  const char *function;
+  double arg;
+};
+
+const Workload kWorkloads[] = {
+    {"fib", "def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);", "fib",
+     20},
+    {"poly",
+     "def poly(x) var y = x * x, z = y * x in "
+     "z * z - 3 * y * z + 2 * y - x / 7 + 11;",
+     "poly", 1.5},
+    {"loop", "def loop(n) for i = 0, i < n in sqrt(i) * i;", "loop", 1000},
+    {"calls",
+     "def sq(x) x * x;\n"
+     "def dist(x y) sqrt(sq(x) + sq(y));\n"
+     "def walk(n) for i = 0, i < n in dist(i, n - i);",
+     "walk", 1000},
+    // A zero step runs nothing, whichever way the bounds go.
+    {"zerostep", "def zerostep(n) sum i = 0, n, 0 in 1;", "zerostep", 10},
+    {"zeroback", "def zeroback(n) prod i = n, 0, 0 in 2;", "zeroback", 10},
+};
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_us(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+/// Median time per call, in nanoseconds, of repetitions batches of calls.
+template <class Fn>
+double steady_state_ns(Fn &&fn, int repetitions) {
+  // Enough calls per batch for the clock to be precise.
+  int calls = 1;
+  for (;;) {
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < calls; i++) fn();
+    if (elapsed_us(start) > 1000) break;
+    calls *= 2;
+  }
+
+  std::vector<double> times;
+  for (int r = 0; r < repetitions; r++) {
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < calls; i++) fn();
+    times.push_back(elapsed_us(start) * 1000 / calls);
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int repetitions = argc > 1 ? atoi(argv[1]) : 11;
+
+  printf("%-8s %14s %14s %14s %14s %10s\n", "", "vm first (us)",
+         "llvm first (us)", "vm (ns/call)", "llvm (ns/call)", "vm/llvm");
+
+  for (const Workload &workload : kWorkloads) {
+    // Time to first result: source to value, everything included. The first
+    // Engine also pays for initializing the native target.
+    Clock::time_point start = Clock::now();
+    Lexer lexer(std::make_unique<std::istringstream>(workload.source));
+    Parser parser;
+    Program program = parser.program(lexer);
+    std::unique_ptr<vm::Bytecode> bytecode = vm::Compiler::compile(program);
+    if (!bytecode) return 1;
+    vm::Machine machine(*bytecode);
+    size_t function = bytecode->lookup(workload.function);
+    double vm_result;
+    machine.call(function, {workload.arg}, vm_result);
+    double vm_first = elapsed_us(start);
+
+    start = Clock::now();
+    Engine engine;
+    Engine::HandlePtr handle = engine.compile(workload.source);
+    if (!handle) return 1;
+    auto *jitted = handle->lookup<double(double)>(workload.function);
+    double llvm_result = jitted(workload.arg);
+    double llvm_first = elapsed_us(start);
+
+    if (vm_result != llvm_result) {
+      fprintf(stderr, "Error: %s: vm gives %g, llvm %g\n", workload.name,
+              vm_result, llvm_result);
+      return 1;
+    }
+
+    std::vector<double> args{workload.arg};
+    double vm_ns = steady_state_ns(
+        [&]() {
+          double result;
+          machine.call(function, args, result);
+        },
+        repetitions);
+    volatile double sink;
+    double llvm_ns =
+        steady_state_ns([&]() { sink = jitted(workload.arg); }, repetitions);
+
+    printf("%-8s %14.1f %14.1f %14.1f %14.1f %10.1f\n", workload.name,
+           vm_first, llvm_first, vm_ns, llvm_ns, vm_ns / llvm_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/// BoundedQueue - Hands values from the threads of one stage of a pipeline to
+/// those of the next. Holds at most capacity values, so a stage that runs
+/// ahead of the next waits rather than piling up its output.
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  /// Adds value, waiting while the queue is full.
+  void push(T value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return values_.size() < capacity_; });
+    values_.push_back(std::move(value));
+    not_empty_.notify_one();
+  }
+
+  /// Takes the oldest value, waiting while the queue is empty. Returns nullopt
+  /// once the queue is closed and empty.
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return !values_.empty() || closed_; });
+    if (values_.empty()) return std::nullopt;
+    T value = std::move(values_.front());
+    values_.pop_front();
+    not_full_.notify_one();
+    return value;
+  }
+
+  /// Marks the end of the values: pop() returns nullopt after the last.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> values_;
+  bool closed_ = false;
+};
@@ -0,0 +1,131 @@
+#include "build_cache.h"
+
+#include <chrono>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+
+namespace {
+
+// pruneCache() only ever deletes files named like this, so a mistyped
+// --cache-dir cannot lose anything else.
+constexpr const char *kEntryPrefix = "llvmcache-";
+
+}  // namespace
+
+void BuildCache::Stats::print(llvm::raw_ostream &out) const {
+  out << "cache: " << hits << " hits, " << misses << " misses, " << evicted
+      << " evicted, " << size << " bytes\n";
+}
+
+BuildCache::BuildCache(std::string directory, uint64_t max_size)
+    : directory_(std::move(directory)), max_size_(max_size) {}
+
+std::unique_ptr<BuildCache> BuildCache::open(const std::string &directory,
+                                             uint64_t max_size) {
+  if (std::error_code error = llvm::sys::fs::create_directories(directory)) {
+    llvm::errs() << "Error: Could not create cache directory " << directory
+                 << ": " << error.message() << '\n';
+    return nullptr;
+  }
+  return std::unique_ptr<BuildCache>(new BuildCache(directory, max_size));
+}
+
+std::string BuildCache::key(const llvm::Module &module,
+                            llvm::StringRef options) {
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream out(bitcode);
+  llvm::WriteBitcodeToFile(module, out);
+
+  llvm::SHA1 hasher;
+  hasher.update(llvm::StringRef(bitcode.data(), bitcode.size()));
+  hasher.update(options);
+  return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> BuildCache::get(
+    const std::string &key, const std::string &name,
+    llvm::function_ref<bool(llvm::raw_pwrite_stream &)> compile) {
+  llvm::SmallString<128> path(directory_);
+  llvm::sys::path::append(path, kEntryPrefix + key);
+
+  int fd;
+  if (!llvm::sys::fs::openFileForRead(path, fd)) {
+    auto buffer = llvm::MemoryBuffer::getOpenFile(
+        llvm::sys::fs::convertFDToNativeFile(fd), name, /*FileSize=*/-1);
+    // Whether reading a file updates its access time depends on how the file
+    // system is mounted; prune() goes by it, so update it here.
+    llvm::sys::fs::setLastAccessAndModificationTime(
+        fd, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    if (buffer) {
+      stats_.hits++;
+      return std::move(*buffer);
+    }
+  }
+
+  stats_.misses++;
+  llvm::SmallVector<char, 0> object;
+  llvm::raw_svector_ostream out(object);
+  if (!compile(out)) return nullptr;
+
+  // Written to a temporary file, and renamed into place, so that a concurrent
+  // build never reads half an entry. Failing to is not an error of the build.
+  llvm::SmallString<128> model(directory_);
+  llvm::sys::path::append(model, "kali-%%%%%%%%.tmp");
+  llvm::Expected<llvm::sys::fs::TempFile> temp =
+      llvm::sys::fs::TempFile::create(model);
+  llvm::Error error = temp.takeError();
+  if (!error) {
+    llvm::raw_fd_ostream(temp->FD, /*shouldClose=*/false)
+        << llvm::StringRef(object.data(), object.size());
+    error = temp->keep(path);
+  }
+  if (error) {
+    llvm::errs() << "Warning: Could not write to cache: "
+                 << llvm::toString(std::move(error)) << '\n';
+  }
+
+  return llvm::MemoryBuffer::getMemBufferCopy(
+      llvm::StringRef(object.data(), object.size()), name);
+}
+
+void BuildCache::prune() {
+  size_t before = measure().first;
+
+  llvm::CachePruningPolicy policy;
+  // Every time, and by size alone: entries never go stale.
+  policy.Interval = std::chrono::seconds(0);
+  policy.Expiration = std::chrono::seconds(0);
+  policy.MaxSizeBytes = max_size_;
+  llvm::pruneCache(directory_, policy);
+
+  auto [entries, size] = measure();
+  // Concurrent builds may have added entries meanwhile.
+  stats_.evicted += before > entries ? before - entries : 0;
+  stats_.size = size;
+}
+
+std::pair<size_t, uint64_t> BuildCache::measure() const {
+  size_t entries = 0;
+  uint64_t size = 0;
+  std::error_code error;
+  for (llvm::sys::fs::directory_iterator it(directory_, error), end;
+       it != end && !error; it.increment(error)) {
+    if (!llvm::sys::path::filename(it->path()).startswith(kEntryPrefix)) {
+      continue;
+    }
+    llvm::ErrorOr<llvm::sys::fs::basic_file_status> status = it->status();
+    if (status) {
+      entries++;
+      size += status->getSize();
+    }
+  }
+  return {entries, size};
+}
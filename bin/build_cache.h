@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// An on-disk cache of object code (kali --cache-dir). An entry is keyed by a
+/// hash of the IR it was compiled from and of everything else that went into
+/// compiling it, so an entry is never stale; entries nobody asks for age out.
+/// Once the cache outgrows its size bound, the least recently used entries
+/// are evicted.
+class BuildCache {
+ public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evicted = 0;
+    /// Size on disk after the last prune().
+    uint64_t size = 0;
+
+    void print(llvm::raw_ostream &out) const;
+  };
+
+  /// open - Creates directory if need be. Returns nullptr, after logging, if
+  /// it cannot be used. A max_size of 0 does not bound the size.
+  static std::unique_ptr<BuildCache> open(const std::string &directory,
+                                          uint64_t max_size);
+
+  /// key - Hash of module and of options, which describes whatever else
+  /// determines the object code: the compiler, the target, and flags.
+  static std::string key(const llvm::Module &module, llvm::StringRef options);
+
+  /// get - The object code for key, from the cache, or else compiled by
+  /// compile into the stream it is given and added to the cache. The buffer
+  /// is named name. Returns nullptr, after logging, if compile returns false
+  /// or the cache cannot be written.
+  std::unique_ptr<llvm::MemoryBuffer> get(
+      const std::string &key, const std::string &name,
+      llvm::function_ref<bool(llvm::raw_pwrite_stream &)> compile);
+
+  /// prune - Evicts entries, least recently used first, down to the size
+  /// bound.
+  void prune();
+
+  const Stats &stats() const { return stats_; }
+
+ private:
+  BuildCache(std::string directory, uint64_t max_size);
+
+  /// Number and total size of the entries on disk.
+  std::pair<size_t, uint64_t> measure() const;
+
+  std::string directory_;
+  uint64_t max_size_;
+  Stats stats_;
+};
@@ -0,0 +1,97 @@
+#include "executable.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifdef HAVE_LLD
+#include "lld/Common/CommonLinkerContext.h"
+#include "lld/Common/Driver.h"
+#endif
+
+bool define_main(llvm::Module &module,
+                 const std::vector<llvm::Function *> &expressions) {
+  if (module.getFunction("main")) {
+    llvm::errs() << "kali: --emit=exe defines main, which the program "
+                    "already does\n";
+    return false;
+  }
+
+  llvm::LLVMContext &context = module.getContext();
+  llvm::IRBuilder<> builder(context);
+  llvm::Function *main = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getInt32Ty(), /*isVarArg=*/false),
+      llvm::Function::ExternalLinkage, "main", module);
+  builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", main));
+  for (llvm::Function *expression : expressions) {
+    builder.CreateCall(expression);
+  }
+  llvm::FunctionCallee flush =
+      module.getOrInsertFunction("kl_flush", builder.getVoidTy());
+  builder.CreateCall(flush);
+  builder.CreateRet(builder.getInt32(0));
+  return true;
+}
+
+bool link_executable(const std::string &object_path, const std::string &path) {
+  // As the C++ compiler driver links with -static, given the runtime.
+  const std::string libc_dir = LIBC_DIR;
+  const std::string gcc_dir = GCC_DIR;
+  std::vector<std::string> args = {"ld.lld",
+                                   "-static",
+                                   "-o",
+                                   path,
+                                   libc_dir + "/crt1.o",
+                                   libc_dir + "/crti.o",
+                                   gcc_dir + "/crtbeginT.o",
+                                   object_path,
+                                   KL_RUNTIME,
+                                   "-L" + gcc_dir,
+                                   "-L" + libc_dir,
+                                   "-lstdc++",
+                                   "-lm",
+                                   "--start-group",
+                                   "-lgcc",
+                                   "-lgcc_eh",
+                                   "-lc",
+                                   "--end-group",
+                                   gcc_dir + "/crtend.o",
+                                   libc_dir + "/crtn.o"};
+
+#ifdef HAVE_LLD
+  std::vector<const char *> lld_args;
+  for (const std::string &arg : args) lld_args.push_back(arg.c_str());
+  bool linked = lld::elf::link(lld_args, llvm::outs(), llvm::errs(),
+                               /*exitEarly=*/false, /*disableOutput=*/false);
+  lld::CommonLinkerContext::destroy();
+  if (!linked) {
+    llvm::errs() << "Error: Could not link " << path << '\n';
+    return false;
+  }
+  return true;
+#else
+  llvm::ErrorOr<std::string> linker = llvm::sys::findProgramByName("ld.lld");
+  if (!linker) linker = llvm::sys::findProgramByName("ld");
+  if (!linker) {
+    llvm::errs() << "Error: Could not find a linker to link " << path << '\n';
+    return false;
+  }
+
+  // Not what --emit=exe is for: the linker starts as a process of its own.
+  llvm::errs() << "Warning: kali was built without LLD; linking " << path
+               << " with " << *linker << '\n';
+  args[0] = *linker;
+  std::vector<llvm::StringRef> arg_refs(args.begin(), args.end());
+  std::string message;
+  int status = llvm::sys::ExecuteAndWait(*linker, arg_refs, /*Env=*/llvm::None,
+                                         /*Redirects=*/{}, /*SecondsToWait=*/0,
+                                         /*MemoryLimit=*/0, &message);
+  if (status != 0) {
+    llvm::errs() << "Error: Could not link " << path;
+    if (!message.empty()) llvm::errs() << ": " << message;
+    llvm::errs() << '\n';
+    return false;
+  }
+  return true;
+#endif
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+
+/// Building a program that runs on its own (kali --emit=exe): a main that
+/// runs the top-level expressions, linked statically against the kl runtime
+/// and libc, without the C compiler driver.
+
+/// define_main - Defines main in module, calling the functions of
+/// expressions in order, then flushing the output of the runtime, and
+/// returning 0. Returns false, after logging, if the program defines main
+/// itself.
+bool define_main(llvm::Module &module,
+                 const std::vector<llvm::Function *> &expressions);
+
+/// link_executable - Links the object at object_path into a static executable
+/// at path, with the kl runtime, libc, and the C++ library the runtime uses.
+/// Links in process with LLD if kali was built with it, and if not, warns and
+/// runs ld.lld, or failing that ld. Returns false, after logging, if linking
+/// fails.
+bool link_executable(const std::string &object_path, const std::string &path);
@@ -1,103 +1,306 @@
+#include <atomic>
 #include <cstdio>
+#include <map>
+#include <optional>
+#include <thread>
 
+#include "bin/bounded_queue.h"
+#include "bin/build_cache.h"
+#include "bin/executable.h"
+#include "bin/serve.h"
+#include "bin/shared_library.h"
+#include "bin/stats.h"
+#include "bin/vector_variants.h"
+#include "kaleidoscope/ast_file.h"
+#include "kaleidoscope/batch.h"
 #include "kaleidoscope/codegen_context.h"
 #include "kaleidoscope/lexer.h"
 #include "kaleidoscope/parser.h"
+#include "kaleidoscope/passes.h"
+#include "kaleidoscope/timing.h"
+#include "kaleidoscope/vm.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils.h"
 
-void repl(const std::string &source, CodegenContext &codegen_context) {
-  Lexer lexer(source);
-  Parser parser;
-  Atom symbol = lexer.read();
-  while (symbol != Atom::eof) {
-    switch (symbol) {
-      case Atom::eof: {
-        return;
-      } break;
-
-      case Atom::keyword_def: {
-        // Handle definition
-        DefinitionPtr def = parser.definition(lexer);
-        if (def) {
-          if (auto *ir = def->codegen(codegen_context)) {
-            // ir->print(llvm::errs());
-          }
-        } else {
-          lexer.read();
-        }
-      } break;
-
-      case Atom::keyword_extern: {
-        // Handle extern
-        PrototypePtr expr = Parser::extern_(lexer);
-        if (expr) {
-          if (auto *ir = expr->codegen(codegen_context)) {
-            // ir->print(llvm::errs());
-          }
-        } else {
-          lexer.read();
-        }
-      } break;
+namespace cl = llvm::cl;
 
-      case Atom::kComment: {
-      } break;
+namespace {
 
-      case Atom::semicolon: {
-        lexer.read();
-      } break;
+cl::OptionCategory kali_category("kali options");
 
-      case Atom::unknown: {
-      } break;
+cl::opt<std::string> input_file(cl::Positional, cl::desc("<input file>"),
+                                cl::cat(kali_category));
 
-      default: {
-        DefinitionPtr expr = parser.top(lexer);
-        if (expr) {
-          if (auto *ir = expr->codegen(codegen_context)) {
-            // ir->print(llvm::errs());
+// NOLINTNEXTLINE
+enum class Backend { llvm, vm };
 
-            // Remove anonymous expression
-            ir->eraseFromParent();
-          }
-        } else {
-          lexer.read();
-        }
-      } break;
-    }
+cl::opt<Backend> backend(
+    "backend", cl::desc("How to run the input file"),
+    cl::values(clEnumValN(Backend::llvm, "llvm",
+                          "Compile to an object file, output.o"),
+               clEnumValN(Backend::vm, "vm",
+                          "Evaluate the top-level expressions in a bytecode "
+                          "interpreter, without LLVM")),
+    cl::init(Backend::llvm), cl::cat(kali_category));
 
-    symbol = lexer.read();
-  }
-}
+cl::opt<bool> serve_requests(
+    "serve",
+    cl::desc("Run as a daemon evaluating requests in a warm JIT, instead of "
+             "compiling an input file"),
+    cl::cat(kali_category));
 
-int main(int argc, char **argv) {
-  (void)argc;
-  CodegenContext codegen_context("kaleidoscope");
+cl::opt<std::string> socket_path(
+    "socket",
+    cl::desc("Unix socket --serve listens on; stdin/stdout if unspecified"),
+    cl::value_desc("path"), cl::cat(kali_category));
 
-  std::string source(argv[1]);
+cl::opt<uint64_t> tier_up_threshold(
+    "tier-up-threshold",
+    cl::desc("With --serve, compile functions unoptimized first, and "
+             "recompile them optimized in the background once calls plus "
+             "loop iterations reach this count; 0 to optimize up front"),
+    cl::init(0), cl::cat(kali_category));
 
-  repl(source, codegen_context);
+// NOLINTNEXTLINE
+enum class Emit { obj, ast, exe };
 
-  llvm::Module &module = codegen_context.module();
+cl::opt<Emit> emit_type(
+    "emit", cl::desc("What to write"),
+    cl::values(clEnumValN(Emit::obj, "obj", "An object file, output.o"),
+               clEnumValN(Emit::ast, "ast",
+                          "The parsed program in a binary format, output.ast, "
+                          "which kali reads in place of the source"),
+               clEnumValN(Emit::exe, "exe",
+                          "A static executable, output, whose main runs the "
+                          "top-level expressions, linked against the kl "
+                          "runtime and libc")),
+    cl::init(Emit::obj), cl::cat(kali_category));
 
-  // Initialize the target registry etc.
-  llvm::InitializeAllTargetInfos();
-  llvm::InitializeAllTargets();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmParsers();
-  llvm::InitializeAllAsmPrinters();
+cl::opt<std::string> output_file(
+    "o",
+    cl::desc("Where to write the output, instead of output.o (output.so with "
+             "--shared, output.a with --cache-dir, output.ast with "
+             "--emit=ast, output with --emit=exe)"),
+    cl::value_desc("filename"), cl::cat(kali_category));
 
-  std::string target_triple = llvm::sys::getDefaultTargetTriple();
-  module.setTargetTriple(target_triple);
+cl::opt<bool> shared(
+    "shared",
+    cl::desc("Link a position-independent shared library, in which only the "
+             "exported defs are visible"),
+    cl::cat(kali_category));
+
+cl::list<std::string> exports(
+    "export", cl::CommaSeparated,
+    cl::desc("With --shared, the defs the library exports; all of them if "
+             "unspecified. With --whole-program, the defs that stay external"),
+    cl::value_desc("name,..."), cl::cat(kali_category));
+
+cl::opt<bool> whole_program(
+    "whole-program",
+    cl::desc("Take the input to be the whole program: only the --export defs, "
+             "the --vector-variants and --batch functions, and main with "
+             "--emit=exe, stay external, and all else becomes internal and "
+             "uses fastcc, for unused defs to be dropped and the rest inlined "
+             "and specialized"),
+    cl::cat(kali_category));
+
+cl::opt<std::string> header_file(
+    "header",
+    cl::desc("Write a C and C++ header declaring the exported defs to this "
+             "file"),
+    cl::value_desc("filename"), cl::cat(kali_category));
+
+cl::list<std::string> vector_variants(
+    "vector-variants", cl::CommaSeparated,
+    cl::desc("Defs of f64 arguments to also define vector variants of, which "
+             "take 2, 4 or 8 doubles per call under the x86-64 vector "
+             "function ABI (_ZGV...)"),
+    cl::value_desc("name,..."), cl::cat(kali_category));
+
+cl::list<std::string> batch_kernels(
+    "batch", cl::CommaSeparated,
+    cl::desc("Defs of f64 arguments to also define batch kernels of, "
+             "name_batch(const double *const *cols, double *out, size_t n), "
+             "evaluating them over n rows of columns"),
+    cl::value_desc("name,..."), cl::cat(kali_category));
+
+cl::opt<uint64_t> batch_chunk_rows(
+    "batch-chunk",
+    cl::desc("Split the rows of batch kernels into chunks of this many, run "
+             "by the threads of the parfor pool; 0 to run them all on the "
+             "calling thread"),
+    cl::value_desc("rows"), cl::init(0), cl::cat(kali_category));
+
+cl::opt<bool> fast_compile(
+    "fast-compile",
+    cl::desc("Compile for the least latency rather than the best code: -O0 "
+             "unless another level is given, FastISel, no debug info, value "
+             "names or verifier, and only the native target"),
+    cl::cat(kali_category));
+
+cl::opt<unsigned> optimization_level(
+    "O", cl::Prefix,
+    cl::desc("Optimization level: 0 for none, 1 for kali's own pipeline, 2 "
+             "and 3 for LLVM's standard ones"),
+    cl::value_desc("level"), cl::init(1), cl::cat(kali_category));
+
+// NOLINTNEXTLINE
+enum class VectorLibrary { none, libmvec, svml };
+
+cl::opt<VectorLibrary> vector_library(
+    "veclib",
+    cl::desc("Vector math library that vectorized loops call, and which is "
+             "recorded as a dependent library of the object"),
+    cl::values(clEnumValN(VectorLibrary::none, "none", "No vector library"),
+               clEnumValN(VectorLibrary::libmvec, "libmvec",
+                          "GLIBC vector math library (libmvec)"),
+               clEnumValN(VectorLibrary::svml, "svml",
+                          "Intel short vector math library (libsvml)")),
+    cl::init(VectorLibrary::none), cl::cat(kali_category));
+
+cl::opt<std::string> cache_dir(
+    "cache-dir",
+    cl::desc("Compile each function on its own, keeping its object code in "
+             "this directory for builds in which it is unchanged. Writes an "
+             "archive, output.a, instead of output.o"),
+    cl::value_desc("directory"), cl::cat(kali_category));
+
+cl::opt<uint64_t> cache_size(
+    "cache-size",
+    cl::desc("With --cache-dir, evict the least recently used objects once the "
+             "cache is larger than this many bytes; 0 for no bound"),
+    cl::init(uint64_t(1) << 30), cl::cat(kali_category));
+
+cl::opt<bool> cache_stats(
+    "cache-stats",
+    cl::desc("With --cache-dir, print cache hits, misses and evictions"),
+    cl::cat(kali_category));
+
+cl::opt<bool> pipeline(
+    "pipeline",
+    cl::desc("Compile each function on its own, parsing, generating code, and "
+             "optimizing and emitting it on threads of their own, so that the "
+             "phases overlap. Writes an archive, output.a, instead of "
+             "output.o"),
+    cl::cat(kali_category));
+
+cl::opt<unsigned> jobs(
+    "jobs",
+    cl::desc("With --pipeline, the number of threads optimizing and emitting "
+             "functions; 0 for one per hardware thread"),
+    cl::init(0), cl::cat(kali_category));
+
+cl::opt<bool> time_report(
+    "time-report",
+    cl::desc("Print wall time, CPU time and peak RSS of each compiler phase "
+             "and top-level definition, and the time taken by each pass"),
+    cl::cat(kali_category));
+
+cl::opt<std::string> time_trace(
+    "time-trace",
+    cl::desc("Write a Chrome trace-event profile of the compilation, "
+             "including LLVM's own passes, to this file"),
+    cl::value_desc("filename"), cl::cat(kali_category));
+
+cl::opt<unsigned> time_trace_granularity(
+    "time-trace-granularity",
+    cl::desc("Minimum duration (in microseconds) of scopes recorded in the "
+             "--time-trace profile"),
+    cl::init(500), cl::cat(kali_category));
+
+cl::opt<std::string> stats_file(
+    "stats-file",
+    cl::desc("With --stats, write the statistics to this file rather than to "
+             "stdout"),
+    cl::value_desc("filename"), cl::cat(kali_category));
+
+cl::opt<std::string> profile_generate(
+    "profile-generate", cl::ValueOptional,
+    cl::desc("Instrument functions and branches with counters, which are "
+             "appended to this file (default.klprof if unspecified) when the "
+             "program exits"),
+    cl::value_desc("filename"), cl::cat(kali_category));
+
+cl::opt<std::string> profile_use(
+    "profile-use",
+    cl::desc("Annotate functions and branches with the counts in a profile "
+             "written by a --profile-generate build"),
+    cl::value_desc("filename"), cl::cat(kali_category));
+
+/// output_path - The -o file, or if there is none, default_path.
+std::string output_path(const std::string &default_path) {
+  return output_file.empty() ? default_path : output_file;
+}
+
+/// Configures library_info to map math calls to the vector variants of the
+/// chosen library.
+void add_vector_library(llvm::TargetLibraryInfoImpl &library_info) {
+  switch (vector_library) {
+    case VectorLibrary::none:
+      return;
+    case VectorLibrary::libmvec:
+      library_info.addVectorizableFunctionsFromVecLib(
+          llvm::TargetLibraryInfoImpl::LIBMVEC_X86);
+      return;
+    case VectorLibrary::svml:
+      library_info.addVectorizableFunctionsFromVecLib(
+          llvm::TargetLibraryInfoImpl::SVML);
+      return;
+  }
+}
+
+/// Asks the linker to pull the chosen vector library in.
+void link_vector_library(llvm::Module &module) {
+  const char *library = nullptr;
+  switch (vector_library) {
+    case VectorLibrary::none:
+      return;
+    case VectorLibrary::libmvec:
+      library = "mvec";
+      break;
+    case VectorLibrary::svml:
+      library = "svml";
+      break;
+  }
+
+  // Emitted as an ELF .deplibs entry, which lld links automatically.
+  llvm::LLVMContext &context = module.getContext();
+  module.getOrInsertNamedMetadata("llvm.dependent-libraries")
+      ->addOperand(
+          llvm::MDNode::get(context, llvm::MDString::get(context, library)));
+}
+
+/// Creates the TargetMachine for target_triple, or returns nullptr after
+/// logging.
+llvm::TargetMachine *create_target_machine(const std::string &target_triple) {
+  // Initialize the target registry etc. The default triple is the native one,
+  // which is all --fast-compile pays for.
+  if (fast_compile) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  } else {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+  }
 
   std::string error;
   const auto *target = llvm::TargetRegistry::lookupTarget(target_triple, error);
@@ -107,21 +310,574 @@ int main(int argc, char **argv) {
   // TargetRegistry or we have a bogus target triple.
   if (!target) {
     llvm::errs() << error;
-    return 1;
+    return nullptr;
   }
 
   std::string cpu = "generic";
   std::string features;
 
+  llvm::CodeGenOpt::Level codegen_level = llvm::CodeGenOpt::Default;
+  if (optimization_level == 0) {
+    codegen_level = llvm::CodeGenOpt::None;
+  } else if (optimization_level == 3) {
+    codegen_level = llvm::CodeGenOpt::Aggressive;
+  }
+
   llvm::TargetOptions target_options;
+  // Constructors (say, of --profile-generate) go in .init_array, which is
+  // what current ELF toolchains run; .ctors is no longer picked up.
+  target_options.UseInitArray = true;
   llvm::Optional<llvm::Reloc::Model> relocation_model;
+  if (shared) {
+    relocation_model = llvm::Reloc::PIC_;
+  }
   llvm::TargetMachine *target_machine = target->createTargetMachine(
-      target_triple, cpu, features, target_options, relocation_model);
+      target_triple, cpu, features, target_options, relocation_model,
+      llvm::None, codegen_level);
+  if (target_machine && fast_compile && optimization_level == 0) {
+    target_machine->setO0WantsFastISel(true);
+    target_machine->setFastISel(true);
+  }
+  return target_machine;
+}
+
+/// set_up_codegen - With --fast-compile, has codegen_context skip verifying
+/// functions, and its context drop the names of values.
+void set_up_codegen(CodegenContext &codegen_context) {
+  if (!fast_compile) return;
+  codegen_context.set_verify(false);
+  codegen_context.context().setDiscardValueNames(true);
+}
+
+/// optimize - Runs the pipeline of the -O level over module.
+void optimize(llvm::Module &module,
+              const llvm::TargetLibraryInfoImpl &library_info,
+              llvm::TargetMachine &target_machine) {
+  switch (optimization_level) {
+    case 0:
+      return;
+    case 2:
+      run_default_pipeline(module, llvm::OptimizationLevel::O2,
+                           &target_machine, &library_info);
+      return;
+    case 3:
+      run_default_pipeline(module, llvm::OptimizationLevel::O3,
+                           &target_machine, &library_info);
+      return;
+  }
+
+  // The standard pipelines above run these already.
+  if (whole_program) {
+    run_interprocedural_passes(module, &target_machine, &library_info);
+  }
+
+  llvm::legacy::PassManager pass;
+  pass.add(new llvm::TargetLibraryInfoWrapperPass(library_info));
+  pass.add(llvm::createTargetTransformInfoWrapperPass(
+      target_machine.getTargetIRAnalysis()));
+
+  add_optimization_passes(pass);
+
+  pass.run(module);
+}
+
+/// emit - Writes the object code of module to output. Returns false, after
+/// logging, if the target cannot.
+bool emit(llvm::Module &module, const llvm::TargetLibraryInfoImpl &library_info,
+          llvm::TargetMachine &target_machine,
+          llvm::raw_pwrite_stream &output) {
+  llvm::legacy::PassManager pass;
+  pass.add(new llvm::TargetLibraryInfoWrapperPass(library_info));
+
+  llvm::CodeGenFileType filetype = llvm::CGFT_ObjectFile;
+  if (target_machine.addPassesToEmitFile(pass, output, nullptr, filetype)) {
+    llvm::errs() << "target_machine can't emit a file of this type";
+    return false;
+  }
+
+  pass.run(module);
+  return true;
+}
+
+}  // namespace
+
+/// read_program - Parses the file at path, or if it is named *.ast, loads the
+/// binary AST in it (--emit=ast). Returns nullopt, after logging, if it cannot
+/// be loaded.
+std::optional<Program> read_program(const std::string &path,
+                                    TimeReport *report) {
+  if (llvm::StringRef(path).endswith(".ast")) {
+    TimeScope scope(report, "load", path);
+    std::unique_ptr<ast_file::File> file = ast_file::File::open(path);
+    if (!file) return std::nullopt;
+    return file->program();
+  }
+
+  TimeScope scope(report, "parse", path);
+  Lexer lexer(path);
+  Parser parser;
+  return parser.program(lexer);
+}
+
+/// repl - Generates the items of program. Top-level expressions are only
+/// checked, unless expressions is given, in which case they are kept, renamed
+/// apart and internal, and added to it in order (--emit=exe).
+void repl(const Program &program, CodegenContext &codegen_context,
+          TimeReport *report, CompileStats *stats,
+          std::vector<llvm::Function *> *expressions = nullptr) {
+  TimeScope scope(report, "codegen");
+  for (const TopLevel &item : program) {
+    TimeScope item_scope(report, "codegen", item.prototype()->name());
+    CodegenContext::Lookups lookups = codegen_context.lookups();
+    llvm::Function *ir = item.codegen(codegen_context);
+    if (stats) {
+      stats->add_lookups(item.prototype()->name(), lookups,
+                         codegen_context.lookups());
+    }
+    if (!ir || item.kind() != TopLevel::Kind::expression) continue;
+    if (expressions) {
+      // Anonymous expressions are all called main; make them unique.
+      ir->setName("__kl_expr." + std::to_string(expressions->size()));
+      ir->setLinkage(llvm::Function::InternalLinkage);
+      expressions->push_back(ir);
+    } else {
+      // Remove anonymous expression
+      ir->eraseFromParent();
+    }
+  }
+}
+
+int write_ast(TimeReport *report) {
+  std::optional<Program> program = read_program(input_file, report);
+  if (!program) return 1;
+
+  TimeScope scope(report, "write");
+  return ast_file::Writer::write(*program, output_path("output.ast")) ? 0 : 1;
+}
+
+int interpret(TimeReport *report) {
+  std::optional<Program> program = read_program(input_file, report);
+  if (!program) return 1;
+
+  std::unique_ptr<vm::Bytecode> bytecode;
+  {
+    TimeScope scope(report, "lower");
+    bytecode = vm::Compiler::compile(*program);
+  }
+  if (!bytecode) return 1;
+
+  TimeScope scope(report, "run");
+  vm::Machine machine(*bytecode);
+  return machine.run() ? 0 : 1;
+}
+
+/// write_archive - Archives objects, in order, into output.a. Returns false,
+/// after logging, if it cannot be written.
+bool write_archive(
+    const std::vector<std::unique_ptr<llvm::MemoryBuffer>> &objects,
+    TimeReport *report) {
+  TimeScope scope(report, "archive");
+  std::vector<llvm::NewArchiveMember> members;
+  for (const auto &object : objects) {
+    members.emplace_back(object->getMemBufferRef());
+  }
+  std::string path = output_path("output.a");
+  if (llvm::Error error = llvm::writeArchive(
+          path, members, /*WriteSymtab=*/true, llvm::object::Archive::K_GNU,
+          /*Deterministic=*/true, /*Thin=*/false)) {
+    llvm::errs() << "Could not write " << path << ": "
+                 << llvm::toString(std::move(error)) << '\n';
+    return false;
+  }
+  return true;
+}
+
+/// compile_cached - Compiles each function into a module and an object of its
+/// own, reusing the objects of unchanged functions from the cache, and
+/// archives the objects into output.a (--cache-dir).
+///
+/// A function is looked up by a hash of its unoptimized IR, rather than of its
+/// AST, since the IR also captures the signatures of what it calls. The IR
+/// includes debug locations, so a function that moves to other lines is built
+/// again. The pipeline does not inline, so no code crosses functions.
+int compile_cached(TimeReport *report) {
+  if (profile_generate.getNumOccurrences() || !profile_use.empty()) {
+    llvm::errs() << "kali: --cache-dir does not support profiles\n";
+    return 1;
+  }
+
+  std::unique_ptr<BuildCache> cache = BuildCache::open(cache_dir, cache_size);
+  if (!cache) return 1;
+
+  std::optional<Program> program = read_program(input_file, report);
+  if (!program) return 1;
+
+  std::string target_triple = llvm::sys::getDefaultTargetTriple();
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  {
+    TimeScope scope(report, "target");
+    target_machine.reset(create_target_machine(target_triple));
+  }
+  if (!target_machine) return 1;
+
+  llvm::TargetLibraryInfoImpl library_info{llvm::Triple(target_triple)};
+  add_vector_library(library_info);
+
+  // What goes into the object code besides the IR.
+  std::string options;
+  llvm::raw_string_ostream(options)
+      << "kali " << LLVM_VERSION_STRING << ' ' << target_triple << ' '
+      << target_machine->getTargetCPU() << ' '
+      << target_machine->getTargetFeatureString() << ' '
+      << static_cast<int>(vector_library.getValue()) << " -O"
+      << optimization_level;
+
+  CodegenContext::Externals externals;
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects;
+  for (const TopLevel &item : *program) {
+    const function::Prototype *prototype = item.prototype();
+    if (item.kind() == TopLevel::Kind::extern_) {
+      externals.emplace(prototype->name(),
+                        CodegenContext::External{prototype, false});
+      continue;
+    }
+
+    // A context of its own, too: compiling registers metadata kinds with the
+    // context, which bitcode records, so a shared one would make keys depend
+    // on what was compiled before.
+    CodegenContext codegen_context("kaleidoscope",
+                                   /*debug_info=*/!fast_compile);
+    set_up_codegen(codegen_context);
+    codegen_context.set_externals(&externals);
+    llvm::Module &module = codegen_context.module();
+    module.setTargetTriple(target_triple);
+    module.setDataLayout(target_machine->createDataLayout());
+
+    llvm::Function *ir = nullptr;
+    {
+      TimeScope scope(report, "codegen", prototype->name());
+      ir = item.codegen(codegen_context);
+    }
+    // As in an uncached build, top-level expressions are only checked.
+    if (!ir || item.kind() == TopLevel::Kind::expression) continue;
+    externals.insert_or_assign(prototype->name(),
+                               CodegenContext::External{prototype, true});
+
+    codegen_context.debug_info_builder().finalize();
+    link_vector_library(module);
+
+    std::unique_ptr<llvm::MemoryBuffer> object = cache->get(
+        BuildCache::key(module, options), prototype->name() + ".o",
+        [&](llvm::raw_pwrite_stream &output) {
+          {
+            TimeScope scope(report, "optimize", prototype->name());
+            optimize(module, library_info, *target_machine);
+          }
+          TimeScope scope(report, "emit", prototype->name());
+          return emit(module, library_info, *target_machine, output);
+        });
+    if (!object) return 1;
+    objects.push_back(std::move(object));
+  }
+
+  if (!write_archive(objects, report)) return 1;
+
+  cache->prune();
+  if (cache_stats) {
+    cache->stats().print(llvm::errs());
+  }
+  return 0;
+}
+
+/// compile_pipelined - Compiles each function into a module and an object of
+/// its own, as compile_cached does, in a pipeline of threads: one parses the
+/// file, one generates a module for each function as it is parsed, and --jobs
+/// workers optimize and emit the modules. Bounded queues between the stages
+/// hold back those that run ahead, so the phases overlap, and the build takes
+/// about as long as its slowest stage rather than all of them. The objects are
+/// archived, in source order, into output.a (--pipeline).
+int compile_pipelined(TimeReport *report) {
+  if (profile_generate.getNumOccurrences() || !profile_use.empty() ||
+      !cache_dir.empty() || shared || !header_file.empty() ||
+      !vector_variants.empty() || !batch_kernels.empty()) {
+    llvm::errs() << "kali: --pipeline does not support profiles, "
+                    "--cache-dir, --shared, --header, --vector-variants or "
+                    "--batch\n";
+    return 1;
+  }
 
-  llvm::DataLayout data_layout = target_machine->createDataLayout();
-  module.setDataLayout(data_layout);
+  unsigned workers = jobs ? jobs.getValue()
+                          : std::max(1U, std::thread::hardware_concurrency());
+
+  // A target machine for each worker: emitting is not safe to share.
+  std::string target_triple = llvm::sys::getDefaultTargetTriple();
+  std::vector<std::unique_ptr<llvm::TargetMachine>> target_machines;
+  {
+    TimeScope scope(report, "target");
+    for (unsigned i = 0; i < workers; i++) {
+      target_machines.emplace_back(create_target_machine(target_triple));
+      if (!target_machines.back()) return 1;
+    }
+  }
+
+  llvm::TargetLibraryInfoImpl library_info{llvm::Triple(target_triple)};
+  add_vector_library(library_info);
+  llvm::DataLayout data_layout = target_machines.front()->createDataLayout();
+
+  // A function's module, and where its object goes in the archive.
+  struct Generated {
+    size_t index;
+    std::string name;
+    std::unique_ptr<CodegenContext> codegen_context;
+  };
+
+  // Items are small next to their modules, so more of them are let through.
+  BoundedQueue<TopLevel> parsed(64);
+  BoundedQueue<Generated> generated(2 * workers);
+  std::atomic<bool> failed{false};
+  std::mutex objects_mutex;
+  std::map<size_t, std::unique_ptr<llvm::MemoryBuffer>> objects;
+
+  // The time trace keeps a profiler for each thread.
+  auto spawn = [](auto body) {
+    return std::thread([body]() {
+      if (!time_trace.empty()) {
+        llvm::timeTraceProfilerInitialize(time_trace_granularity, "kali");
+      }
+      body();
+      if (!time_trace.empty()) llvm::timeTraceProfilerFinishThread();
+    });
+  };
+
+  std::vector<std::thread> threads;
+  TimeScope pipeline_scope(report, "pipeline");
+
+  threads.push_back(spawn([&]() {
+    if (llvm::StringRef(input_file).endswith(".ast")) {
+      TimeScope scope(report, "load", input_file);
+      std::unique_ptr<ast_file::File> file = ast_file::File::open(input_file);
+      if (file) {
+        for (TopLevel &item : file->program()) parsed.push(std::move(item));
+      } else {
+        failed = true;
+      }
+    } else {
+      TimeScope scope(report, "parse", input_file);
+      Lexer lexer(input_file);
+      Parser parser;
+      parser.program(lexer,
+                     [&](TopLevel item) { parsed.push(std::move(item)); });
+    }
+    parsed.close();
+  }));
+
+  threads.push_back(spawn([&]() {
+    // The items so far, whose prototypes externals points to.
+    Program program;
+    CodegenContext::Externals externals;
+    size_t index = 0;
+    while (std::optional<TopLevel> item = parsed.pop()) {
+      program.push_back(std::move(*item));
+      const TopLevel &top = program.back();
+      const function::Prototype *prototype = top.prototype();
+      if (top.kind() == TopLevel::Kind::extern_) {
+        externals.emplace(prototype->name(),
+                          CodegenContext::External{prototype, false});
+        continue;
+      }
+
+      auto codegen_context = std::make_unique<CodegenContext>(
+          "kaleidoscope", /*debug_info=*/!fast_compile);
+      set_up_codegen(*codegen_context);
+      codegen_context->set_externals(&externals);
+      llvm::Module &module = codegen_context->module();
+      module.setTargetTriple(target_triple);
+      module.setDataLayout(data_layout);
+
+      llvm::Function *ir = nullptr;
+      {
+        TimeScope scope(report, "codegen", prototype->name());
+        ir = top.codegen(*codegen_context);
+      }
+      // As in an unpipelined build, top-level expressions are only checked.
+      if (!ir || top.kind() == TopLevel::Kind::expression) continue;
+      externals.insert_or_assign(prototype->name(),
+                                 CodegenContext::External{prototype, true});
+
+      codegen_context->debug_info_builder().finalize();
+      link_vector_library(module);
+      generated.push({index++, prototype->name(), std::move(codegen_context)});
+    }
+    generated.close();
+  }));
+
+  for (unsigned i = 0; i < workers; i++) {
+    threads.push_back(spawn([&, i]() {
+      llvm::TargetMachine &target_machine = *target_machines[i];
+      while (std::optional<Generated> function = generated.pop()) {
+        llvm::Module &module = function->codegen_context->module();
+        {
+          TimeScope scope(report, "optimize", function->name);
+          optimize(module, library_info, target_machine);
+        }
+
+        llvm::SmallVector<char, 0> buffer;
+        llvm::raw_svector_ostream output(buffer);
+        {
+          TimeScope scope(report, "emit", function->name);
+          if (!emit(module, library_info, target_machine, output)) {
+            failed = true;
+            continue;
+          }
+        }
+        auto object = std::make_unique<llvm::SmallVectorMemoryBuffer>(
+            std::move(buffer), function->name + ".o");
+        std::lock_guard<std::mutex> lock(objects_mutex);
+        objects.emplace(function->index, std::move(object));
+      }
+    }));
+  }
+
+  for (std::thread &thread : threads) thread.join();
+  if (failed) return 1;
+
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> archived;
+  for (auto &[index, object] : objects) archived.push_back(std::move(object));
+  return write_archive(archived, report) ? 0 : 1;
+}
+
+/// compile - Compiles the program into a single module, and writes its object
+/// code, or with --shared, a shared library, or with --emit=exe, an
+/// executable. Records what was generated into stats, if given (--stats).
+int compile(TimeReport *report, CompileStats *stats) {
+  if (pipeline) {
+    return compile_pipelined(report);
+  }
+
+  if (!cache_dir.empty()) {
+    return compile_cached(report);
+  }
+
+  // What the heap holds at each step, for the memory of --stats.
+  int64_t heap_start = stats ? heap_in_use() : 0;
+  CodegenContext codegen_context("kaleidoscope",
+                                 /*debug_info=*/!fast_compile);
+  set_up_codegen(codegen_context);
+
+  if (profile_generate.getNumOccurrences()) {
+    std::string path = profile_generate;
+    codegen_context.instrument_profile(path.empty() ? "default.klprof" : path);
+  }
+
+  std::unique_ptr<Profile> profile;
+  if (!profile_use.empty()) {
+    profile = Profile::read(profile_use);
+    if (!profile) return 1;
+    codegen_context.use_profile(profile.get());
+  }
+
+  int64_t heap_parse = stats ? heap_in_use() : 0;
+  std::optional<Program> program = read_program(input_file, report);
+  if (!program) return 1;
+  int64_t heap_codegen = stats ? heap_in_use() : 0;
+
+  std::optional<std::set<std::string>> exported =
+      exported_functions(*program, exports);
+  if (!exported) return 1;
+  std::optional<std::set<std::string>> vectorized =
+      f64_functions(*program, vector_variants, "--vector-variants");
+  if (!vectorized) return 1;
+  std::optional<std::set<std::string>> batched =
+      f64_functions(*program, batch_kernels, "--batch");
+  if (!batched) return 1;
+
+  bool executable = emit_type == Emit::exe;
+  std::vector<llvm::Function *> expressions;
+  repl(*program, codegen_context, report, stats,
+       executable ? &expressions : nullptr);
+  codegen_context.finalize_profile();
+
+  llvm::Module &module = codegen_context.module();
+  if (executable && !define_main(module, expressions)) return 1;
+  if (stats) {
+    stats->memory.ast = heap_codegen - heap_parse;
+    stats->memory.context_generated =
+        (heap_parse - heap_start) + (heap_in_use() - heap_codegen);
+    stats->count_ast(*program);
+  }
+
+  std::string target_triple = llvm::sys::getDefaultTargetTriple();
+  llvm::TargetMachine *target_machine = nullptr;
+  {
+    TimeScope scope(report, "target");
+    target_machine = create_target_machine(target_triple);
+    if (!target_machine) return 1;
+
+    module.setTargetTriple(target_triple);
+    llvm::DataLayout data_layout = target_machine->createDataLayout();
+    module.setDataLayout(data_layout);
+  }
+
+  // With --whole-program, what stays external: the --export defs, main, and
+  // the vector variants and batch kernels asked for by name, whether or not
+  // their defs are exported too.
+  std::set<std::string> kept(exports.begin(), exports.end());
+  if (executable) kept.insert("main");
+
+  if (!vectorized->empty()) {
+    if (llvm::Triple(target_triple).getArch() != llvm::Triple::x86_64) {
+      llvm::errs() << "kali: --vector-variants needs an x86-64 target\n";
+      return 1;
+    }
+    TimeScope scope(report, "vector variants");
+    for (const TopLevel &item : *program) {
+      const std::string &name = item.prototype()->name();
+      if (item.kind() != TopLevel::Kind::definition ||
+          !vectorized->count(name)) {
+        continue;
+      }
+      std::vector<std::string> variants = add_vector_variants(
+          codegen_context, *item.prototype(), *target_machine);
+      // Exported along with the function they vectorize.
+      if (exported->count(name) || whole_program) {
+        exported->insert(variants.begin(), variants.end());
+      }
+      kept.insert(variants.begin(), variants.end());
+    }
+  }
+
+  if (!batched->empty()) {
+    TimeScope scope(report, "batch kernels");
+    for (const TopLevel &item : *program) {
+      const std::string &name = item.prototype()->name();
+      if (item.kind() != TopLevel::Kind::definition || !batched->count(name) ||
+          !batch_codegen(codegen_context, *item.prototype(),
+                         batch_chunk_rows)) {
+        continue;
+      }
+      if (exported->count(name) || whole_program) {
+        exported->insert(batch_name(name));
+      }
+      kept.insert(batch_name(name));
+    }
+  }
+
+  if (whole_program) internalize(module, kept);
+
+  // A shared library or an executable is linked from a temporary object file.
+  llvm::SmallString<128> filename(output_path("output.o"));
+  llvm::FileRemover object_remover;
+  if (shared || executable) {
+    if (std::error_code error_code =
+            llvm::sys::fs::createTemporaryFile("kali", "o", filename)) {
+      llvm::errs() << "Could not create temporary file: "
+                   << error_code.message() << '\n';
+      return 1;
+    }
+    object_remover.setFile(filename);
+    if (shared) make_shared(module, *exported);
+  }
 
-  std::string filename = "output.o";
   std::error_code error_code;
   llvm::raw_fd_ostream output(filename, error_code, llvm::sys::fs::OF_None);
 
@@ -130,31 +886,173 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  llvm::legacy::PassManager pass;
-  llvm::CodeGenFileType filetype = llvm::CGFT_ObjectFile;
-
-  // Promote allocas to registers.
-  pass.add(llvm::createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  pass.add(llvm::createInstructionCombiningPass());
-  // Reassociate expressions.
-  pass.add(llvm::createReassociatePass());
-  // Eliminate Common SubExpressions.
-  pass.add(llvm::createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  pass.add(llvm::createCFGSimplificationPass());
+  llvm::TargetLibraryInfoImpl library_info{llvm::Triple(target_triple)};
+  add_vector_library(library_info);
+  link_vector_library(module);
 
   llvm::DIBuilder &debug_info_builder = codegen_context.debug_info_builder();
   debug_info_builder.finalize();
 
-  if (target_machine->addPassesToEmitFile(pass, output, nullptr, filetype)) {
-    llvm::errs() << "target_machine can't emit a file of this type";
-    return 1;
+  if (stats) stats->count_ir(module, /*optimized=*/false);
+  int64_t heap_optimize = stats ? heap_in_use() : 0;
+  {
+    TimeScope scope(report, "optimize");
+    optimize(module, library_info, *target_machine);
+  }
+  if (stats) {
+    stats->count_ir(module, /*optimized=*/true);
+    stats->memory.context_optimized = stats->memory.context_generated +
+                                      (heap_in_use() - heap_optimize);
   }
 
-  pass.run(module);
-  module.print(llvm::errs(), nullptr);
+  // Emitted into memory, and written out in one go.
+  llvm::SmallVector<char, 0> object;
+  {
+    TimeScope scope(report, "emit");
+    llvm::raw_svector_ostream object_stream(object);
+    if (!emit(module, library_info, *target_machine, object_stream)) return 1;
+  }
+  output.write(object.data(), object.size());
   output.flush();
 
+  if (!fast_compile) module.print(llvm::errs(), nullptr);
+
+  if (shared) {
+    TimeScope scope(report, "link");
+    if (!link_shared(filename.str().str(), output_path("output.so"))) return 1;
+  }
+
+  if (executable) {
+    TimeScope scope(report, "link");
+    if (!link_executable(filename.str().str(), output_path("output"))) {
+      return 1;
+    }
+  }
+
+  if (!header_file.empty() &&
+      !write_header(*program, module, *exported, *vectorized, *batched,
+                    input_file, header_file)) {
+    return 1;
+  }
+
   return 0;
 }
+
+int main(int argc, char **argv) {
+  // --stats is LLVM's own, which turns on llvm::Statistic counters; kali
+  // reports them along with its own.
+  if (cl::Option *stats = cl::getRegisteredOptions().lookup("stats")) {
+    stats->addCategory(kali_category);
+    stats->setHiddenFlag(cl::NotHidden);
+    stats->setDescription(
+        "Report counts of AST nodes, lookups, and IR instructions and blocks "
+        "before and after optimization, memory use, and LLVM's pass "
+        "statistics, by function and in all, as JSON on stdout, apart from "
+        "the IR and reports kali prints to stderr");
+  }
+  cl::HideUnrelatedOptions(kali_category);
+  cl::ParseCommandLineOptions(argc, argv, "kaleidoscope compiler\n");
+  bool stats_enabled = llvm::AreStatisticsEnabled();
+
+  if (serve_requests) {
+    EngineOptions options;
+    options.tier_up_threshold = tier_up_threshold;
+    return serve(socket_path, options);
+  }
+
+  if (input_file.empty()) {
+    llvm::errs() << "kali: No input file\n";
+    return 1;
+  }
+
+  if (shared && !cache_dir.empty()) {
+    llvm::errs() << "kali: --shared does not support --cache-dir\n";
+    return 1;
+  }
+
+  if (!vector_variants.empty() && !cache_dir.empty()) {
+    llvm::errs() << "kali: --vector-variants does not support --cache-dir\n";
+    return 1;
+  }
+
+  if (!batch_kernels.empty() && !cache_dir.empty()) {
+    llvm::errs() << "kali: --batch does not support --cache-dir\n";
+    return 1;
+  }
+
+  if (emit_type == Emit::exe &&
+      (backend == Backend::vm || shared || !cache_dir.empty() || pipeline)) {
+    llvm::errs() << "kali: --emit=exe does not support --backend=vm, "
+                    "--shared, --cache-dir or --pipeline\n";
+    return 1;
+  }
+
+  if (whole_program && exports.empty() && emit_type != Emit::exe) {
+    llvm::errs() << "kali: --whole-program needs --export or --emit=exe, for "
+                    "something to stay external\n";
+    return 1;
+  }
+
+  if (whole_program &&
+      (backend == Backend::vm || !cache_dir.empty() || pipeline)) {
+    llvm::errs() << "kali: --whole-program needs a single-module LLVM build, "
+                    "without --backend=vm, --cache-dir or --pipeline\n";
+    return 1;
+  }
+
+  if (fast_compile && !optimization_level.getNumOccurrences()) {
+    optimization_level = 0;
+  }
+
+  if (stats_enabled &&
+      (backend == Backend::vm || emit_type == Emit::ast ||
+       !cache_dir.empty() || pipeline)) {
+    llvm::errs() << "kali: --stats needs a single-module LLVM build, without "
+                    "--backend=vm, --emit=ast, --cache-dir or --pipeline\n";
+    return 1;
+  }
+
+  if (optimization_level > 3) {
+    llvm::errs() << "kali: Invalid optimization level -O" << optimization_level
+                 << '\n';
+    return 1;
+  }
+
+  if (!time_trace.empty()) {
+    llvm::timeTraceProfilerInitialize(time_trace_granularity, argv[0]);
+  }
+
+  TimeReport report_storage;
+  TimeReport *report = time_report ? &report_storage : nullptr;
+  llvm::TimePassesIsEnabled = time_report;
+
+  CompileStats stats_storage;
+  CompileStats *stats = nullptr;
+  if (stats_enabled) stats = &stats_storage;
+
+  int status = 0;
+  if (emit_type == Emit::ast) {
+    status = write_ast(report);
+  } else {
+    status =
+        backend == Backend::vm ? interpret(report) : compile(report, stats);
+  }
+
+  if (stats && status == 0 && !stats->write(stats_file)) status = 1;
+
+  if (report) {
+    report->print(llvm::errs());
+    llvm::reportAndResetTimings(&llvm::errs());
+  }
+
+  if (!time_trace.empty()) {
+    if (llvm::Error error = llvm::timeTraceProfilerWrite(time_trace, "")) {
+      llvm::errs() << "Could not write time trace: "
+                   << llvm::toString(std::move(error)) << '\n';
+      status = 1;
+    }
+    llvm::timeTraceProfilerCleanup();
+  }
+
+  return status;
+}
@@ -0,0 +1,202 @@
+#include "serve.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "kaleidoscope/engine.h"
+
+namespace {
+
+/// Reads and writes frames on a file descriptor, buffering reads.
+class Connection {
+ public:
+  Connection(int in, int out) : in_(in), out_(out) {}
+
+  /// Reads the next frame into payload; false on end of input or error.
+  bool read(std::string &payload) {
+    std::string header;
+    char c = 0;
+    while (get(c) && c != '\n') {
+      header += c;
+    }
+    if (c != '\n') return false;
+
+    size_t length = 0;
+    auto result =
+        std::from_chars(header.data(), header.data() + header.size(), length);
+    if (result.ec != std::errc() || result.ptr != header.data() + header.size())
+      return false;
+
+    payload.clear();
+    payload.reserve(length);
+    while (payload.size() < length && get(c)) {
+      payload += c;
+    }
+    return payload.size() == length;
+  }
+
+  bool write(const std::string &payload) {
+    std::string frame = std::to_string(payload.size()) + '\n' + payload;
+    const char *data = frame.data();
+    size_t size = frame.size();
+    while (size > 0) {
+      ssize_t written = ::write(out_, data, size);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+ private:
+  bool get(char &c) {
+    if (begin_ == end_) {
+      ssize_t size = 0;
+      do {
+        size = ::read(in_, buffer_, sizeof(buffer_));
+      } while (size < 0 && errno == EINTR);
+      if (size <= 0) return false;
+      begin_ = 0;
+      end_ = size;
+    }
+    c = buffer_[begin_++];
+    return true;
+  }
+
+  int in_;
+  int out_;
+  char buffer_[4096];
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+std::string evaluate(Engine::Session &session, const std::string &source) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<double> values;
+  bool ok = session.evaluate(source, values);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  std::string response = ok ? "ok " : "error ";
+  response += std::to_string(elapsed.count()) + '\n';
+  for (double value : values) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    response.append(buffer, result.ptr);
+    response += '\n';
+  }
+  return response;
+}
+
+void serve_connection(Engine::Session &session, int in, int out) {
+  Connection connection(in, out);
+  std::string request;
+  while (connection.read(request)) {
+    if (!connection.write(evaluate(session, request))) break;
+  }
+}
+
+/// remove_stale_socket - Unlinks the socket at address left by a daemon that
+/// is gone, which refuses connections. Returns false, after logging, if
+/// something other than a socket is there, or a daemon still listens on it.
+bool remove_stale_socket(const sockaddr_un &address) {
+  const char *path = address.sun_path;
+  struct stat status;
+  if (lstat(path, &status) < 0) {
+    if (errno == ENOENT) return true;
+    fprintf(stderr, "Error: Could not stat %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if (!S_ISSOCK(status.st_mode)) {
+    fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+    return false;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0) {
+    fprintf(stderr, "Error: Could not probe %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  int connected = connect(probe, reinterpret_cast<const sockaddr *>(&address),
+                          sizeof(address));
+  int error = errno;
+  close(probe);
+  if (connected == 0) {
+    fprintf(stderr, "Error: A daemon is already listening on %s\n", path);
+    return false;
+  }
+  if (error != ECONNREFUSED) {
+    fprintf(stderr, "Error: Could not probe %s: %s\n", path, strerror(error));
+    return false;
+  }
+
+  if (unlink(path) < 0 && errno != ENOENT) {
+    fprintf(stderr, "Error: Could not remove %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int serve(const std::string &socket_path, const EngineOptions &options) {
+  Engine engine(options);
+  std::unique_ptr<Engine::Session> session = engine.create_session();
+  if (!session) return 1;
+
+  if (socket_path.empty()) {
+    serve_connection(*session, STDIN_FILENO, STDOUT_FILENO);
+    return 0;
+  }
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: Socket path too long: %s\n", socket_path.c_str());
+    return 1;
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  if (!remove_stale_socket(address)) return 1;
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    fprintf(stderr, "Error: Could not listen on %s: %s\n",
+            socket_path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  // A client going away mid-response is not fatal to the daemon.
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error: accept: %s\n", strerror(errno));
+      return 1;
+    }
+
+    std::thread([&session, client]() {
+      serve_connection(*session, client, client);
+      close(client);
+    }).detach();
+  }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+
+#include "kaleidoscope/engine.h"
+
+/// serve - Runs kali as an evaluation daemon (--serve). Requests are evaluated
+/// in one Engine::Session, so the target, the JIT and everything defined by
+/// earlier requests stay warm. Listens on the Unix socket at socket_path,
+/// serving each client on a thread of its own, or if socket_path is empty,
+/// reads requests from stdin and writes responses to stdout. A socket left at
+/// socket_path by a daemon that is gone is replaced; anything else there, or
+/// a daemon still listening, is an error.
+///
+/// Requests and responses are frames: the payload length in decimal, a
+/// newline, and the payload. A request payload is Kaleidoscope source. The
+/// response payload is a status line, `ok <microseconds>` or
+/// `error <microseconds>`, followed by the value of each top-level expression
+/// of the request, one per line. Error messages go to the daemon's stderr.
+int serve(const std::string &socket_path, const EngineOptions &options);
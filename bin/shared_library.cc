@@ -0,0 +1,202 @@
+#include "shared_library.h"
+
+#include <algorithm>
+#include <map>
+
+#include "kaleidoscope/batch.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+/// The C type of values of type.
+const char *c_type(ValueType type) {
+  switch (type) {
+    case ValueType::f64:
+      return "double";
+    case ValueType::f32:
+      return "float";
+    case ValueType::i64:
+      return "int64_t";
+    case ValueType::u64:
+      return "uint64_t";
+    case ValueType::bool_:
+      return "bool";
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+std::optional<std::set<std::string>> exported_functions(
+    const Program &program, const std::vector<std::string> &exports) {
+  std::set<std::string> defined;
+  for (const TopLevel &item : program) {
+    if (item.kind() == TopLevel::Kind::definition) {
+      defined.insert(item.prototype()->name());
+    }
+  }
+  if (exports.empty()) return defined;
+
+  std::set<std::string> exported;
+  for (const std::string &name : exports) {
+    if (!defined.count(name)) {
+      llvm::errs() << "kali: --export " << name << " is not a def\n";
+      return std::nullopt;
+    }
+    exported.insert(name);
+  }
+  return exported;
+}
+
+std::optional<std::set<std::string>> f64_functions(
+    const Program &program, const std::vector<std::string> &names,
+    const char *option) {
+  std::map<std::string, const function::Prototype *> defined;
+  for (const TopLevel &item : program) {
+    if (item.kind() == TopLevel::Kind::definition) {
+      defined.emplace(item.prototype()->name(), item.prototype());
+    }
+  }
+
+  std::set<std::string> functions;
+  for (const std::string &name : names) {
+    auto query = defined.find(name);
+    if (query == defined.end()) {
+      llvm::errs() << "kali: " << option << ' ' << name << " is not a def\n";
+      return std::nullopt;
+    }
+    if (query->second->typed()) {
+      llvm::errs() << "kali: " << option << ' ' << name
+                   << " takes or returns other than f64\n";
+      return std::nullopt;
+    }
+    functions.insert(name);
+  }
+  return functions;
+}
+
+void make_shared(llvm::Module &module, const std::set<std::string> &exported) {
+  module.setPICLevel(llvm::PICLevel::BigPIC);
+  for (llvm::GlobalValue &value : module.global_values()) {
+    if (value.isDeclaration() || value.hasLocalLinkage()) continue;
+    if (llvm::isa<llvm::Function>(value) &&
+        exported.count(value.getName().str())) {
+      value.setDSOLocal(true);
+    } else {
+      value.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+  }
+}
+
+bool link_shared(const std::string &object_path, const std::string &path) {
+  llvm::ErrorOr<std::string> driver = llvm::sys::findProgramByName("cc");
+  if (!driver) {
+    llvm::errs() << "Error: Could not find cc to link " << path << '\n';
+    return false;
+  }
+
+  // libm, for the math builtins that lower to calls.
+  llvm::StringRef args[] = {*driver, "-shared", "-o", path, object_path,
+                            "-lm"};
+  std::string message;
+  int status = llvm::sys::ExecuteAndWait(*driver, args, /*Env=*/llvm::None,
+                                         /*Redirects=*/{}, /*SecondsToWait=*/0,
+                                         /*MemoryLimit=*/0, &message);
+  if (status != 0) {
+    llvm::errs() << "Error: Could not link " << path;
+    if (!message.empty()) llvm::errs() << ": " << message;
+    llvm::errs() << '\n';
+    return false;
+  }
+  return true;
+}
+
+bool write_header(const Program &program, const llvm::Module &module,
+                  const std::set<std::string> &exported,
+                  const std::set<std::string> &vectorized,
+                  const std::set<std::string> &batched,
+                  const std::string &source, const std::string &path) {
+  std::error_code error_code;
+  llvm::raw_fd_ostream out(path, error_code, llvm::sys::fs::OF_Text);
+  if (error_code) {
+    llvm::errs() << "Could not open file: " << error_code.message() << '\n';
+    return false;
+  }
+
+  out << "/* Generated by kali from " << source << ". */\n"
+      << "#pragma once\n"
+      << "#include <stdbool.h>\n"
+      << "#include <stddef.h>\n"
+      << "#include <stdint.h>\n\n";
+
+  // The runtime functions the code calls, which the host provides.
+  std::vector<std::string> externs;
+  for (const TopLevel &item : program) {
+    const std::string &name = item.prototype()->name();
+    const llvm::Function *fn = module.getFunction(name);
+    if (item.kind() == TopLevel::Kind::extern_ && fn && !fn->use_empty()) {
+      externs.push_back(name);
+    }
+  }
+  if (!externs.empty()) {
+    out << "/* Calls, and leaves for the host to define:";
+    for (const std::string &name : externs) {
+      out << ' ' << name;
+    }
+    out << ". */\n\n";
+  }
+
+  // And those of the kl runtime that parfor, batch kernels split into chunks
+  // and profiling call, which the library leaves undefined as well.
+  std::vector<std::string> runtime;
+  for (const llvm::Function &fn : module) {
+    if (fn.isDeclaration() && !fn.use_empty() &&
+        fn.getName().startswith("kl_") &&
+        std::find(externs.begin(), externs.end(), fn.getName()) ==
+            externs.end()) {
+      runtime.push_back(fn.getName().str());
+    }
+  }
+  if (!runtime.empty()) {
+    out << "/* Calls, and leaves for the kl runtime to define, which the "
+           "host links\n   against (libkl.a, and the C++ library it uses):";
+    for (const std::string &name : runtime) {
+      out << ' ' << name;
+    }
+    out << ". */\n\n";
+  }
+
+  out << "#ifdef __cplusplus\n"
+      << "extern \"C\" {\n"
+      << "#endif\n\n";
+  for (const TopLevel &item : program) {
+    const function::Prototype *prototype = item.prototype();
+    const llvm::Function *fn = module.getFunction(prototype->name());
+    if (item.kind() != TopLevel::Kind::definition || !fn ||
+        fn->isDeclaration() || !exported.count(prototype->name())) {
+      continue;
+    }
+    // Both masked and unmasked variants, which kali defines for every ISA.
+    if (vectorized.count(prototype->name())) {
+      out << "#pragma omp declare simd\n";
+    }
+    // Without argument names, which may be C keywords.
+    out << c_type(prototype->return_type()) << ' ' << prototype->name() << '(';
+    const std::vector<ValueType> &types = prototype->types();
+    if (types.empty()) out << "void";
+    for (size_t i = 0; i < types.size(); i++) {
+      out << (i ? ", " : "") << c_type(types[i]);
+    }
+    out << ");\n";
+    if (batched.count(prototype->name())) {
+      out << "void " << batch_name(prototype->name())
+          << "(const double *const *, double *, size_t);\n";
+    }
+  }
+  out << "\n#ifdef __cplusplus\n"
+      << "}\n"
+      << "#endif\n";
+  return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/ast.h"
+#include "llvm/IR/Module.h"
+
+/// Building a shared library for a C or C++ host to link against (kali
+/// --shared), and the header declaring its functions (kali --header), in place
+/// of extern "C" declarations written by hand.
+
+/// exported_functions - The defs of program that the library exports: those
+/// named in exports, or all of them if it is empty. Returns nullopt, after
+/// logging, if exports names anything but a def.
+std::optional<std::set<std::string>> exported_functions(
+    const Program &program, const std::vector<std::string> &exports);
+
+/// f64_functions - The defs named in names, the value of the kali option
+/// option, all of which must take and return f64 only. Returns nullopt, after
+/// logging, if one is not such a def.
+std::optional<std::set<std::string>> f64_functions(
+    const Program &program, const std::vector<std::string> &names,
+    const char *option);
+
+/// make_shared - Readies module for a shared library: position-independent,
+/// with the exported functions visible, and all else it defines hidden. Calls
+/// within the library then go straight to the callee rather than through the
+/// PLT: hidden functions cannot be interposed, and exported ones are taken not
+/// to be, as with -fno-semantic-interposition.
+void make_shared(llvm::Module &module, const std::set<std::string> &exported);
+
+/// link_shared - Links the object at object_path into a shared library at
+/// path, with the C compiler driver. Runtime functions the code calls, say
+/// putchard, or kl_parallel_for for parfor, are left for the host to provide,
+/// from the kl runtime or its own. Returns false, after logging, if linking
+/// fails.
+bool link_shared(const std::string &object_path, const std::string &path);
+
+/// write_header - Writes a header declaring the exported functions of program
+/// that module defines, for C and C++, to path, and naming the functions it
+/// leaves undefined: the externs of program, and those of the kl runtime.
+/// Those in vectorized are declared `#pragma omp declare simd`, for hosts
+/// built with -fopenmp-simd to call their vector variants in loops. The batch
+/// kernels of those in batched are declared too. Returns false, after
+/// logging, if it cannot be written.
+bool write_header(const Program &program, const llvm::Module &module,
+                  const std::set<std::string> &exported,
+                  const std::set<std::string> &vectorized,
+                  const std::set<std::string> &batched,
+                  const std::string &source, const std::string &path);
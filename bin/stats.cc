@@ -0,0 +1,179 @@
+#include "bin/stats.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "kaleidoscope/timing.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+int64_t heap_in_use() {
+#if defined(__GLIBC__)
+  // Small blocks, and those large enough to be mapped on their own.
+  struct mallinfo2 info = mallinfo2();
+  return static_cast<int64_t>(info.uordblks + info.hblkhd);
+#else
+  return 0;
+#endif
+}
+
+CompileStats::Function &CompileStats::function(const std::string &name) {
+  auto inserted = functions_.try_emplace(name);
+  if (inserted.second) order_.push_back(name);
+  return inserted.first->second;
+}
+
+void CompileStats::count_ast(const Program &program) {
+  for (const TopLevel &item : program) {
+    // Top-level expressions share a name, and add up under it.
+    Function &counted = function(item.prototype()->name());
+    if (const function::Definition *definition = item.definition()) {
+      std::array<uint64_t, ast_file::kKinds> counts =
+          ast_file::Writer::count(*definition->body());
+      for (size_t kind = 0; kind < ast_file::kKinds; kind++) {
+        counted.ast[kind] += counts[kind];
+      }
+    }
+  }
+}
+
+void CompileStats::add_lookups(const std::string &name,
+                               const CodegenContext::Lookups &before,
+                               const CodegenContext::Lookups &after) {
+  Function &counted = function(name);
+  counted.lookups.variables += after.variables - before.variables;
+  counted.lookups.functions += after.functions - before.functions;
+}
+
+void CompileStats::count_ir(const llvm::Module &module, bool optimized) {
+  for (const llvm::Function &fn : module) {
+    if (fn.isDeclaration()) continue;
+    Ir ir;
+    ir.instructions = fn.getInstructionCount();
+    ir.blocks = fn.size();
+    for (const llvm::BasicBlock &block : fn) {
+      for (const llvm::Instruction &instruction : block) {
+        if (llvm::isa<llvm::AllocaInst>(instruction)) ir.allocas++;
+      }
+    }
+    Function &counted = function(fn.getName().str());
+    (optimized ? counted.optimized : counted.generated) = ir;
+  }
+}
+
+namespace {
+
+void write_ast(llvm::json::OStream &json,
+               const std::array<uint64_t, ast_file::kKinds> &counts) {
+  json.attributeObject("ast", [&]() {
+    for (size_t kind = 0; kind < ast_file::kKinds; kind++) {
+      json.attribute(ast_file::kind_name(static_cast<ast_file::Kind>(kind)),
+                     static_cast<int64_t>(counts[kind]));
+    }
+  });
+}
+
+void write_lookups(llvm::json::OStream &json,
+                   const CodegenContext::Lookups &lookups) {
+  json.attributeObject("lookups", [&]() {
+    json.attribute("variables", static_cast<int64_t>(lookups.variables));
+    json.attribute("functions", static_cast<int64_t>(lookups.functions));
+  });
+}
+
+template <class Ir>
+void write_ir(llvm::json::OStream &json, llvm::StringRef key, const Ir &ir) {
+  json.attributeObject(key, [&]() {
+    json.attribute("instructions", static_cast<int64_t>(ir.instructions));
+    json.attribute("blocks", static_cast<int64_t>(ir.blocks));
+    json.attribute("allocas", static_cast<int64_t>(ir.allocas));
+  });
+}
+
+}  // namespace
+
+bool CompileStats::write(const std::string &path) const {
+  std::error_code error_code;
+  std::optional<llvm::raw_fd_ostream> file;
+  if (!path.empty()) {
+    file.emplace(path, error_code, llvm::sys::fs::OF_Text);
+    if (error_code) {
+      llvm::errs() << "Could not open " << path << ": " << error_code.message()
+                   << '\n';
+      return false;
+    }
+  }
+
+  // The totals: functions only the IR has count toward the IR alone.
+  std::array<uint64_t, ast_file::kKinds> ast{};
+  CodegenContext::Lookups lookups;
+  Ir generated;
+  Ir optimized;
+  for (const auto &[name, counted] : functions_) {
+    for (size_t kind = 0; kind < ast_file::kKinds; kind++) {
+      ast[kind] += counted.ast[kind];
+    }
+    lookups.variables += counted.lookups.variables;
+    lookups.functions += counted.lookups.functions;
+    for (auto [from, to] : {std::pair(&counted.generated, &generated),
+                            std::pair(&counted.optimized, &optimized)}) {
+      if (!*from) continue;
+      to->instructions += (*from)->instructions;
+      to->blocks += (*from)->blocks;
+      to->allocas += (*from)->allocas;
+    }
+  }
+
+  llvm::json::OStream json(file ? *file : llvm::outs(), 2);
+  json.object([&]() {
+    json.attributeObject("total", [&]() {
+      write_ast(json, ast);
+      write_lookups(json, lookups);
+      write_ir(json, "ir_generated", generated);
+      write_ir(json, "ir_optimized", optimized);
+    });
+
+    json.attributeObject("memory", [&]() {
+      json.attribute("ast_bytes", memory.ast);
+      json.attribute("context_bytes_generated", memory.context_generated);
+      json.attribute("context_bytes_optimized", memory.context_optimized);
+      json.attribute("peak_rss_kb", static_cast<int64_t>(peak_rss_kb()));
+    });
+
+    json.attributeArray("functions", [&]() {
+      for (const std::string &name : order_) {
+        const Function &counted = functions_.at(name);
+        json.object([&]() {
+          json.attribute("name", name);
+          write_ast(json, counted.ast);
+          write_lookups(json, counted.lookups);
+          if (counted.generated) {
+            write_ir(json, "ir_generated", *counted.generated);
+          }
+          if (counted.optimized) {
+            write_ir(json, "ir_optimized", *counted.optimized);
+          }
+        });
+      }
+    });
+
+    // As LLVM prints them, keyed by pass and counter. Empty unless LLVM was
+    // built with statistics (LLVM_ENABLE_STATS, which assertions imply).
+    std::string statistics;
+    llvm::raw_string_ostream statistics_stream(statistics);
+    llvm::PrintStatisticsJSON(statistics_stream);
+    llvm::Expected<llvm::json::Value> parsed =
+        llvm::json::parse(statistics_stream.str());
+    if (parsed) {
+      json.attribute("llvm", std::move(*parsed));
+    } else {
+      llvm::consumeError(parsed.takeError());
+    }
+  });
+  (file ? *file : llvm::outs()) << '\n';
+  return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/ast_file.h"
+#include "kaleidoscope/codegen_context.h"
+#include "llvm/IR/Module.h"
+
+/// What a compile produced and allocated (kali --stats), by function and in
+/// all: AST nodes by kind, the variable and function lookups of codegen, the
+/// instructions, blocks and allocas of the IR before and after optimization,
+/// the heap held by the AST and by the LLVMContext, and the llvm::Statistic
+/// counters of the passes. Written as JSON, for tracking from run to run.
+
+/// heap_in_use - Bytes allocated from the heap and not yet freed, as glibc's
+/// malloc counts them; 0 with other C libraries.
+int64_t heap_in_use();
+
+class CompileStats {
+ public:
+  /// Counts the nodes of the items of program, by kind.
+  void count_ast(const Program &program);
+
+  /// Adds the lookups codegen made for the item named name: those counted
+  /// between before and after.
+  void add_lookups(const std::string &name,
+                   const CodegenContext::Lookups &before,
+                   const CodegenContext::Lookups &after);
+
+  /// Counts the instructions, blocks and allocas of the functions module
+  /// defines, as generated, or as optimized.
+  void count_ir(const llvm::Module &module, bool optimized);
+
+  /// Heap bytes held by the AST, and by the LLVMContext and the module in it
+  /// once generated and once optimized.
+  struct Memory {
+    int64_t ast = 0;
+    int64_t context_generated = 0;
+    int64_t context_optimized = 0;
+  };
+  Memory memory;
+
+  /// write - Writes the statistics, and the llvm::Statistic counters --stats
+  /// turned on in LLVM, as JSON to path, or to stdout if path is empty.
+  /// Returns false, after logging, if the file cannot be written.
+  bool write(const std::string &path) const;
+
+ private:
+  struct Ir {
+    uint64_t instructions = 0;
+    uint64_t blocks = 0;
+    uint64_t allocas = 0;
+  };
+
+  /// Of an item of the program, or of a function only the IR has, say the
+  /// outlined body of a parfor.
+  struct Function {
+    std::array<uint64_t, ast_file::kKinds> ast{};
+    CodegenContext::Lookups lookups;
+    std::optional<Ir> generated;
+    std::optional<Ir> optimized;
+  };
+
+  /// The statistics of name, added in the order functions are first seen.
+  Function &function(const std::string &name);
+
+  std::vector<std::string> order_;
+  std::map<std::string, Function> functions_;
+};
@@ -0,0 +1,224 @@
+#include "vector_variants.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+namespace {
+
+/// An x86-64 ISA of the vector function ABI: the letter naming it, how many
+/// doubles its registers hold, and the target features its variants need.
+struct Isa {
+  char letter;
+  unsigned lanes;
+  const char *features;
+};
+
+/// SSE, AVX, AVX2 and AVX-512, each of which a host compiler may call.
+const Isa kIsas[] = {
+    {'b', 2, "+sse2"},
+    {'c', 4, "+avx"},
+    {'d', 4, "+avx2"},
+    {'e', 8, "+avx512f"},
+};
+
+/// The name of the variant for isa of a function name of args arguments, all
+/// of them vectors: _ZGV<isa><mask><lanes><v per argument>_<name>.
+std::string variant_name(const Isa &isa, bool masked, size_t args,
+                         const std::string &name) {
+  std::string mangled;
+  llvm::raw_string_ostream(mangled)
+      << "_ZGV" << isa.letter << (masked ? 'M' : 'N') << isa.lanes
+      << std::string(args, 'v') << '_' << name;
+  return mangled;
+}
+
+/// define_variant - Defines the variant of fn for isa: a loop over the lanes,
+/// calling fn on each, or on those the mask enables. fn is inlined into the
+/// loop, which leaves the loop vectorizer straight-line code to widen.
+///
+/// The mask is a vector of doubles, a lane nonzero where enabled; under
+/// AVX-512, an integer of a bit per lane. Disabled lanes of the result are 0.
+llvm::Function *define_variant(CodegenContext &codegen_context,
+                               llvm::Function *fn,
+                               const function::Prototype &prototype,
+                               const Isa &isa, bool masked,
+                               const std::string &features) {
+  auto &builder = codegen_context.builder();
+  auto &context = codegen_context.context();
+  llvm::Type *double_type = llvm::Type::getDoubleTy(context);
+  llvm::Type *index_type = llvm::Type::getInt64Ty(context);
+  llvm::Type *vector_type = llvm::FixedVectorType::get(double_type, isa.lanes);
+  size_t args = fn->arg_size();
+
+  std::vector<llvm::Type *> param_types(args, vector_type);
+  if (masked) {
+    param_types.push_back(isa.letter == 'e'
+                              ? builder.getIntNTy(isa.lanes)
+                              : vector_type);
+  }
+  llvm::Function *variant = llvm::Function::Create(
+      llvm::FunctionType::get(vector_type, param_types, /*isVarArg=*/false),
+      llvm::Function::ExternalLinkage,
+      variant_name(isa, masked, args, prototype.name()),
+      codegen_context.module());
+  variant->addFnAttr("target-features", features);
+  // Else vectors wider than 256 bits are passed in halves, not zmm registers.
+  variant->addFnAttr("min-legal-vector-width",
+                     std::to_string(isa.lanes * 64));
+
+  llvm::IRBuilderBase::InsertPoint insert_point = builder.saveIP();
+  llvm::BasicBlock *entry_block =
+      llvm::BasicBlock::Create(context, "entry", variant);
+  builder.SetInsertPoint(entry_block);
+  DebugInfo &debug_info = codegen_context.debug_info();
+  debug_info.push_subprogram(variant->getName().str(), prototype.location(),
+                             args, variant);
+  if (variant->getSubprogram()) {
+    builder.SetCurrentDebugLocation(llvm::DILocation::get(
+        context, prototype.location().line, prototype.location().column,
+        variant->getSubprogram()));
+  }
+
+  // Lanes are read and written through arrays, which the vectorizer sees
+  // through, aligned to be stored and loaded as a whole.
+  const llvm::DataLayout &data_layout =
+      codegen_context.module().getDataLayout();
+  auto lanes = [&](llvm::Value *value, llvm::Type *element_type,
+                   const llvm::Twine &name) {
+    llvm::Type *type = llvm::FixedVectorType::get(element_type, isa.lanes);
+    llvm::AllocaInst *alloca = builder.CreateAlloca(
+        llvm::ArrayType::get(element_type, isa.lanes), nullptr, name);
+    alloca->setAlignment(data_layout.getABITypeAlign(type));
+    builder.CreateStore(
+        builder.CreateBitCast(value, type),
+        builder.CreatePointerCast(alloca, type->getPointerTo()));
+    return alloca;
+  };
+  std::vector<llvm::AllocaInst *> arg_lanes;
+  for (size_t i = 0; i < args; i++) {
+    variant->getArg(i)->setName(prototype.args()[i]);
+    arg_lanes.push_back(
+        lanes(variant->getArg(i), double_type, prototype.args()[i]));
+  }
+  llvm::AllocaInst *result_lanes =
+      lanes(llvm::Constant::getNullValue(vector_type), double_type, "result");
+  llvm::Value *mask = nullptr;
+  llvm::AllocaInst *mask_lanes = nullptr;
+  if (masked) {
+    mask = variant->getArg(args);
+    mask->setName("mask");
+    if (isa.letter != 'e') mask_lanes = lanes(mask, index_type, "mask");
+  }
+
+  llvm::BasicBlock *loop_block =
+      llvm::BasicBlock::Create(context, "lane", variant);
+  llvm::BasicBlock *next_block = llvm::BasicBlock::Create(context, "next");
+  builder.CreateBr(loop_block);
+  builder.SetInsertPoint(loop_block);
+  llvm::PHINode *lane = builder.CreatePHI(index_type, 2, "lane");
+  lane->addIncoming(builder.getInt64(0), entry_block);
+
+  auto lane_pointer = [&](llvm::AllocaInst *alloca) {
+    return builder.CreateInBoundsGEP(alloca->getAllocatedType(), alloca,
+                                     {builder.getInt64(0), lane});
+  };
+
+  if (masked) {
+    llvm::Value *enabled = nullptr;
+    if (mask_lanes) {
+      // Compared as integers, all bits set being NaN.
+      llvm::Value *bits =
+          builder.CreateLoad(index_type, lane_pointer(mask_lanes));
+      enabled = builder.CreateICmpNE(bits, builder.getInt64(0), "enabled");
+    } else {
+      llvm::Value *bit = builder.CreateAnd(
+          builder.CreateLShr(builder.CreateZExt(mask, index_type), lane), 1);
+      enabled = builder.CreateICmpNE(bit, builder.getInt64(0), "enabled");
+    }
+    llvm::BasicBlock *call_block =
+        llvm::BasicBlock::Create(context, "call", variant);
+    builder.CreateCondBr(enabled, call_block, next_block);
+    builder.SetInsertPoint(call_block);
+  }
+
+  std::vector<llvm::Value *> call_args;
+  for (llvm::AllocaInst *alloca : arg_lanes) {
+    call_args.push_back(builder.CreateLoad(double_type, lane_pointer(alloca)));
+  }
+  llvm::CallInst *call = builder.CreateCall(fn, call_args, "calltmp");
+  builder.CreateStore(call, lane_pointer(result_lanes));
+  builder.CreateBr(next_block);
+
+  variant->getBasicBlockList().push_back(next_block);
+  builder.SetInsertPoint(next_block);
+  llvm::Value *next_lane = builder.CreateAdd(lane, builder.getInt64(1));
+  lane->addIncoming(next_lane, next_block);
+  llvm::BasicBlock *exit_block =
+      llvm::BasicBlock::Create(context, "exit", variant);
+  builder.CreateCondBr(
+      builder.CreateICmpULT(next_lane, builder.getInt64(isa.lanes)),
+      loop_block, exit_block);
+  builder.SetInsertPoint(exit_block);
+  builder.CreateRet(builder.CreateLoad(
+      vector_type,
+      builder.CreatePointerCast(result_lanes, vector_type->getPointerTo())));
+
+  debug_info.pop_subprogram();
+  builder.SetCurrentDebugLocation(llvm::DebugLoc());
+  builder.restoreIP(insert_point);
+
+  // A recursive fn is inlined a level deep, the rest of it calling itself.
+  llvm::InlineFunctionInfo inline_info;
+  llvm::InlineFunction(*call, inline_info);
+  codegen_context.verify(*variant);
+  return variant;
+}
+
+}  // namespace
+
+std::vector<std::string> add_vector_variants(
+    CodegenContext &codegen_context, const function::Prototype &prototype,
+    const llvm::TargetMachine &target_machine) {
+  llvm::Function *fn = codegen_context.module().getFunction(prototype.name());
+  if (!fn || fn->isDeclaration()) return {};
+
+  std::string target_features = target_machine.getTargetFeatureString().str();
+  const llvm::MCSubtargetInfo *subtarget = target_machine.getMCSubtargetInfo();
+
+  std::vector<std::string> names;
+  std::vector<std::string> callable;
+  for (const Isa &isa : kIsas) {
+    std::string features = isa.features;
+    if (!target_features.empty()) {
+      features = target_features + "," + features;
+    }
+    for (bool masked : {false, true}) {
+      llvm::Function *variant = define_variant(codegen_context, fn, prototype,
+                                               isa, masked, features);
+      names.push_back(variant->getName().str());
+      // Masked calls are not made by the vectorizer, which would pass the
+      // mask as <lanes x i1>; calls to wider ISAs than the target's would
+      // pass vectors in registers the callee does not take them in.
+      if (!masked && subtarget->checkFeatures(isa.features)) {
+        callable.push_back(names.back());
+      }
+    }
+  }
+  if (callable.empty()) return names;
+
+  // The vectorizer reads the attribute off calls, where it is put on those
+  // already generated, as well as off the function.
+  std::string mappings = llvm::join(callable, ",");
+  fn->addFnAttr("vector-function-abi-variant", mappings);
+  for (llvm::User *user : fn->users()) {
+    auto *call = llvm::dyn_cast<llvm::CallInst>(user);
+    if (call && call->getCalledFunction() == fn) {
+      call->addFnAttr(
+          llvm::Attribute::get(fn->getContext(), "vector-function-abi-variant",
+                               mappings));
+    }
+  }
+  return names;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/codegen_context.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// Vector variants of scalar defs (kali --vector-variants): functions that
+/// apply a def to 2, 4 or 8 doubles at once, named and called as the x86-64
+/// vector function ABI lays out, so that the loops of a host compiled with
+/// `#pragma omp declare simd` call them, and hosts may call them by name.
+
+/// add_vector_variants - Defines the vector variants of the function of
+/// prototype in the module of codegen_context, for each x86-64 ISA, masked and
+/// not, and returns their names. The scalar function, and the calls to it so
+/// far, list the unmasked variants target_machine can run in their
+/// vector-function-abi-variant attribute, for the loop vectorizer to call.
+/// Adds nothing if the function was not generated.
+std::vector<std::string> add_vector_variants(
+    CodegenContext &codegen_context, const function::Prototype &prototype,
+    const llvm::TargetMachine &target_machine);
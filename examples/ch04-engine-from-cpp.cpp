@@ -0,0 +1,14 @@
+#include <iostream>
+
+#include "kaleidoscope/engine.h"
+
+int main() {
+  Engine engine;
+  Engine::HandlePtr handle = engine.compile("def average(x y) (x + y) * 0.5;");
+  if (!handle) {
+    return 1;
+  }
+
+  auto *average = handle->lookup<double(double, double)>("average");
+  std::cout << "average of 3.0 and 4.0: " << average(3.0, 4.0) << std::endl;
+}
@@ -1,16 +1,17 @@
 #include "ast.h"
 
+#include <cmath>
+
+#include "builtins.h"
 #include "codegen_context.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
-#include "llvm/IR/Verifier.h"
 #include "llvm/Support/raw_ostream.h"
 #include "parser.h"
 
-using llvm::AllocaInst;
 using llvm::APFloat;
 using llvm::BasicBlock;
 using llvm::Constant;
@@ -26,6 +27,19 @@ llvm::Value *LogErrorV(const char *str) {
   return nullptr;
 }
 
+const char *type_name(ValueType type) {
+  const char *names[] = {"f64", "f32", "i64", "u64", "bool"};
+  return names[static_cast<int>(type)];
+}
+
+std::optional<ValueType> parse_type(const std::string &name) {
+  for (ValueType type : {ValueType::f64, ValueType::f32, ValueType::i64,
+                         ValueType::u64, ValueType::bool_}) {
+    if (name == type_name(type)) return type;
+  }
+  return std::nullopt;
+}
+
 namespace {
 
 llvm::raw_ostream &indent(llvm::raw_ostream &out, int size) {
@@ -69,26 +83,84 @@ VarIn::VarIn(std::vector<Assignment> assignments, ExprPtr body,
 llvm::raw_ostream &VarIn::dump(llvm::raw_ostream &out, int indent_level) {
   Expr::dump(out << "var", indent_level);
   for (const auto &assignment : assignments_) {
-    const auto &rhs = assignment.second;
-    const std::string &lhs = assignment.first;
-    rhs->dump(indent(out, indent_level) << lhs << ':', indent_level + 1);
+    indent(out, indent_level) << assignment.name;
+    if (assignment.type) out << " (" << type_name(*assignment.type) << ')';
+    out << ':';
+    if (assignment.value) {
+      assignment.value->dump(out, indent_level + 1);
+    } else {
+      out << " 0\n";
+    }
   }
   body_->dump(indent(out, indent_level) << "body:", indent_level + 1);
   return out;
 }
 
+Operation::Operation(SourceLocation source_location)
+    : Expr(std::move(source_location)) {}
+
+Operation::~Operation() {
+  // Takes the operations among the operands apart before they are destroyed,
+  // so that destroying a nest of them does not recurse.
+  std::vector<ExprPtr> pending;
+  for (ExprPtr &operand : operands_) {
+    pending.push_back(std::move(operand));
+  }
+  while (!pending.empty()) {
+    ExprPtr expr = std::move(pending.back());
+    pending.pop_back();
+    if (Operation *operation = expr->as_operation()) {
+      for (ExprPtr &operand : operation->operands_) {
+        pending.push_back(std::move(operand));
+      }
+      operation->operands_.clear();
+    }
+  }
+}
+
+llvm::raw_ostream &Operation::dump(llvm::raw_ostream &out, int indent_level) {
+  // In pre-order, with a stack of what is left to print: an expression, the
+  // label to print ahead of it, and its indentation.
+  struct Pending {
+    Expr *expr;
+    const char *label;
+    int indent_level;
+  };
+  std::vector<Pending> pending{{this, nullptr, indent_level}};
+  while (!pending.empty()) {
+    Pending next = pending.back();
+    pending.pop_back();
+    if (next.label) {
+      indent(out, next.indent_level - 1) << next.label;
+    }
+    Operation *operation = next.expr->as_operation();
+    if (!operation) {
+      next.expr->dump(out, next.indent_level);
+      continue;
+    }
+    operation->dump_name(out);
+    operation->Expr::dump(out, next.indent_level);
+    for (size_t i = operation->operands_.size(); i-- > 0;) {
+      pending.push_back({operation->operands_[i].get(),
+                         operation->dump_label(i), next.indent_level + 1});
+    }
+  }
+  return out;
+}
+
 BinaryOp::BinaryOp(Op op, ExprPtr lhs, ExprPtr rhs,
                    SourceLocation source_location)
-    : Expr(std::move(source_location)),
-      op_(op),
-      lhs_(std::move(lhs)),
-      rhs_(std::move(rhs)) {}
-
-llvm::raw_ostream &BinaryOp::dump(llvm::raw_ostream &out, int indent_level) {
-  Expr::dump(out << "binary" << keyword_from_op(op_), indent_level);
-  lhs_->dump(indent(out, indent_level) << "lhs:", indent_level + 1);
-  rhs_->dump(indent(out, indent_level) << "rhs:", indent_level + 1);
-  return out;
+    : Operation(std::move(source_location)), op_(op) {
+  operands_.push_back(std::move(lhs));
+  operands_.push_back(std::move(rhs));
+}
+
+void BinaryOp::dump_name(llvm::raw_ostream &out) const {
+  out << "binary" << keyword_from_op(op_);
+}
+
+const char *BinaryOp::dump_label(size_t index) const {
+  return index == 0 ? "lhs:" : "rhs:";
 }
 
 IfThenElse::IfThenElse(ExprPtr condition, ExprPtr then, ExprPtr otherwise,
@@ -106,20 +178,72 @@ llvm::raw_ostream &IfThenElse::dump(llvm::raw_ostream &out, int indent_level) {
   return out;
 }
 
-For::For(std::string var, ExprPtr start, ExprPtr end, ExprPtr step,
-         ExprPtr body, SourceLocation source_location)
+For::For(std::string var, std::optional<ValueType> type, ExprPtr start,
+         ExprPtr end, ExprPtr step, ExprPtr body,
+         SourceLocation source_location)
     : Expr(std::move(source_location)),
       var_(std::move(var)),
+      type_(type),
       start_(std::move(start)),
       end_(std::move(end)),
       step_(std::move(step)),
       body_(std::move(body)) {}
 
 llvm::raw_ostream &For::dump(llvm::raw_ostream &out, int indent_level) {
-  Expr::dump(out << "for", indent_level);
+  out << "for";
+  if (type_) out << ' ' << type_name(*type_);
+  Expr::dump(out, indent_level);
+  start_->dump(indent(out, indent_level) << "init:", indent_level + 1);
+  end_->dump(indent(out, indent_level) << "end:", indent_level + 1);
+  if (step_) {
+    step_->dump(indent(out, indent_level) << "step:", indent_level + 1);
+  }
+  body_->dump(indent(out, indent_level) << "body:", indent_level + 1);
+  return out;
+}
+
+ParallelFor::ParallelFor(std::string var, ExprPtr start, ExprPtr end,
+                         ExprPtr step, Reduction reduction, ExprPtr body,
+                         SourceLocation source_location)
+    : Expr(std::move(source_location)),
+      var_(std::move(var)),
+      start_(std::move(start)),
+      end_(std::move(end)),
+      step_(std::move(step)),
+      reduction_(reduction),
+      body_(std::move(body)) {}
+
+llvm::raw_ostream &ParallelFor::dump(llvm::raw_ostream &out,
+                                     int indent_level) {
+  Expr::dump(out << "parfor", indent_level);
+  start_->dump(indent(out, indent_level) << "init:", indent_level + 1);
+  end_->dump(indent(out, indent_level) << "end:", indent_level + 1);
+  if (step_) {
+    step_->dump(indent(out, indent_level) << "step:", indent_level + 1);
+  }
+  body_->dump(indent(out, indent_level) << "body:", indent_level + 1);
+  return out;
+}
+
+Reduce::Reduce(Reduction reduction, std::string var, ExprPtr start,
+               ExprPtr end, ExprPtr step, ExprPtr body,
+               SourceLocation source_location)
+    : Expr(std::move(source_location)),
+      reduction_(reduction),
+      var_(std::move(var)),
+      start_(std::move(start)),
+      end_(std::move(end)),
+      step_(std::move(step)),
+      body_(std::move(body)) {}
+
+llvm::raw_ostream &Reduce::dump(llvm::raw_ostream &out, int indent_level) {
+  const char *names[] = {"reduce", "sum", "prod", "min", "max"};
+  Expr::dump(out << names[static_cast<int>(reduction_)], indent_level);
   start_->dump(indent(out, indent_level) << "init:", indent_level + 1);
   end_->dump(indent(out, indent_level) << "end:", indent_level + 1);
-  step_->dump(indent(out, indent_level) << "step:", indent_level + 1);
+  if (step_) {
+    step_->dump(indent(out, indent_level) << "step:", indent_level + 1);
+  }
   body_->dump(indent(out, indent_level) << "body:", indent_level + 1);
   return out;
 }
@@ -127,10 +251,23 @@ llvm::raw_ostream &For::dump(llvm::raw_ostream &out, int indent_level) {
 namespace function {
 
 Prototype::Prototype(std::string name, Args args,
-                     SourceLocation source_location)
+                     SourceLocation source_location,
+                     std::vector<ValueType> types, ValueType return_type)
     : name_(std::move(name)),
       args_(std::move(args)),
-      source_location_(std::move(source_location)) {}
+      types_(std::move(types)),
+      return_type_(return_type),
+      source_location_(std::move(source_location)) {
+  if (types_.empty()) {
+    types_.assign(args_.size(), ValueType::f64);
+  }
+}
+
+bool Prototype::typed() const {
+  return return_type_ != ValueType::f64 ||
+         llvm::any_of(types_,
+                      [](ValueType type) { return type != ValueType::f64; });
+}
 
 Definition::Definition(PrototypePtr prototype, ExprPtr body,
                        SourceLocation source_location)
@@ -139,66 +276,246 @@ Definition::Definition(PrototypePtr prototype, ExprPtr body,
       source_location_(std::move(source_location)) {}
 
 Call::Call(std::string name, ArgExprs args, SourceLocation source_location)
-    : Expr(std::move(source_location)),
-      name_(std::move(name)),
-      args_(std::move(args)) {}
+    : Operation(std::move(source_location)), name_(std::move(name)) {
+  for (ExprPtr &arg : args) {
+    operands_.push_back(std::move(arg));
+  }
+}
+
+void Call::dump_name(llvm::raw_ostream &out) const { out << "call " << name_; }
+
+// Arguments go unlabelled, a level further in.
+const char *Call::dump_label(size_t /*index*/) const { return " "; }
 
 }  // namespace function
 
-Value *Number::codegen(CodegenContext &codegen_context) const {
-  codegen_context.emit_location(this);
-  return ConstantFP::get(codegen_context.context(), APFloat(value_));
+namespace {
+
+bool is_float(ValueType type) {
+  return type == ValueType::f64 || type == ValueType::f32;
 }
 
-Value *Variable::codegen(CodegenContext &codegen_context) const {
-  // Look this variable up in the function.
-  AllocaInst *alloca_inst = codegen_context.lookup(name_);
-  if (!alloca_inst) LogErrorV("Unknown variable name");
+Typed mismatch(ValueType expected, ValueType found) {
+  std::string message = std::string("Type mismatch: expected ") +
+                        type_name(expected) + ", found " + type_name(found);
+  return LogErrorV(message.c_str());
+}
+
+/// convert - value as type, converted the way C casts: floats to integers
+/// round toward zero, and anything but zero is true.
+Value *convert(CodegenContext &codegen_context, const Typed &value,
+               ValueType type) {
+  auto &builder = codegen_context.builder();
+  Type *llvm_type = codegen_context.type(type);
+  Type *from_type = value.value->getType();
+  if (value.type == type) return value.value;
+  if (type == ValueType::bool_) {
+    if (is_float(value.type)) {
+      return builder.CreateFCmpUNE(value.value,
+                                   ConstantFP::get(from_type, 0.0), "tobool");
+    }
+    return builder.CreateICmpNE(value.value,
+                                llvm::ConstantInt::get(from_type, 0), "tobool");
+  }
+  if (is_float(type)) {
+    if (is_float(value.type)) {
+      return builder.CreateFPCast(value.value, llvm_type, "conv");
+    }
+    if (value.type == ValueType::i64) {
+      return builder.CreateSIToFP(value.value, llvm_type, "conv");
+    }
+    return builder.CreateUIToFP(value.value, llvm_type, "conv");
+  }
+  // To i64 or u64, which differ only in how they are used.
+  if (is_float(value.type)) {
+    return type == ValueType::i64
+               ? builder.CreateFPToSI(value.value, llvm_type, "conv")
+               : builder.CreateFPToUI(value.value, llvm_type, "conv");
+  }
+  if (value.type == ValueType::bool_) {
+    return builder.CreateZExt(value.value, llvm_type, "conv");
+  }
+  return value.value;
+}
+
+/// fits - Whether value is a literal that type holds exactly. Literals are
+/// f64, and take on the type of what they meet, when it holds them: n + 1 is
+/// an i64 for an i64 n. Only literals do: n + 2 * 0.5 and a variable bound to
+/// 3 are f64s.
+bool fits(const Typed &value, ValueType type) {
+  if (!value.literal) return false;
+  auto *constant = llvm::cast<ConstantFP>(value.value);
+  double number = constant->getValueAPF().convertToDouble();
+  bool integral = number == std::trunc(number);
+  switch (type) {
+    case ValueType::f64:
+    case ValueType::f32:
+      return true;
+    case ValueType::i64:
+      return integral && number >= -0x1p63 && number < 0x1p63;
+    case ValueType::u64:
+      return integral && number >= 0 && number < 0x1p64;
+    case ValueType::bool_:
+      return number == 0 || number == 1;
+  }
+  return false;
+}
 
-  // Load the value
+/// coerce - value as type, if it converts implicitly: a constant that fits,
+/// and a bool to f64, as 0 or 1. Anything else takes an explicit conversion,
+/// i64(x), and is an error.
+Typed coerce(CodegenContext &codegen_context, const Typed &value,
+             ValueType type) {
+  if (value.type == type) return value;
+  if (fits(value, type) ||
+      (value.type == ValueType::bool_ && type == ValueType::f64)) {
+    return {convert(codegen_context, value, type), type};
+  }
+  return mismatch(type, value.type);
+}
+
+/// unify - The type two values combine in: their own, or the one that the
+/// other coerces to. nullopt, after logging, if they do not combine.
+std::optional<ValueType> unify(const Typed &lhs, const Typed &rhs) {
+  if (lhs.type == rhs.type) return lhs.type;
+  if (fits(lhs, rhs.type)) return rhs.type;
+  if (fits(rhs, lhs.type)) return lhs.type;
+  if ((lhs.type == ValueType::bool_ && rhs.type == ValueType::f64) ||
+      (lhs.type == ValueType::f64 && rhs.type == ValueType::bool_)) {
+    return ValueType::f64;
+  }
+  mismatch(lhs.type, rhs.type);
+  return std::nullopt;
+}
+
+/// condition - Whether value is non-zero, as a bool; a bool as it is.
+Value *condition(CodegenContext &codegen_context, const Typed &value,
+                 const char *name) {
   auto &builder = codegen_context.builder();
+  Type *type = value.value->getType();
+  switch (value.type) {
+    case ValueType::bool_:
+      return value.value;
+    case ValueType::f64:
+    case ValueType::f32:
+      return builder.CreateFCmpONE(value.value, ConstantFP::get(type, 0.0),
+                                   name);
+    case ValueType::i64:
+    case ValueType::u64:
+      return builder.CreateICmpNE(value.value,
+                                  llvm::ConstantInt::get(type, 0), name);
+  }
+  return nullptr;
+}
+
+/// arithmetic - lhs op rhs, in the type they unify to. Arithmetic on bools is
+/// on 0 and 1, in f64.
+Typed arithmetic(CodegenContext &codegen_context, Op op, const Typed &lhs,
+                 const Typed &rhs) {
+  std::optional<ValueType> type = unify(lhs, rhs);
+  if (!type) return nullptr;
+  if (*type == ValueType::bool_ && op != Op::lt) {
+    type = ValueType::f64;
+  }
+  Value *l = convert(codegen_context, lhs, *type);
+  Value *r = convert(codegen_context, rhs, *type);
+  bool floating = is_float(*type);
+  llvm::IRBuilder<> &builder = codegen_context.builder();
+  switch (op) {
+    case Op::add:
+      return {floating ? builder.CreateFAdd(l, r, "addtmp")
+                       : builder.CreateAdd(l, r, "addtmp"),
+              *type};
+    case Op::sub:
+      return {floating ? builder.CreateFSub(l, r, "subtmp")
+                       : builder.CreateSub(l, r, "subtmp"),
+              *type};
+    case Op::mul:
+      return {floating ? builder.CreateFMul(l, r, "multmp")
+                       : builder.CreateMul(l, r, "multmp"),
+              *type};
+    case Op::div:
+      if (floating) return {builder.CreateFDiv(l, r, "divtmp"), *type};
+      if (*type == ValueType::i64) {
+        return {builder.CreateSDiv(l, r, "divtmp"), *type};
+      }
+      return {builder.CreateUDiv(l, r, "divtmp"), *type};
+    case Op::lt:
+      // An i1, which `if` and `for` branch on as it is, and which converts to
+      // 0.0 or 1.0 where an f64 is expected: with uitofp, since sitofp would
+      // make true -1.0.
+      if (floating) {
+        return {builder.CreateFCmpULT(l, r, "cmptmp"), ValueType::bool_};
+      }
+      if (*type == ValueType::i64) {
+        return {builder.CreateICmpSLT(l, r, "cmptmp"), ValueType::bool_};
+      }
+      return {builder.CreateICmpULT(l, r, "cmptmp"), ValueType::bool_};
+    default:
+      return LogErrorV("invalid binary operator");
+  }
+}
+
+}  // namespace
+
+Typed Number::codegen(CodegenContext &codegen_context) const {
   codegen_context.emit_location(this);
-  return builder.CreateLoad(alloca_inst->getAllocatedType(), alloca_inst,
-                            name_.c_str());
+  Typed number = ConstantFP::get(codegen_context.context(), APFloat(value_));
+  number.literal = true;
+  return number;
 }
 
-Value *VarIn::codegen(CodegenContext &codegen_context) const {
+Typed Variable::codegen(CodegenContext &codegen_context) const {
   // Look this variable up in the function.
-  std::vector<AllocaInst *> old_bindings;
+  CodegenContext::Binding binding = codegen_context.lookup(name_);
+  if (!binding.value) return LogErrorV("Unknown variable name");
 
-  auto &builder = codegen_context.builder();
+  codegen_context.emit_location(this);
+  return {binding.value, binding.type};
+}
 
-  Function *fn = builder.GetInsertBlock()->getParent();
+Typed VarIn::codegen(CodegenContext &codegen_context) const {
+  // Look this variable up in the function.
+  std::vector<CodegenContext::Binding> old_bindings;
 
   // Register all variables - emit initializer
   for (const auto &assignment : assignments_) {
-    const std::string &name = assignment.first;
-    Expr *init = (assignment.second).get();
+    const std::string &name = assignment.name;
+    Expr *init = assignment.value.get();
 
-    Value *init_value;
+    Typed init_value;
     if (init) {
       init_value = init->codegen(codegen_context);
       if (!init_value) {
         return nullptr;
       }
+      if (assignment.type) {
+        init_value = coerce(codegen_context, init_value, *assignment.type);
+        if (!init_value) {
+          return nullptr;
+        }
+      }
     } else {
-      init_value = ConstantFP::get(codegen_context.context(), APFloat(0.0));
+      ValueType type = assignment.type.value_or(ValueType::f64);
+      init_value = {Constant::getNullValue(codegen_context.type(type)), type};
     }
 
-    AllocaInst *alloca = codegen_context.create_entry_block_alloca(fn, name);
-    builder.CreateStore(init_value, alloca);
+    if (!init_value.value->hasName()) init_value.value->setName(name);
 
+    // Bound to the value itself, but not as a literal: var c = 3 is an f64
+    // variable, as it was when variables lived in allocas, however the
+    // constant the value may be.
     old_bindings.push_back(codegen_context.lookup(name));
-    codegen_context.set(name, alloca);
+    codegen_context.set(name, {init_value.value, init_value.type});
   }
 
-  Value *body_value = body_->codegen(codegen_context);
+  Typed body_value = body_->codegen(codegen_context);
   if (!body_value) {
     return nullptr;
   }
 
   for (size_t i = 0; i < assignments_.size(); i++) {
-    const std::string &name = assignments_[i].first;
+    const std::string &name = assignments_[i].name;
     codegen_context.set(name, old_bindings[i]);
   }
 
@@ -206,76 +523,121 @@ Value *VarIn::codegen(CodegenContext &codegen_context) const {
   return body_value;
 }
 
-Value *BinaryOp::codegen(CodegenContext &codegen_context) const {
-  codegen_context.emit_location(this);
-  Value *lhs = lhs_->codegen(codegen_context);
-  Value *rhs = rhs_->codegen(codegen_context);
-  if (!lhs || !rhs) return nullptr;
+namespace {
 
-  llvm::IRBuilder<> &builder = codegen_context.builder();
-  switch (op_) {
-    case Op::add:
-      return builder.CreateFAdd(lhs, rhs, "addtmp");
-    case Op::sub:
-      return builder.CreateFSub(lhs, rhs, "subtmp");
-    case Op::mul:
-      return builder.CreateFMul(lhs, rhs, "multmp");
-    case Op::div:
-      return builder.CreateFMul(lhs, rhs, "divtmp");
-    case Op::lt:
-      lhs = builder.CreateFCmpULT(lhs, rhs, "cmptmp");
-      // Convert bool 0/1 to double 0.0 or 1.0
-      //
-      // On the other hand, LLVM specifies that the fcmp instruction always
-      // returns an ‘i1’ value (a one bit integer). The problem with this is
-      // that Kaleidoscope wants the value to be a 0.0 or 1.0 value. In order to
-      // get these semantics, we combine the fcmp instruction with a uitofp
-      // instruction. This instruction converts its input integer into a
-      // floating point value by treating the input as an unsigned value. In
-      // contrast, if we used the sitofp instruction, the Kaleidoscope ‘<’
-      // operator would return 0.0 and -1.0, depending on the input value.
-
-      return builder.CreateUIToFP(
-          lhs, Type::getDoubleTy(codegen_context.context()), "booltmp");
-    default:
-      return LogErrorV("invalid binary operator");
+/// Generates a nest of operations, with Operation::post_order().
+class OperationGenerator {
+ public:
+  explicit OperationGenerator(CodegenContext &codegen_context)
+      : codegen_context_(codegen_context) {}
+
+  void enter(const Operation * /*operation*/) {}
+
+  std::optional<Typed> leaf(const Expr *expr) {
+    if (Typed value = expr->codegen(codegen_context_)) return value;
+    return std::nullopt;
+  }
+
+  Typed operand(const Operation * /*operation*/, size_t /*index*/,
+                Typed value) {
+    return value;
   }
+
+  std::optional<Typed> combine(const Operation *operation,
+                               llvm::ArrayRef<Typed> operands) {
+    if (Typed value = operation->combine(codegen_context_, operands)) {
+      return value;
+    }
+    return std::nullopt;
+  }
+
+ private:
+  CodegenContext &codegen_context_;
+};
+
+}  // namespace
+
+Typed Operation::codegen(CodegenContext &codegen_context) const {
+  OperationGenerator generator(codegen_context);
+  return post_order<Typed>(generator).value_or(nullptr);
+}
+
+Typed BinaryOp::combine(CodegenContext &codegen_context,
+                        llvm::ArrayRef<Typed> operands) const {
+  codegen_context.emit_location(this);
+  return arithmetic(codegen_context, op_, operands[0], operands[1]);
 }
 
 namespace function {
 
-Value *Call::codegen(CodegenContext &codegen_context) const {
+Typed Call::combine(CodegenContext &codegen_context,
+                    llvm::ArrayRef<Typed> operands) const {
+  // Conversions are written as calls to the type, i64(x), and math library
+  // functions lower to intrinsics, unless the program defines a function of
+  // the same name itself.
+  std::optional<ValueType> type = parse_type(name_);
+  if (type && !codegen_context.defines(name_)) {
+    if (operands.size() != 1) return LogErrorV("Incorrect # arguments passed");
+    return {convert(codegen_context, operands[0], *type), *type};
+  }
+  const Builtin *builtin = lookup_builtin(name_);
+  if (builtin && !codegen_context.defines(name_)) {
+    return builtin_codegen(*builtin, codegen_context, operands);
+  }
+
   // Look up the name in the global module table.
-  Function *fn = codegen_context.module().getFunction(name_);
-  if (!fn) return LogErrorV("Unknown function referenced");
+  Function *fn = codegen_context.function(name_);
+  const Prototype *prototype = codegen_context.prototype(name_);
+
+  if (!fn || !prototype) return LogErrorV("Unknown function referenced");
 
   // If argument mismatch error.
-  if (fn->arg_size() != args_.size())
+  if (fn->arg_size() != operands.size())
     return LogErrorV("Incorrect # arguments passed");
 
-  std::vector<Value *> arg_values;
-  for (const auto &arg : args_) {
-    arg_values.push_back(arg->codegen(codegen_context));
-    if (!arg_values.back()) return nullptr;
+  std::vector<Value *> args;
+  for (size_t i = 0; i < operands.size(); i++) {
+    Typed arg = coerce(codegen_context, operands[i], prototype->types()[i]);
+    if (!arg) return nullptr;
+    args.push_back(arg.value);
   }
 
-  return codegen_context.builder().CreateCall(fn, arg_values, "calltmp");
+  return {codegen_context.builder().CreateCall(fn, args, "calltmp"),
+          prototype->return_type()};
 }
 
-llvm::raw_ostream &Call::dump(llvm::raw_ostream &out, int indent_level) {
-  Expr::dump(out << "call " << name_, indent_level);
-  for (const auto &arg : args_) {
-    arg->dump(indent(out, indent_level + 1), indent_level + 1);
+Typed Call::builtin_codegen(const Builtin &builtin,
+                            CodegenContext &codegen_context,
+                            llvm::ArrayRef<Typed> operands) const {
+  if (builtin.arity != operands.size())
+    return LogErrorV("Incorrect # arguments passed");
+
+  // All builtins are overloaded on the floating point type only: f32 if an
+  // operand is, and f64 otherwise.
+  ValueType type = ValueType::f64;
+  for (const Typed &operand : operands) {
+    if (operand.type == ValueType::f32) type = ValueType::f32;
   }
-  return out;
+  std::vector<Value *> args;
+  for (const Typed &operand : operands) {
+    Typed arg = coerce(codegen_context, operand, type);
+    if (!arg) return nullptr;
+    args.push_back(arg.value);
+  }
+  return {codegen_context.builder().CreateIntrinsic(
+              builtin.id, {codegen_context.type(type)}, args, nullptr,
+              "calltmp"),
+          type};
 }
 
 Function *Prototype::codegen(CodegenContext &codegen_context) const {
   // Make the function type:  double(double,double) etc.
-  std::vector<Type *> doubles(args_.size(),
-                              Type::getDoubleTy(codegen_context.context()));
+  std::vector<Type *> arg_types;
+  for (ValueType type : types_) {
+    arg_types.push_back(codegen_context.type(type));
+  }
   FunctionType *function_type =
-      FunctionType::get(Type::getDoubleTy(codegen_context.context()), doubles,
+      FunctionType::get(codegen_context.type(return_type_), arg_types,
                         /*isVarArg=*/false);
 
   Function *fn = Function::Create(function_type, Function::ExternalLinkage,
@@ -287,6 +649,18 @@ Function *Prototype::codegen(CodegenContext &codegen_context) const {
     arg.setName(args_[idx++]);
   }
 
+  // i64 and u64 are a C long and unsigned long as they are; a bool is an i1,
+  // which the C ABI extends to a byte, as a _Bool.
+  for (unsigned i = 0; i < types_.size(); i++) {
+    if (types_[i] == ValueType::bool_) {
+      fn->addParamAttr(i, llvm::Attribute::ZExt);
+    }
+  }
+  if (return_type_ == ValueType::bool_) {
+    fn->addRetAttr(llvm::Attribute::ZExt);
+  }
+
+  codegen_context.declare(*this);
   return fn;
 }
 
@@ -294,11 +668,20 @@ Function *Definition::codegen(CodegenContext &codegen_context) const {
   // First, check for an existing function from a previous 'extern' declaration.
   Function *fn = codegen_context.module().getFunction(prototype_->name());
 
+  if (fn) {
+    const Prototype *declared = codegen_context.prototype(prototype_->name());
+    if (declared && (declared->types() != prototype_->types() ||
+                     declared->return_type() != prototype_->return_type())) {
+      return static_cast<Function *>(
+          LogErrorV("Function redeclared with different types."));
+    }
+  }
+
   if (!fn) fn = prototype_->codegen(codegen_context);
 
   if (!fn) return nullptr;
 
-  if (!fn->empty())
+  if (codegen_context.defines(prototype_->name()))
     return static_cast<Function *>(LogErrorV("Function cannot be redefined."));
 
   // Create a new basic block to start insertion into.
@@ -311,34 +694,41 @@ Function *Definition::codegen(CodegenContext &codegen_context) const {
   auto &debug_info = codegen_context.debug_info();
   debug_info.push_subprogram(prototype_->name(), this, fn);
 
+  codegen_context.begin_profile(fn);
+
   // Record the function arguments in the NamedValues map.
   codegen_context.clear();
+  // By the names of the prototype: the context may discard those of values.
   for (auto &arg : fn->args()) {
-    llvm::StringRef name_ref = arg.getName();
-    std::string name(name_ref.data(), name_ref.size());
-
-    AllocaInst *alloca = codegen_context.create_entry_block_alloca(fn, name);
-    builder.CreateStore(&arg, alloca);
-    codegen_context.set(name, alloca);
+    unsigned index = arg.getArgNo();
+    codegen_context.set(prototype_->args()[index],
+                        {&arg, prototype_->types()[index]});
   }
 
   // TODO(jerinphilip)
   // debug_info.emit_location(this, builder);
 
-  if (Value *ret_val = body_->codegen(codegen_context)) {
+  Typed ret_val = body_->codegen(codegen_context);
+  if (ret_val) {
+    ret_val = coerce(codegen_context, ret_val, prototype_->return_type());
+  }
+  if (ret_val) {
     // Finish off the function.
-    builder.CreateRet(ret_val);
+    builder.CreateRet(ret_val.value);
+
+    codegen_context.end_profile(fn);
 
     // This function does a variety of consistency checks on the generated code,
     // to determine if our compiler is doing everything right. Using this is
     // important: it can catch a lot of bugs.
-    verifyFunction(*fn);
+    codegen_context.verify(*fn);
 
     return fn;
   }
 
   // Error reading body, remove function.
   fn->eraseFromParent();
+  codegen_context.end_profile(nullptr);
 
   debug_info.pop_subprogram();
   return nullptr;
@@ -346,9 +736,30 @@ Function *Definition::codegen(CodegenContext &codegen_context) const {
 
 }  // namespace function
 
-Value *IfThenElse::codegen(CodegenContext &codegen_context) const {
+TopLevel::TopLevel(PrototypePtr prototype)
+    : kind_(Kind::extern_), prototype_(std::move(prototype)) {}
+
+TopLevel::TopLevel(Kind kind, DefinitionPtr definition)
+    : kind_(kind), definition_(std::move(definition)) {}
+
+const function::Prototype *TopLevel::prototype() const {
+  if (kind_ == Kind::extern_) {
+    return prototype_.get();
+  }
+  return definition_->prototype();
+}
+
+Function *TopLevel::codegen(CodegenContext &codegen_context) const {
+  if (kind_ == Kind::extern_) {
+    return prototype_->codegen(codegen_context);
+  }
+  return definition_->codegen(codegen_context);
+}
+
+
+Typed IfThenElse::codegen(CodegenContext &codegen_context) const {
   codegen_context.emit_location(this);
-  Value *condition_value = condition_->codegen(codegen_context);
+  Typed condition_value = condition_->codegen(codegen_context);
   if (!condition_value) {
     return nullptr;
   }
@@ -356,8 +767,8 @@ Value *IfThenElse::codegen(CodegenContext &codegen_context) const {
   auto &builder = codegen_context.builder();
   auto &context = codegen_context.context();
 
-  condition_value = builder.CreateFCmpONE(
-      condition_value, ConstantFP::get(context, APFloat(0.0)), "ifcond");
+  Value *branch_condition =
+      condition(codegen_context, condition_value, "ifcond");
 
   Function *fn = builder.GetInsertBlock()->getParent();
 
@@ -365,61 +776,78 @@ Value *IfThenElse::codegen(CodegenContext &codegen_context) const {
   BasicBlock *otherwise_block = BasicBlock::Create(context, "else");
   BasicBlock *merge_block = BasicBlock::Create(context, "ifcont");
 
-  codegen_context.builder().CreateCondBr(condition_value, then_block,
-                                         otherwise_block);
+  llvm::BranchInst *branch = codegen_context.builder().CreateCondBr(
+      branch_condition, then_block, otherwise_block);
 
   // Emit otherwise value.
   codegen_context.builder().SetInsertPoint(then_block);
-  Value *then_value = then_->codegen(codegen_context);
+  size_t then_counter = codegen_context.count();
+  Typed then_value = then_->codegen(codegen_context);
 
   if (!then_value) {
     return nullptr;
   }
 
-  builder.CreateBr(merge_block);
-
   then_block = builder.GetInsertBlock();
 
   fn->getBasicBlockList().push_back(otherwise_block);
   builder.SetInsertPoint(otherwise_block);
+  size_t otherwise_counter = codegen_context.count();
 
-  Value *otherwise_value = otherwise_->codegen(codegen_context);
+  Typed otherwise_value = otherwise_->codegen(codegen_context);
   if (!otherwise_value) {
     return nullptr;
   }
 
-  builder.CreateBr(merge_block);
   otherwise_block = builder.GetInsertBlock();
 
+  // Both branches end in the type they unify to, converting on their way out.
+  std::optional<ValueType> type = unify(then_value, otherwise_value);
+  if (!type) {
+    return nullptr;
+  }
+  builder.SetInsertPoint(then_block);
+  Value *then_result = convert(codegen_context, then_value, *type);
+  builder.CreateBr(merge_block);
+  builder.SetInsertPoint(otherwise_block);
+  Value *otherwise_result = convert(codegen_context, otherwise_value, *type);
+  builder.CreateBr(merge_block);
+
   fn->getBasicBlockList().push_back(merge_block);
   builder.SetInsertPoint(merge_block);
 
-  PHINode *phi_node = builder.CreatePHI(Type::getDoubleTy(context), 2, "iftmp");
+  PHINode *phi_node =
+      builder.CreatePHI(codegen_context.type(*type), 2, "iftmp");
 
-  phi_node->addIncoming(then_value, then_block);
-  phi_node->addIncoming(otherwise_value, otherwise_block);
+  phi_node->addIncoming(then_result, then_block);
+  phi_node->addIncoming(otherwise_result, otherwise_block);
 
-  return phi_node;
+  auto then_count = codegen_context.profile_count(then_counter);
+  auto otherwise_count = codegen_context.profile_count(otherwise_counter);
+  if (then_count && otherwise_count) {
+    codegen_context.set_branch_weights(branch, *then_count, *otherwise_count);
+  }
+
+  return {phi_node, *type};
 }
 
-llvm::Value *For::codegen(CodegenContext &codegen_context) const {
+Typed For::codegen(CodegenContext &codegen_context) const {
   auto &builder = codegen_context.builder();
   Function *fn = builder.GetInsertBlock()->getParent();
 
-  // Emit the start code first, without 'variable' in scope.
-  AllocaInst *alloca = codegen_context.create_entry_block_alloca(fn, var_);
-
   codegen_context.emit_location(this);
 
-  Value *start_value = start_->codegen(codegen_context);
+  // Emit the start code first, without 'variable' in scope.
+  Typed start_value = start_->codegen(codegen_context);
+  if (!start_value) return nullptr;
+  ValueType type = type_.value_or(start_value.type);
+  start_value = coerce(codegen_context, start_value, type);
   if (!start_value) return nullptr;
 
   auto &context = codegen_context.context();
 
   // Make the new basic block for the loop header, inserting after current
   // block.
-  builder.CreateStore(start_value, alloca);
-
   BasicBlock *pre_header_block = builder.GetInsertBlock();
 
   BasicBlock *loop_block = BasicBlock::Create(context, "loop", fn);
@@ -431,13 +859,16 @@ llvm::Value *For::codegen(CodegenContext &codegen_context) const {
   builder.SetInsertPoint(loop_block);
 
   // Start the PHI node with an entry for start_.
-  PHINode *variable = builder.CreatePHI(Type::getDoubleTy(context), 2, var_);
-  variable->addIncoming(start_value, pre_header_block);
+  PHINode *variable = builder.CreatePHI(codegen_context.type(type), 2, var_);
+  variable->addIncoming(start_value.value, pre_header_block);
+
+  // Counts iterations; the counter in the after block counts exits.
+  size_t loop_counter = codegen_context.count();
 
   // Within the loop, the variable is defined equal to the PHI node.  If it
   // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *old_value = codegen_context.lookup(var_);
-  codegen_context.set(var_, alloca);
+  CodegenContext::Binding old_value = codegen_context.lookup(var_);
+  codegen_context.set(var_, {variable, type});
 
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
@@ -445,44 +876,57 @@ llvm::Value *For::codegen(CodegenContext &codegen_context) const {
   if (!body_->codegen(codegen_context)) return nullptr;
 
   // Emit the step value.
-  Value *step_value = nullptr;
+  Typed step_value;
   if (step_) {
     step_value = step_->codegen(codegen_context);
     if (!step_value) return nullptr;
   } else {
-    // If not specified, use 1.0.
+    // If not specified, use 1.0, a literal as if written, so that it takes
+    // the type of the variable.
     step_value = ConstantFP::get(context, APFloat(1.0));
+    step_value.literal = true;
   }
 
-  Value *current_var =
-      builder.CreateLoad(alloca->getAllocatedType(), alloca, var_.c_str());
-  Value *next_var = builder.CreateFAdd(variable, step_value, "nextvar");
+  Typed next_var =
+      arithmetic(codegen_context, Op::add, {variable, type}, step_value);
+  if (next_var) next_var = coerce(codegen_context, next_var, type);
+  if (!next_var) return nullptr;
 
-  builder.CreateStore(next_var, alloca);
+  // The end condition sees the variable as the next iteration will.
+  codegen_context.set(var_, {next_var.value, type});
 
   // Compute the end condition.
-  Value *end_condition = end_->codegen(codegen_context);
-  if (!end_condition) return nullptr;
+  Typed end_value = end_->codegen(codegen_context);
+  if (!end_value) return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  end_condition = builder.CreateFCmpONE(
-      end_condition, ConstantFP::get(context, APFloat(0.0)), "loopcond");
+  // Convert condition to a bool by comparing non-equal to 0.
+  Value *end_condition = condition(codegen_context, end_value, "loopcond");
 
   // Create the "after loop" block and insert it.
   BasicBlock *loop_end_block = builder.GetInsertBlock();
   BasicBlock *after_block = BasicBlock::Create(context, "afterloop", fn);
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  builder.CreateCondBr(end_condition, loop_end_block, after_block);
+  // Insert the conditional branch into the end of LoopEndBB, back to the
+  // loop header.
+  llvm::BranchInst *branch =
+      builder.CreateCondBr(end_condition, loop_block, after_block);
 
   // Any new code will be inserted in AfterBB.
   builder.SetInsertPoint(after_block);
+  size_t exit_counter = codegen_context.count();
+
+  auto loop_count = codegen_context.profile_count(loop_counter);
+  auto exit_count = codegen_context.profile_count(exit_counter);
+  if (loop_count && exit_count && *loop_count >= *exit_count) {
+    codegen_context.set_branch_weights(branch, *loop_count - *exit_count,
+                                       *exit_count);
+  }
 
   // Add a new entry to the PHI node for the backedge.
-  variable->addIncoming(next_var, loop_end_block);
+  variable->addIncoming(next_var.value, loop_end_block);
 
   // Restore the unshadowed variable.
-  if (old_value) {
+  if (old_value.value) {
     codegen_context.set(var_, old_value);
   } else {
     codegen_context.erase(var_);
@@ -491,3 +935,235 @@ llvm::Value *For::codegen(CodegenContext &codegen_context) const {
   // for expr always returns 0.0.
   return Constant::getNullValue(Type::getDoubleTy(context));
 }
+
+namespace {
+
+/// f64_codegen - expr, coerced to f64: parfor and the reductions, and the
+/// runtime under parfor, are f64 throughout.
+Value *f64_codegen(const Expr &expr, CodegenContext &codegen_context) {
+  Typed value = expr.codegen(codegen_context);
+  if (!value) return nullptr;
+  return coerce(codegen_context, value, ValueType::f64).value;
+}
+
+}  // namespace
+
+Typed ParallelFor::codegen(CodegenContext &codegen_context) const {
+  auto &builder = codegen_context.builder();
+  auto &context = codegen_context.context();
+  llvm::Module &module = codegen_context.module();
+  Function *fn = builder.GetInsertBlock()->getParent();
+  Type *double_type = Type::getDoubleTy(context);
+
+  codegen_context.emit_location(this);
+  Value *start_value = f64_codegen(*start_, codegen_context);
+  if (!start_value) return nullptr;
+  Value *end_value = f64_codegen(*end_, codegen_context);
+  if (!end_value) return nullptr;
+  Value *step_value = ConstantFP::get(context, APFloat(1.0));
+  if (step_) {
+    step_value = f64_codegen(*step_, codegen_context);
+    if (!step_value) return nullptr;
+  }
+
+  // The body is outlined into a function of the environment, a struct of the
+  // values of all variables in scope, whatever their types, and of the loop
+  // variable:
+  //
+  //     double fn.parfor(const double *env, double i)
+  //
+  // The runtime passes env on as the const double * it takes it as.
+  CodegenContext::Scope scope = codegen_context.scope();
+  std::vector<Type *> env_types;
+  for (const auto &variable : scope) {
+    env_types.push_back(variable.second.value->getType());
+  }
+  llvm::StructType *env_type = llvm::StructType::get(context, env_types);
+  llvm::AllocaInst *env =
+      llvm::IRBuilder<>(&fn->getEntryBlock(), fn->getEntryBlock().begin())
+          .CreateAlloca(env_type, nullptr, "env");
+  unsigned slot = 0;
+  for (const auto &variable : scope) {
+    builder.CreateStore(variable.second.value,
+                        builder.CreateStructGEP(env_type, env, slot++));
+  }
+
+  llvm::PointerType *env_pointer_type = llvm::PointerType::getUnqual(double_type);
+  FunctionType *body_type = FunctionType::get(
+      double_type, {env_pointer_type, double_type}, /*isVarArg=*/false);
+  Function *body_fn = Function::Create(body_type, Function::InternalLinkage,
+                                       fn->getName() + ".parfor", module);
+  llvm::Argument *env_arg = body_fn->getArg(0);
+  env_arg->setName("env");
+  body_fn->getArg(1)->setName(var_);
+
+  llvm::IRBuilderBase::InsertPoint insert_point = builder.saveIP();
+  builder.SetInsertPoint(BasicBlock::Create(context, "entry", body_fn));
+  DebugInfo &debug_info = codegen_context.debug_info();
+  debug_info.push_subprogram(body_fn->getName().str(), location(), 1, body_fn);
+
+  codegen_context.clear();
+  Value *env_struct =
+      builder.CreatePointerCast(env_arg, env_type->getPointerTo());
+  slot = 0;
+  for (const auto &variable : scope) {
+    ValueType type = variable.second.type;
+    Value *value = builder.CreateLoad(
+        codegen_context.type(type),
+        builder.CreateStructGEP(env_type, env_struct, slot++), variable.first);
+    codegen_context.set(variable.first, {value, type});
+  }
+  codegen_context.set(var_, {body_fn->getArg(1), ValueType::f64});
+
+  Value *body_value = f64_codegen(*body_, codegen_context);
+  if (body_value) {
+    builder.CreateRet(body_value);
+    codegen_context.verify(*body_fn);
+  } else {
+    body_fn->eraseFromParent();
+  }
+
+  debug_info.pop_subprogram();
+  codegen_context.set_scope(std::move(scope));
+  builder.restoreIP(insert_point);
+  if (!body_value) return nullptr;
+
+  // double kl_parallel_for(double start, double end, double step,
+  //                        double (*body)(const double *, double),
+  //                        const double *env, int reduction)
+  codegen_context.emit_location(this);
+  llvm::FunctionCallee parallel_for = module.getOrInsertFunction(
+      "kl_parallel_for", double_type, double_type, double_type, double_type,
+      body_fn->getType(), env_pointer_type, Type::getInt32Ty(context));
+  return builder.CreateCall(
+      parallel_for,
+      {start_value, end_value, step_value, body_fn,
+       builder.CreatePointerCast(env, env_pointer_type),
+       builder.getInt32(static_cast<int>(reduction_))},
+      "parfor");
+}
+
+Typed Reduce::codegen(CodegenContext &codegen_context) const {
+  auto &builder = codegen_context.builder();
+  auto &context = codegen_context.context();
+  Function *fn = builder.GetInsertBlock()->getParent();
+  Type *double_type = Type::getDoubleTy(context);
+  Type *count_type = Type::getInt64Ty(context);
+
+  // The bounds, without the variable in scope.
+  codegen_context.emit_location(this);
+  Value *start_value = f64_codegen(*start_, codegen_context);
+  if (!start_value) return nullptr;
+  Value *end_value = f64_codegen(*end_, codegen_context);
+  if (!end_value) return nullptr;
+  Value *step_value = ConstantFP::get(context, APFloat(1.0));
+  if (step_) {
+    step_value = f64_codegen(*step_, codegen_context);
+    if (!step_value) return nullptr;
+  }
+
+  // The loop is driven by an integer count of iterations, worked out up front
+  // as kl_parallel_for does, rather than by comparing the double variable, so
+  // that it has the trip count and induction variable the vectorizer needs.
+  // A zero step, a NaN bound, or a range too large to count (an infinite
+  // span, which fptosi would make poison) runs nothing.
+  Value *span = builder.CreateFDiv(builder.CreateFSub(end_value, start_value),
+                                   step_value, "span");
+  span = builder.CreateUnaryIntrinsic(llvm::Intrinsic::ceil, span);
+  Value *zero = ConstantFP::get(double_type, 0);
+  Value *countable = builder.CreateAnd(
+      builder.CreateFCmpOGT(span, zero),
+      builder.CreateFCmpOLT(span, ConstantFP::get(double_type, 0x1p63)));
+  span = builder.CreateSelect(countable, span, zero);
+  Value *count = builder.CreateFPToSI(span, count_type, "count");
+
+  Value *identity = nullptr;
+  switch (reduction_) {
+    case Reduction::none:
+    case Reduction::sum:
+      identity = ConstantFP::get(double_type, 0);
+      break;
+    case Reduction::product:
+      identity = ConstantFP::get(double_type, 1);
+      break;
+    case Reduction::min:
+      identity = ConstantFP::getInfinity(double_type);
+      break;
+    case Reduction::max:
+      identity = ConstantFP::getInfinity(double_type, /*Negative=*/true);
+      break;
+  }
+
+  BasicBlock *pre_header_block = builder.GetInsertBlock();
+  BasicBlock *loop_block = BasicBlock::Create(context, "reduce", fn);
+  BasicBlock *after_block = BasicBlock::Create(context, "afterreduce");
+  builder.CreateCondBr(
+      builder.CreateICmpSGT(count, llvm::ConstantInt::get(count_type, 0)),
+      loop_block, after_block);
+
+  builder.SetInsertPoint(loop_block);
+  PHINode *index = builder.CreatePHI(count_type, 2, "index");
+  index->addIncoming(llvm::ConstantInt::get(count_type, 0), pre_header_block);
+  PHINode *accumulated = builder.CreatePHI(double_type, 2, "accumulated");
+  accumulated->addIncoming(identity, pre_header_block);
+
+  // i = start + index * step.
+  Value *variable = builder.CreateFAdd(
+      start_value,
+      builder.CreateFMul(builder.CreateSIToFP(index, double_type), step_value),
+      var_);
+  CodegenContext::Binding old_value = codegen_context.lookup(var_);
+  codegen_context.set(var_, {variable, ValueType::f64});
+
+  Value *body_value = f64_codegen(*body_, codegen_context);
+  if (!body_value) return nullptr;
+
+  // Reassociating the combining operation is what lets the vectorizer keep
+  // several partial results and combine them at the end. The flag is on this
+  // instruction only; the body keeps strict semantics.
+  llvm::FastMathFlags reassociate;
+  reassociate.setAllowReassoc();
+  Value *combined = nullptr;
+  switch (reduction_) {
+    case Reduction::none:
+    case Reduction::sum:
+      combined = builder.CreateFAdd(accumulated, body_value, "sum");
+      break;
+    case Reduction::product:
+      combined = builder.CreateFMul(accumulated, body_value, "prod");
+      break;
+    case Reduction::min:
+      combined = builder.CreateBinaryIntrinsic(llvm::Intrinsic::minnum,
+                                               accumulated, body_value);
+      break;
+    case Reduction::max:
+      combined = builder.CreateBinaryIntrinsic(llvm::Intrinsic::maxnum,
+                                               accumulated, body_value);
+      break;
+  }
+  llvm::cast<llvm::Instruction>(combined)->setFastMathFlags(reassociate);
+
+  Value *next = builder.CreateAdd(index, llvm::ConstantInt::get(count_type, 1),
+                                  "nextindex", /*HasNUW=*/true,
+                                  /*HasNSW=*/true);
+  BasicBlock *loop_end_block = builder.GetInsertBlock();
+  builder.CreateCondBr(builder.CreateICmpNE(next, count), loop_block,
+                       after_block);
+  index->addIncoming(next, loop_end_block);
+  accumulated->addIncoming(combined, loop_end_block);
+
+  after_block->insertInto(fn);
+  builder.SetInsertPoint(after_block);
+  PHINode *result = builder.CreatePHI(double_type, 2, "reduction");
+  result->addIncoming(identity, pre_header_block);
+  result->addIncoming(combined, loop_end_block);
+
+  // Restore the unshadowed variable.
+  if (old_value.value) {
+    codegen_context.set(var_, old_value);
+  } else {
+    codegen_context.erase(var_);
+  }
+
+  return result;
+}
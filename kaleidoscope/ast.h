@@ -1,25 +1,79 @@
 #pragma once
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "lexer.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Support/raw_ostream.h"
 
 class CodegenContext;
+struct Builtin;
+
+namespace vm {
+class Compiler;
+using Register = uint16_t;
+}  // namespace vm
+
+namespace ast_file {
+class Writer;
+}  // namespace ast_file
 
 llvm::Value *LogErrorV(const char *str);
 
+/// The type of a value. Values without a type annotation are f64, as all
+/// values were before there were types, and comparisons are bool, which
+/// converts to f64 (as 0 or 1) wherever one is expected.
+// NOLINTNEXTLINE
+enum class ValueType : uint8_t { f64, f32, i64, u64, bool_ };
+
+/// type_name - The name a type is written as.
+const char *type_name(ValueType type);
+
+/// parse_type - The type written as name, if it is one.
+std::optional<ValueType> parse_type(const std::string &name);
+
+/// A value in generated code, and its type, which the LLVM type alone does not
+/// tell: i64 and u64 are both i64 to LLVM.
+struct Typed {
+  // NOLINTNEXTLINE(google-explicit-constructor)
+  Typed(llvm::Value *value = nullptr, ValueType type = ValueType::f64)
+      : value(value), type(type) {}
+  explicit operator bool() const { return value != nullptr; }
+
+  llvm::Value *value;
+  ValueType type;
+  /// Whether value is a number as written in the source, which takes on the
+  /// type of what it meets; set by Number::codegen alone, so that what
+  /// type-checks does not hang on what IRBuilder folds to a constant.
+  bool literal = false;
+};
+
+class Operation;
+
 class Expr {
  public:
   explicit Expr(SourceLocation source_location);
   virtual ~Expr();
-  virtual llvm::Value *codegen(CodegenContext &codegen_ctx) const = 0;
+  virtual Typed codegen(CodegenContext &codegen_ctx) const = 0;
+  /// Emits bytecode computing the value, returning the register holding it,
+  /// or nullopt after logging an error. Defined in vm.cc.
+  virtual std::optional<vm::Register> compile(vm::Compiler &compiler) const = 0;
+  /// Appends the node, after its children, to a binary AST, returning its
+  /// index. Defined in ast_file.cc.
+  virtual uint32_t write(ast_file::Writer &writer) const = 0;
   virtual const SourceLocation &location() const;
   virtual llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent);
 
+  /// This expression as an Operation, or nullptr if it is not one.
+  virtual const Operation *as_operation() const { return nullptr; }
+  virtual Operation *as_operation() { return nullptr; }
+
  private:
   SourceLocation source_location_;
 };
@@ -32,7 +86,9 @@ enum class Op { add, sub, mul, div, mod, lt, unknown };
 class Number : public Expr {
  public:
   Number(double value, SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent) final;
 
  private:
@@ -42,7 +98,9 @@ class Number : public Expr {
 class Variable : public Expr {
  public:
   Variable(std::string name, SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent) final;
 
  private:
@@ -51,10 +109,19 @@ class Variable : public Expr {
 
 class VarIn : public Expr {
  public:
-  using Assignment = std::pair<std::string, ExprPtr>;
+  /// name: type = value, where the type and the value are optional. Without
+  /// a type, the variable has the type of its value; without a value, it is
+  /// 0.
+  struct Assignment {
+    std::string name;
+    std::optional<ValueType> type;
+    ExprPtr value;
+  };
   VarIn(std::vector<Assignment> assignments, ExprPtr body,
         SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
 
  private:
@@ -62,22 +129,127 @@ class VarIn : public Expr {
   ExprPtr body_;
 };
 
-class BinaryOp : public Expr {
+/// An operator or a call: evaluates its operands, in order, and combines their
+/// values, and does nothing else in between. Generated code nests these
+/// thousands deep, in parentheses or in chains of operators, so an operation
+/// and the operations nested in its operands are generated, compiled, written,
+/// dumped and destroyed by loops over explicit stacks (see post_order()) rather
+/// than by recursion. Other expressions recurse, a level per construct.
+class Operation : public Expr {
  public:
-  BinaryOp(Op op, ExprPtr lhs, ExprPtr rhs, SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  ~Operation() override;
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
+  const Operation *as_operation() const final { return this; }
+  Operation *as_operation() final { return this; }
+
+  llvm::ArrayRef<ExprPtr> operands() const { return operands_; }
+
+  // The steps of the above for this operation alone, given what they gave for
+  // the operands.
+
+  /// Emits IR combining the operands' values.
+  virtual Typed combine(CodegenContext &codegen_context,
+                        llvm::ArrayRef<Typed> operands) const = 0;
+  /// Emits bytecode combining the operands' values. Operand i is in register
+  /// first + i, unless it is in that of a variable.
+  virtual std::optional<vm::Register> combine(
+      vm::Compiler &compiler, vm::Register first,
+      llvm::ArrayRef<vm::Register> operands) const = 0;
+  /// Appends the node, given the indices of the operands'.
+  virtual uint32_t combine(ast_file::Writer &writer,
+                           llvm::ArrayRef<uint32_t> operands) const = 0;
+  /// Prints what dump() prints of the node itself, ahead of its location, and
+  /// ahead of the operand at index.
+  virtual void dump_name(llvm::raw_ostream &out) const = 0;
+  virtual const char *dump_label(size_t index) const = 0;
+
+  /// post_order - Walks this operation and those nested in its operands, each
+  /// after its operands, with explicit stacks. Walker has:
+  ///
+  ///     void enter(const Operation *)      before the operation's operands
+  ///     std::optional<Value> leaf(const Expr *)
+  ///                                        an operand that is no operation
+  ///     Value operand(const Operation *, size_t index, Value)
+  ///                                        takes an operand's value
+  ///     std::optional<Value> combine(const Operation *, ArrayRef<Value>)
+  ///
+  /// Returns nullopt as soon as leaf() or combine() does.
+  template <class Value, class Walker>
+  std::optional<Value> post_order(Walker &walker) const;
+
+ protected:
+  explicit Operation(SourceLocation source_location);
+
+  llvm::SmallVector<ExprPtr, 2> operands_;
+};
+
+template <class Value, class Walker>
+std::optional<Value> Operation::post_order(Walker &walker) const {
+  struct Frame {
+    const Operation *operation;
+    /// The operand to walk next.
+    size_t next;
+    /// Where the values of its operands start in values.
+    size_t values;
+  };
+  std::vector<Frame> frames{{this, 0, 0}};
+  std::vector<Value> values;
+  walker.enter(this);
+  while (true) {
+    Frame &frame = frames.back();
+    llvm::ArrayRef<ExprPtr> operands = frame.operation->operands();
+    std::optional<Value> value;
+    if (frame.next < operands.size()) {
+      const Expr *operand = operands[frame.next].get();
+      if (const Operation *operation = operand->as_operation()) {
+        walker.enter(operation);
+        frames.push_back({operation, 0, values.size()});
+        continue;
+      }
+      value = walker.leaf(operand);
+    } else {
+      llvm::ArrayRef<Value> operand_values(values);
+      value = walker.combine(frame.operation,
+                             operand_values.drop_front(frame.values));
+      if (value) {
+        values.erase(values.begin() + frame.values, values.end());
+        frames.pop_back();
+        if (frames.empty()) return value;
+      }
+    }
+    if (!value) return std::nullopt;
+    Frame &parent = frames.back();
+    values.push_back(walker.operand(parent.operation, parent.next++, *value));
+  }
+}
+
+class BinaryOp : public Operation {
+ public:
+  BinaryOp(Op op, ExprPtr lhs, ExprPtr rhs, SourceLocation source_location);
+  Typed combine(CodegenContext &codegen_context,
+                llvm::ArrayRef<Typed> operands) const final;
+  std::optional<vm::Register> combine(
+      vm::Compiler &compiler, vm::Register first,
+      llvm::ArrayRef<vm::Register> operands) const final;
+  uint32_t combine(ast_file::Writer &writer,
+                   llvm::ArrayRef<uint32_t> operands) const final;
+  void dump_name(llvm::raw_ostream &out) const final;
+  const char *dump_label(size_t index) const final;
 
  private:
   Op op_;
-  ExprPtr lhs_, rhs_;
 };
 
 class IfThenElse : public Expr {
  public:
   IfThenElse(ExprPtr condition, ExprPtr then, ExprPtr otherwise,
              SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
 
  private:
@@ -86,16 +258,78 @@ class IfThenElse : public Expr {
   ExprPtr otherwise_;
 };
 
+/// for i: type = start, end, step in body: runs body, then steps i, for as
+/// long as end, evaluated after each step, holds. Without a type, i has the
+/// type of start. Its value is 0.
 class For : public Expr {
  public:
-  For(std::string var, ExprPtr start, ExprPtr end, ExprPtr step, ExprPtr body,
-      SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
+  For(std::string var, std::optional<ValueType> type, ExprPtr start,
+      ExprPtr end, ExprPtr step, ExprPtr body, SourceLocation source_location);
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
+  llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
+
+ private:
+  std::string var_;
+  std::optional<ValueType> type_;
+
+  ExprPtr start_;
+  ExprPtr end_;
+  ExprPtr step_;
+
+  ExprPtr body_;
+};
+
+// How the values of the iterations of a loop are combined. The values are
+// those of KlReduction in libkl.h, which generated code passes to the runtime.
+// NOLINTNEXTLINE
+enum class Reduction { none, sum, product, min, max };
+
+/// parfor i = start, end, step in body: runs body for i from start up to, and
+/// not including, end, with the iterations spread over all cores. Unlike for,
+/// end is a bound rather than a condition, since the iterations are counted up
+/// front. Its value is 0, or the iterations' values combined by reduction, in
+/// an unspecified order.
+class ParallelFor : public Expr {
+ public:
+  ParallelFor(std::string var, ExprPtr start, ExprPtr end, ExprPtr step,
+              Reduction reduction, ExprPtr body,
+              SourceLocation source_location);
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
   llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
 
  private:
   std::string var_;
 
+  ExprPtr start_;
+  ExprPtr end_;
+  ExprPtr step_;
+  Reduction reduction_;
+
+  ExprPtr body_;
+};
+
+/// sum i = start, end, step in body (or prod, min, max): the values of body
+/// for i from start up to, and not including, end, combined by reduction.
+/// Codegen counts the iterations up front and gives the combining operation,
+/// and nothing else, leave to reassociate, so that the loop vectorizes without
+/// fast-math.
+class Reduce : public Expr {
+ public:
+  Reduce(Reduction reduction, std::string var, ExprPtr start, ExprPtr end,
+         ExprPtr step, ExprPtr body, SourceLocation source_location);
+  Typed codegen(CodegenContext &codegen_context) const final;
+  std::optional<vm::Register> compile(vm::Compiler &compiler) const final;
+  uint32_t write(ast_file::Writer &writer) const final;
+  llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
+
+ private:
+  Reduction reduction_;
+  std::string var_;
+
   ExprPtr start_;
   ExprPtr end_;
   ExprPtr step_;
@@ -118,17 +352,30 @@ using DefinitionPtr = std::unique_ptr<function::Definition>;
 
 namespace function {
 
+/// name(arg: type ...): type, where the types are optional, and f64 if left
+/// out.
 class Prototype {
  public:
-  Prototype(std::string name, Args args, SourceLocation source_location);
+  /// With no types, all arguments are f64.
+  Prototype(std::string name, Args args, SourceLocation source_location,
+            std::vector<ValueType> types = {},
+            ValueType return_type = ValueType::f64);
+  /// codegen - Declares the function, with the C ABI of its types: a bool is
+  /// passed and returned zero-extended, as C passes a _Bool.
   llvm::Function *codegen(CodegenContext &codegen_context) const;
   const std::string &name() const { return name_; };
   const Args &args() const { return args_; }
+  const std::vector<ValueType> &types() const { return types_; }
+  ValueType return_type() const { return return_type_; }
+  /// Whether any type is not f64.
+  bool typed() const;
   const SourceLocation &location() const { return source_location_; }
 
  private:
   std::string name_;
   Args args_;
+  std::vector<ValueType> types_;
+  ValueType return_type_;
   SourceLocation source_location_;
 };
 
@@ -138,6 +385,7 @@ class Definition {
              SourceLocation source_location);
   llvm::Function *codegen(CodegenContext &codegen_context) const;
   const Prototype *prototype() const { return prototype_.get(); }
+  const Expr *body() const { return body_.get(); }
   const SourceLocation &location() const { return source_location_; }
 
  private:
@@ -146,15 +394,51 @@ class Definition {
   SourceLocation source_location_;
 };
 
-class Call : public Expr {
+class Call : public Operation {
  public:
   Call(std::string name, ArgExprs args, SourceLocation source_location);
-  llvm::Value *codegen(CodegenContext &codegen_context) const final;
-  llvm::raw_ostream &dump(llvm::raw_ostream &out, int indent_level) final;
+  Typed combine(CodegenContext &codegen_context,
+                llvm::ArrayRef<Typed> operands) const final;
+  std::optional<vm::Register> combine(
+      vm::Compiler &compiler, vm::Register first,
+      llvm::ArrayRef<vm::Register> operands) const final;
+  uint32_t combine(ast_file::Writer &writer,
+                   llvm::ArrayRef<uint32_t> operands) const final;
+  void dump_name(llvm::raw_ostream &out) const final;
+  const char *dump_label(size_t index) const final;
 
  private:
+  Typed builtin_codegen(const Builtin &builtin,
+                        CodegenContext &codegen_context,
+                        llvm::ArrayRef<Typed> operands) const;
+
   std::string name_;
-  ArgExprs args_;
 };
 
 }  // namespace function
+
+/// A top-level item of a source file: an `extern` declaration, a `def`, or an
+/// expression, which the parser wraps in an anonymous definition.
+class TopLevel {
+ public:
+  // NOLINTNEXTLINE
+  enum class Kind { extern_, definition, expression };
+
+  explicit TopLevel(PrototypePtr prototype);
+  TopLevel(Kind kind, DefinitionPtr definition);
+
+  Kind kind() const { return kind_; }
+  const function::Prototype *prototype() const;
+  const function::Definition *definition() const { return definition_.get(); }
+
+  /// Emits the declaration or function for this item into the module.
+  llvm::Function *codegen(CodegenContext &codegen_context) const;
+
+ private:
+  Kind kind_;
+  PrototypePtr prototype_;
+  DefinitionPtr definition_;
+};
+
+/// A parsed source file, in source order.
+using Program = std::vector<TopLevel>;
@@ -0,0 +1,545 @@
+#include "ast_file.h"
+
+#include <cstring>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace ast_file {
+
+namespace {
+
+void write_bytes(llvm::raw_ostream &out, const void *data, size_t size) {
+  out.write(static_cast<const char *>(data), size);
+}
+
+}  // namespace
+
+uint8_t encode_type(std::optional<ValueType> type) {
+  return type ? static_cast<uint8_t>(*type) + 1 : 0;
+}
+
+std::optional<ValueType> decode_type(uint32_t type) {
+  if (type == 0) return std::nullopt;
+  return static_cast<ValueType>(type - 1);
+}
+
+const char *kind_name(Kind kind) {
+  switch (kind) {
+    case Kind::number:
+      return "Number";
+    case Kind::variable:
+      return "Variable";
+    case Kind::var_in:
+      return "VarIn";
+    case Kind::binary_op:
+      return "BinaryOp";
+    case Kind::if_then_else:
+      return "IfThenElse";
+    case Kind::for_:
+      return "For";
+    case Kind::parallel_for:
+      return "ParallelFor";
+    case Kind::reduce:
+      return "Reduce";
+    case Kind::call:
+      return "Call";
+  }
+  return "";
+}
+
+uint32_t Writer::expr(const Expr *expr) {
+  return expr ? expr->write(*this) : kNone;
+}
+
+uint32_t Writer::node(Kind kind, const SourceLocation &location,
+                      uint32_t edges, uint32_t count) {
+  Node node{};
+  node.kind = kind;
+  node.edges = edges;
+  node.count = count;
+  node.line = location.line;
+  node.column = location.column;
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+uint32_t Writer::edges(llvm::ArrayRef<uint32_t> edges) {
+  uint32_t first = edges_.size();
+  edges_.insert(edges_.end(), edges.begin(), edges.end());
+  return first;
+}
+
+uint32_t Writer::string(const std::string &string) {
+  auto inserted = interned_.emplace(string, strings_.size());
+  if (inserted.second) {
+    strings_.push_back(string);
+  }
+  return inserted.first->second;
+}
+
+std::array<uint64_t, kKinds> Writer::count(const Expr &expr) {
+  Writer writer;
+  writer.expr(&expr);
+  std::array<uint64_t, kKinds> counts{};
+  for (const Node &node : writer.nodes_) {
+    counts[static_cast<size_t>(node.kind)]++;
+  }
+  return counts;
+}
+
+bool Writer::write(const Program &program, const std::string &path) {
+  Writer writer;
+  for (const TopLevel &top_level : program) {
+    const function::Prototype *prototype = top_level.prototype();
+    Item item{};
+    item.kind = static_cast<uint8_t>(top_level.kind());
+    item.name = writer.string(prototype->name());
+    std::vector<uint32_t> args;
+    for (const std::string &arg : prototype->args()) {
+      args.push_back(writer.string(arg));
+    }
+    for (ValueType type : prototype->types()) {
+      args.push_back(encode_type(type));
+    }
+    item.args = writer.edges(args);
+    item.arity = prototype->args().size();
+    item.return_type = encode_type(prototype->return_type());
+    item.prototype_line = prototype->location().line;
+    item.prototype_column = prototype->location().column;
+    item.body = kNone;
+    if (const function::Definition *definition = top_level.definition()) {
+      item.body = writer.expr(definition->body());
+      item.line = definition->location().line;
+      item.column = definition->location().column;
+    }
+    writer.items_.push_back(item);
+  }
+
+  std::error_code error_code;
+  llvm::raw_fd_ostream out(path, error_code, llvm::sys::fs::OF_None);
+  if (error_code) {
+    llvm::errs() << "Could not open file: " << error_code.message() << '\n';
+    return false;
+  }
+
+  std::vector<uint32_t> offsets{0};
+  for (const std::string &string : writer.strings_) {
+    offsets.push_back(offsets.back() + string.size());
+  }
+
+  Header header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.nodes = writer.nodes_.size();
+  header.items = writer.items_.size();
+  header.edges = writer.edges_.size();
+  header.strings = writer.strings_.size();
+  header.string_bytes = offsets.back();
+
+  write_bytes(out, &header, sizeof(header));
+  write_bytes(out, writer.nodes_.data(), writer.nodes_.size() * sizeof(Node));
+  write_bytes(out, writer.items_.data(), writer.items_.size() * sizeof(Item));
+  write_bytes(out, writer.edges_.data(),
+              writer.edges_.size() * sizeof(uint32_t));
+  write_bytes(out, offsets.data(), offsets.size() * sizeof(uint32_t));
+  for (const std::string &string : writer.strings_) {
+    out << string;
+  }
+  return true;
+}
+
+File::File(std::unique_ptr<llvm::MemoryBuffer> buffer)
+    : buffer_(std::move(buffer)) {}
+
+std::unique_ptr<File> File::open(const std::string &path) {
+  // Mapped rather than read, unless the file is small.
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    llvm::errs() << "Could not open file: " << buffer.getError().message()
+                 << '\n';
+    return nullptr;
+  }
+
+  std::unique_ptr<File> file(new File(std::move(*buffer)));
+  if (!file->check(path)) return nullptr;
+  return file;
+}
+
+bool File::check(const std::string &path) {
+  auto fail = [&](const char *message) {
+    llvm::errs() << "Error: " << path << ": " << message << '\n';
+    return false;
+  };
+
+  const char *begin = buffer_->getBufferStart();
+  size_t size = buffer_->getBufferSize();
+  if (reinterpret_cast<uintptr_t>(begin) % alignof(Node) != 0) {
+    return fail("misaligned buffer");
+  }
+  if (size < sizeof(Header)) return fail("not an AST file");
+  header_ = reinterpret_cast<const Header *>(begin);
+  if (memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0) {
+    return fail("not an AST file");
+  }
+  if (header_->version != kVersion) {
+    return fail("AST file of another version of kali");
+  }
+
+  // In 64 bits, the sizes of the sections cannot overflow.
+  uint64_t expected = sizeof(Header) +
+                      uint64_t(header_->nodes) * sizeof(Node) +
+                      uint64_t(header_->items) * sizeof(Item) +
+                      uint64_t(header_->edges) * sizeof(uint32_t) +
+                      (uint64_t(header_->strings) + 1) * sizeof(uint32_t) +
+                      header_->string_bytes;
+  if (size != expected) return fail("truncated AST file");
+
+  nodes_ = reinterpret_cast<const Node *>(begin + sizeof(Header));
+  items_ = reinterpret_cast<const Item *>(nodes_ + header_->nodes);
+  edges_ = reinterpret_cast<const uint32_t *>(items_ + header_->items);
+  string_offsets_ = edges_ + header_->edges;
+  string_bytes_ =
+      reinterpret_cast<const char *>(string_offsets_ + header_->strings + 1);
+
+  for (uint32_t i = 0; i < header_->strings; i++) {
+    if (string_offsets_[i] > string_offsets_[i + 1] ||
+        string_offsets_[i + 1] > header_->string_bytes) {
+      return fail("bad string table");
+    }
+  }
+
+  // Each child comes before its parent, and has one parent, so that
+  // program() can move it into place in one pass.
+  std::vector<bool> taken(header_->nodes);
+  auto take = [&](uint32_t index, uint32_t parent) {
+    if (index == kNone) return true;
+    if (index >= parent || taken[index]) return false;
+    taken[index] = true;
+    return true;
+  };
+  auto run = [&](uint32_t edges, uint64_t count) {
+    return edges <= header_->edges && count <= header_->edges - edges;
+  };
+
+  for (uint32_t i = 0; i < header_->nodes; i++) {
+    const Node &node = nodes_[i];
+    uint64_t count = 0;
+    bool named = false;
+    switch (node.kind) {
+      case Kind::number:
+        break;
+      case Kind::variable:
+        named = true;
+        break;
+      case Kind::var_in:
+        count = 3 * uint64_t(node.count) + 1;
+        break;
+      case Kind::binary_op:
+        count = 2;
+        if (node.op >= static_cast<uint8_t>(Op::unknown)) {
+          return fail("bad operator");
+        }
+        break;
+      case Kind::if_then_else:
+        count = 3;
+        break;
+      case Kind::for_:
+      case Kind::parallel_for:
+      case Kind::reduce:
+        count = 4;
+        named = true;
+        if (node.op > static_cast<uint8_t>(Reduction::max)) {
+          return fail("bad reduction");
+        }
+        break;
+      case Kind::call:
+        count = node.count;
+        named = true;
+        break;
+      default:
+        return fail("bad node");
+    }
+    if (named && node.name >= header_->strings) return fail("bad name");
+    if (node.type > kMaxType) return fail("bad type");
+    if (!run(node.edges, count)) return fail("bad edges");
+
+    // The names and types of a var_in are strings and types; all other edges
+    // are children.
+    uint64_t children = node.kind == Kind::var_in ? node.count + 1 : count;
+    uint64_t names = node.kind == Kind::var_in ? children + node.count : count;
+    for (uint64_t k = 0; k < children; k++) {
+      uint32_t child = edges_[node.edges + k];
+      // The step of a loop, and the values of a var_in, may be left out.
+      bool optional = ((node.kind == Kind::for_ ||
+                        node.kind == Kind::parallel_for ||
+                        node.kind == Kind::reduce) &&
+                       k == 2) ||
+                      (node.kind == Kind::var_in && k < node.count);
+      if ((child == kNone && !optional) || !take(child, i)) {
+        return fail("bad child");
+      }
+    }
+    for (uint64_t k = children; k < names; k++) {
+      if (edges_[node.edges + k] >= header_->strings) return fail("bad name");
+    }
+    for (uint64_t k = names; k < count; k++) {
+      if (edges_[node.edges + k] > kMaxType) return fail("bad type");
+    }
+  }
+
+  for (uint32_t i = 0; i < header_->items; i++) {
+    const Item &item = items_[i];
+    if (item.kind > static_cast<uint8_t>(TopLevel::Kind::expression) ||
+        item.name >= header_->strings ||
+        !run(item.args, 2 * uint64_t(item.arity))) {
+      return fail("bad item");
+    }
+    for (uint32_t k = 0; k < item.arity; k++) {
+      if (edges_[item.args + k] >= header_->strings) return fail("bad name");
+      if (edges_[item.args + item.arity + k] > kMaxType) {
+        return fail("bad type");
+      }
+    }
+    if (item.return_type > kMaxType) return fail("bad type");
+    bool is_extern =
+        item.kind == static_cast<uint8_t>(TopLevel::Kind::extern_);
+    if ((item.body == kNone) != is_extern ||
+        !take(item.body, header_->nodes)) {
+      return fail("bad item");
+    }
+  }
+  return true;
+}
+
+std::string File::string(uint32_t index) const {
+  return std::string(string_bytes_ + string_offsets_[index],
+                     string_offsets_[index + 1] - string_offsets_[index]);
+}
+
+Program File::program() const {
+  // Children come first, so each node finds its children built, here.
+  std::vector<ExprPtr> exprs(header_->nodes);
+  auto take = [&](uint32_t index) {
+    return index == kNone ? nullptr : std::move(exprs[index]);
+  };
+
+  for (uint32_t i = 0; i < header_->nodes; i++) {
+    const Node &node = nodes_[i];
+    const uint32_t *edges = edges_ + node.edges;
+    SourceLocation location{static_cast<int>(node.line),
+                            static_cast<int>(node.column)};
+    switch (node.kind) {
+      case Kind::number:
+        exprs[i] = std::make_unique<Number>(node.number, location);
+        break;
+      case Kind::variable:
+        exprs[i] = std::make_unique<Variable>(string(node.name), location);
+        break;
+      case Kind::var_in: {
+        std::vector<VarIn::Assignment> assignments;
+        for (uint32_t k = 0; k < node.count; k++) {
+          assignments.push_back({string(edges[node.count + 1 + k]),
+                                 decode_type(edges[2 * node.count + 1 + k]),
+                                 take(edges[k])});
+        }
+        exprs[i] = std::make_unique<VarIn>(std::move(assignments),
+                                           take(edges[node.count]), location);
+      } break;
+      case Kind::binary_op:
+        exprs[i] = std::make_unique<BinaryOp>(static_cast<Op>(node.op),
+                                              take(edges[0]), take(edges[1]),
+                                              location);
+        break;
+      case Kind::if_then_else:
+        exprs[i] = std::make_unique<IfThenElse>(
+            take(edges[0]), take(edges[1]), take(edges[2]), location);
+        break;
+      case Kind::for_:
+        exprs[i] = std::make_unique<For>(
+            string(node.name), decode_type(node.type), take(edges[0]),
+            take(edges[1]), take(edges[2]), take(edges[3]), location);
+        break;
+      case Kind::parallel_for:
+        exprs[i] = std::make_unique<ParallelFor>(
+            string(node.name), take(edges[0]), take(edges[1]), take(edges[2]),
+            static_cast<Reduction>(node.op), take(edges[3]), location);
+        break;
+      case Kind::reduce:
+        exprs[i] = std::make_unique<Reduce>(
+            static_cast<Reduction>(node.op), string(node.name), take(edges[0]),
+            take(edges[1]), take(edges[2]), take(edges[3]), location);
+        break;
+      case Kind::call: {
+        function::ArgExprs args;
+        for (uint32_t k = 0; k < node.count; k++) {
+          args.push_back(take(edges[k]));
+        }
+        exprs[i] = std::make_unique<function::Call>(string(node.name),
+                                                    std::move(args), location);
+      } break;
+    }
+  }
+
+  Program program;
+  program.reserve(header_->items);
+  for (uint32_t i = 0; i < header_->items; i++) {
+    const Item &item = items_[i];
+    function::Args args;
+    std::vector<ValueType> types;
+    for (uint32_t k = 0; k < item.arity; k++) {
+      args.push_back(string(edges_[item.args + k]));
+      types.push_back(decode_type(edges_[item.args + item.arity + k])
+                          .value_or(ValueType::f64));
+    }
+    auto prototype = std::make_unique<function::Prototype>(
+        string(item.name), std::move(args),
+        SourceLocation{static_cast<int>(item.prototype_line),
+                       static_cast<int>(item.prototype_column)},
+        std::move(types),
+        decode_type(item.return_type).value_or(ValueType::f64));
+
+    auto kind = static_cast<TopLevel::Kind>(item.kind);
+    if (kind == TopLevel::Kind::extern_) {
+      program.emplace_back(std::move(prototype));
+      continue;
+    }
+    program.emplace_back(
+        kind, std::make_unique<function::Definition>(
+                  std::move(prototype), take(item.body),
+                  SourceLocation{static_cast<int>(item.line),
+                                 static_cast<int>(item.column)}));
+  }
+  return program;
+}
+
+}  // namespace ast_file
+
+// The AST nodes' part of Writer.
+
+uint32_t Number::write(ast_file::Writer &writer) const {
+  uint32_t index = writer.node(ast_file::Kind::number, location());
+  writer.at(index).number = value_;
+  return index;
+}
+
+uint32_t Variable::write(ast_file::Writer &writer) const {
+  uint32_t index = writer.node(ast_file::Kind::variable, location());
+  writer.at(index).name = writer.string(name_);
+  return index;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+uint32_t VarIn::write(ast_file::Writer &writer) const {
+  std::vector<uint32_t> edges;
+  for (const auto &assignment : assignments_) {
+    edges.push_back(writer.expr(assignment.value.get()));
+  }
+  edges.push_back(writer.expr(body_.get()));
+  for (const auto &assignment : assignments_) {
+    edges.push_back(writer.string(assignment.name));
+  }
+  for (const auto &assignment : assignments_) {
+    edges.push_back(ast_file::encode_type(assignment.type));
+  }
+  return writer.node(ast_file::Kind::var_in, location(), writer.edges(edges),
+                     assignments_.size());
+}
+
+namespace {
+
+/// Writes a nest of operations, with Operation::post_order().
+class OperationWriter {
+ public:
+  explicit OperationWriter(ast_file::Writer &writer) : writer_(writer) {}
+
+  void enter(const Operation * /*operation*/) {}
+
+  std::optional<uint32_t> leaf(const Expr *expr) { return writer_.expr(expr); }
+
+  uint32_t operand(const Operation * /*operation*/, size_t /*index*/,
+                   uint32_t index) {
+    return index;
+  }
+
+  std::optional<uint32_t> combine(const Operation *operation,
+                                  llvm::ArrayRef<uint32_t> operands) {
+    return operation->combine(writer_, operands);
+  }
+
+ private:
+  ast_file::Writer &writer_;
+};
+
+}  // namespace
+
+uint32_t Operation::write(ast_file::Writer &writer) const {
+  OperationWriter operation_writer(writer);
+  return *post_order<uint32_t>(operation_writer);
+}
+
+uint32_t BinaryOp::combine(ast_file::Writer &writer,
+                           llvm::ArrayRef<uint32_t> operands) const {
+  uint32_t index = writer.node(ast_file::Kind::binary_op, location(),
+                               writer.edges(operands));
+  writer.at(index).op = static_cast<uint8_t>(op_);
+  return index;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+uint32_t IfThenElse::write(ast_file::Writer &writer) const {
+  std::vector<uint32_t> edges{writer.expr(condition_.get()),
+                              writer.expr(then_.get()),
+                              writer.expr(otherwise_.get())};
+  return writer.node(ast_file::Kind::if_then_else, location(),
+                     writer.edges(edges));
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+uint32_t For::write(ast_file::Writer &writer) const {
+  std::vector<uint32_t> edges{
+      writer.expr(start_.get()), writer.expr(end_.get()),
+      writer.expr(step_.get()), writer.expr(body_.get())};
+  uint32_t index =
+      writer.node(ast_file::Kind::for_, location(), writer.edges(edges));
+  writer.at(index).name = writer.string(var_);
+  writer.at(index).type = ast_file::encode_type(type_);
+  return index;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+uint32_t ParallelFor::write(ast_file::Writer &writer) const {
+  std::vector<uint32_t> edges{
+      writer.expr(start_.get()), writer.expr(end_.get()),
+      writer.expr(step_.get()), writer.expr(body_.get())};
+  uint32_t index = writer.node(ast_file::Kind::parallel_for, location(),
+                               writer.edges(edges));
+  writer.at(index).name = writer.string(var_);
+  writer.at(index).op = static_cast<uint8_t>(reduction_);
+  return index;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+uint32_t Reduce::write(ast_file::Writer &writer) const {
+  std::vector<uint32_t> edges{
+      writer.expr(start_.get()), writer.expr(end_.get()),
+      writer.expr(step_.get()), writer.expr(body_.get())};
+  uint32_t index =
+      writer.node(ast_file::Kind::reduce, location(), writer.edges(edges));
+  writer.at(index).name = writer.string(var_);
+  writer.at(index).op = static_cast<uint8_t>(reduction_);
+  return index;
+}
+
+namespace function {
+
+uint32_t Call::combine(ast_file::Writer &writer,
+                       llvm::ArrayRef<uint32_t> operands) const {
+  uint32_t index = writer.node(ast_file::Kind::call, location(),
+                               writer.edges(operands), operands.size());
+  writer.at(index).name = writer.string(name_);
+  return index;
+}
+
+}  // namespace function
@@ -0,0 +1,164 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/// The binary AST format of kali --emit=ast: a parsed Program, flattened, so
+/// that pipelines compiling the same source again and again with different
+/// options read it back without lexing or parsing.
+///
+/// A file is a Header, the nodes, the top-level items, the edges, and the
+/// string table: the offset of each string, then their bytes. Nodes are in
+/// post-order, each after its children; a node refers to its children by
+/// index, through a run of edges. Names are interned. Everything is little
+/// endian, and the nodes are 8-byte aligned, so that a file can be mapped and
+/// read in place.
+namespace ast_file {
+
+constexpr char kMagic[8] = {'K', 'L', 'A', 'S', 'T', '\0', '\0', '\0'};
+constexpr uint32_t kVersion = 2;
+
+/// Stands for an absent child, say the step of a for without one.
+constexpr uint32_t kNone = UINT32_MAX;
+
+/// Types are stored as the ValueType plus one, and 0 where there is no
+/// annotation.
+uint8_t encode_type(std::optional<ValueType> type);
+std::optional<ValueType> decode_type(uint32_t type);
+constexpr uint32_t kMaxType = static_cast<uint32_t>(ValueType::bool_) + 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodes;
+  uint32_t items;
+  uint32_t edges;
+  uint32_t strings;
+  uint32_t string_bytes;
+};
+
+// NOLINTNEXTLINE
+enum class Kind : uint8_t {
+  number,
+  variable,
+  var_in,
+  binary_op,
+  if_then_else,
+  for_,
+  parallel_for,
+  reduce,
+  call,
+};
+constexpr size_t kKinds = static_cast<size_t>(Kind::call) + 1;
+
+/// kind_name - The class of the AST node a Kind stands for, say "BinaryOp".
+const char *kind_name(Kind kind);
+
+/// The edges of a node, from edges on:
+///
+///     var_in        count assignment values, the body, count names, count
+///                   types
+///     binary_op     lhs, rhs
+///     if_then_else  condition, then, else
+///     for_, parallel_for, reduce
+///                   start, end, step or kNone, body
+///     call          count arguments
+struct Node {
+  Kind kind;
+  /// Op of a binary_op; Reduction of a parallel_for or reduce.
+  uint8_t op;
+  /// The type of the variable of a for_.
+  uint8_t type;
+  uint8_t padding;
+  /// Variable, loop variable or callee, as a string.
+  uint32_t name;
+  uint32_t edges;
+  uint32_t count;
+  uint32_t line;
+  uint32_t column;
+  double number;
+};
+static_assert(sizeof(Node) == 32, "nodes are fixed-size records");
+
+struct Item {
+  /// TopLevel::Kind.
+  uint8_t kind;
+  uint8_t return_type;
+  uint8_t padding[2];
+  uint32_t name;
+  /// Argument names, then their types, from args in the edges.
+  uint32_t args;
+  uint32_t arity;
+  /// kNone for an extern.
+  uint32_t body;
+  uint32_t line;
+  uint32_t column;
+  uint32_t prototype_line;
+  uint32_t prototype_column;
+};
+
+/// Flattens an AST. The AST nodes append themselves, through write().
+class Writer {
+ public:
+  /// write - Writes program to path. Returns false, after logging, if the
+  /// file cannot be written.
+  static bool write(const Program &program, const std::string &path);
+
+  /// count - The number of nodes of expr and its children, by Kind.
+  static std::array<uint64_t, kKinds> count(const Expr &expr);
+
+  // Used by the AST nodes.
+
+  /// Appends expr, after its children, returning its index; kNone if expr is
+  /// nullptr.
+  uint32_t expr(const Expr *expr);
+  /// Appends node, returning its index.
+  uint32_t node(Kind kind, const SourceLocation &location, uint32_t edges = 0,
+                uint32_t count = 0);
+  Node &at(uint32_t index) { return nodes_[index]; }
+  /// Appends a run of edges, returning the index of the first.
+  uint32_t edges(llvm::ArrayRef<uint32_t> edges);
+  uint32_t string(const std::string &string);
+
+ private:
+  std::vector<Node> nodes_;
+  std::vector<Item> items_;
+  std::vector<uint32_t> edges_;
+  std::vector<std::string> strings_;
+  std::map<std::string, uint32_t> interned_;
+};
+
+/// A file written by Writer, mapped into memory.
+class File {
+ public:
+  /// open - Maps the file at path and checks that it is well-formed. Returns
+  /// nullptr, after logging, if it is not an AST file of this version.
+  static std::unique_ptr<File> open(const std::string &path);
+
+  /// program - Builds the AST, in one pass over the nodes.
+  Program program() const;
+
+ private:
+  explicit File(std::unique_ptr<llvm::MemoryBuffer> buffer);
+  bool check(const std::string &path);
+
+  std::string string(uint32_t index) const;
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer_;
+  const Header *header_ = nullptr;
+  const Node *nodes_ = nullptr;
+  const Item *items_ = nullptr;
+  const uint32_t *edges_ = nullptr;
+  const uint32_t *string_offsets_ = nullptr;
+  const char *string_bytes_ = nullptr;
+};
+
+}  // namespace ast_file
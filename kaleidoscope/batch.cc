@@ -0,0 +1,217 @@
+#include "batch.h"
+
+#include "llvm/Transforms/Utils/Cloning.h"
+
+namespace {
+
+/// Starts the body of fn, a function the compiler creates for prototype, at
+/// the location of prototype.
+void begin_body(CodegenContext &codegen_context, llvm::Function *fn,
+                const function::Prototype &prototype) {
+  auto &builder = codegen_context.builder();
+  builder.SetInsertPoint(
+      llvm::BasicBlock::Create(codegen_context.context(), "entry", fn));
+  codegen_context.debug_info().push_subprogram(
+      fn->getName().str(), prototype.location(), size_t{0}, fn);
+  if (fn->getSubprogram()) {
+    builder.SetCurrentDebugLocation(llvm::DILocation::get(
+        codegen_context.context(), prototype.location().line,
+        prototype.location().column, fn->getSubprogram()));
+  }
+}
+
+void end_body(CodegenContext &codegen_context, llvm::Function *fn) {
+  codegen_context.debug_info().pop_subprogram();
+  codegen_context.builder().SetCurrentDebugLocation(llvm::DebugLoc());
+  codegen_context.verify(*fn);
+}
+
+/// emit_rows - Emits a loop setting out[i] to fn(cols[0][i], cols[1][i], ...)
+/// for i in [begin, end), and returns the call to fn in it, to be inlined
+/// once the function is done.
+llvm::CallInst *emit_rows(CodegenContext &codegen_context, llvm::Function *fn,
+                          llvm::Value *cols, llvm::Value *out,
+                          llvm::Value *begin, llvm::Value *end) {
+  auto &builder = codegen_context.builder();
+  auto &context = codegen_context.context();
+  llvm::Type *double_type = builder.getDoubleTy();
+  llvm::Type *column_type = double_type->getPointerTo();
+
+  // The columns are loaded up front, leaving the loop a load per column.
+  std::vector<llvm::Value *> columns;
+  for (unsigned i = 0; i < fn->arg_size(); i++) {
+    columns.push_back(builder.CreateLoad(
+        column_type, builder.CreateConstInBoundsGEP1_64(column_type, cols, i),
+        fn->getArg(i)->getName() + ".col"));
+  }
+
+  llvm::Function *parent = builder.GetInsertBlock()->getParent();
+  llvm::BasicBlock *pre_header_block = builder.GetInsertBlock();
+  llvm::BasicBlock *loop_block =
+      llvm::BasicBlock::Create(context, "row", parent);
+  llvm::BasicBlock *after_block = llvm::BasicBlock::Create(context, "done");
+  builder.CreateCondBr(builder.CreateICmpULT(begin, end), loop_block,
+                       after_block);
+
+  builder.SetInsertPoint(loop_block);
+  llvm::PHINode *row = builder.CreatePHI(builder.getInt64Ty(), 2, "row");
+  row->addIncoming(begin, pre_header_block);
+  std::vector<llvm::Value *> args;
+  for (llvm::Value *column : columns) {
+    args.push_back(builder.CreateLoad(
+        double_type, builder.CreateInBoundsGEP(double_type, column, row)));
+  }
+  llvm::CallInst *call = builder.CreateCall(fn, args, "calltmp");
+  builder.CreateStore(call, builder.CreateInBoundsGEP(double_type, out, row));
+  llvm::Value *next_row = builder.CreateAdd(row, builder.getInt64(1));
+  row->addIncoming(next_row, builder.GetInsertBlock());
+  builder.CreateCondBr(builder.CreateICmpULT(next_row, end), loop_block,
+                       after_block);
+
+  parent->getBasicBlockList().push_back(after_block);
+  builder.SetInsertPoint(after_block);
+  return call;
+}
+
+}  // namespace
+
+std::string batch_name(const std::string &name) { return name + "_batch"; }
+
+llvm::Function *batch_codegen(CodegenContext &codegen_context,
+                              const function::Prototype &prototype,
+                              uint64_t chunk_rows) {
+  llvm::Module &module = codegen_context.module();
+  llvm::Function *fn = module.getFunction(prototype.name());
+  if (!fn || fn->isDeclaration() || prototype.typed()) return nullptr;
+
+  auto &builder = codegen_context.builder();
+  auto &context = codegen_context.context();
+  llvm::Type *double_type = builder.getDoubleTy();
+  llvm::Type *count_type = builder.getInt64Ty();
+  llvm::Type *cols_type = double_type->getPointerTo()->getPointerTo();
+  llvm::Type *out_type = double_type->getPointerTo();
+
+  // Of cols, out and the rows: n, or with chunks, begin and end. Neither the
+  // column pointers nor the columns are written through out, so the loop
+  // needs no runtime checks to be vectorized.
+  auto create = [&](const std::string &name,
+                    llvm::GlobalValue::LinkageTypes linkage,
+                    std::vector<const char *> counts) {
+    std::vector<llvm::Type *> types = {cols_type, out_type};
+    types.insert(types.end(), counts.size(), count_type);
+    llvm::Function *created = llvm::Function::Create(
+        llvm::FunctionType::get(builder.getVoidTy(), types,
+                                /*isVarArg=*/false),
+        linkage, name, module);
+    created->addParamAttr(0, llvm::Attribute::NoAlias);
+    created->addParamAttr(1, llvm::Attribute::NoAlias);
+    created->getArg(0)->setName("cols");
+    created->getArg(1)->setName("out");
+    for (size_t i = 0; i < counts.size(); i++) {
+      created->getArg(2 + i)->setName(counts[i]);
+    }
+    return created;
+  };
+
+  llvm::IRBuilderBase::InsertPoint insert_point = builder.saveIP();
+  llvm::Function *kernel = create(batch_name(prototype.name()),
+                                  llvm::Function::ExternalLinkage, {"n"});
+  llvm::Argument *cols = kernel->getArg(0);
+  llvm::Argument *out = kernel->getArg(1);
+  llvm::Argument *n = kernel->getArg(2);
+  llvm::CallInst *call = nullptr;
+  if (!chunk_rows) {
+    begin_body(codegen_context, kernel, prototype);
+    call = emit_rows(codegen_context, fn, cols, out, builder.getInt64(0), n);
+    builder.CreateRetVoid();
+    end_body(codegen_context, kernel);
+  } else {
+    llvm::Function *rows =
+        create(kernel->getName().str() + ".rows",
+               llvm::Function::InternalLinkage, {"begin", "end"});
+    begin_body(codegen_context, rows, prototype);
+    call = emit_rows(codegen_context, fn, rows->getArg(0), rows->getArg(1),
+                     rows->getArg(2), rows->getArg(3));
+    builder.CreateRetVoid();
+    end_body(codegen_context, rows);
+
+    // The rows of chunk k of the environment {cols, out, n}, a parfor body:
+    //
+    //     double name_batch.chunk(const double *env, double k)
+    llvm::StructType *env_type =
+        llvm::StructType::get(context, {cols_type, out_type, count_type});
+    llvm::Type *env_pointer_type = double_type->getPointerTo();
+    llvm::Function *chunk = llvm::Function::Create(
+        llvm::FunctionType::get(double_type, {env_pointer_type, double_type},
+                                /*isVarArg=*/false),
+        llvm::Function::InternalLinkage, kernel->getName() + ".chunk", module);
+    chunk->getArg(0)->setName("env");
+    chunk->getArg(1)->setName("k");
+
+    begin_body(codegen_context, chunk, prototype);
+    llvm::Value *env =
+        builder.CreatePointerCast(chunk->getArg(0), env_type->getPointerTo());
+    llvm::Value *fields[3];
+    for (unsigned i = 0; i < 3; i++) {
+      fields[i] = builder.CreateLoad(env_type->getStructElementType(i),
+                                     builder.CreateStructGEP(env_type, env, i));
+    }
+    llvm::Value *begin = builder.CreateMul(
+        builder.CreateFPToUI(chunk->getArg(1), count_type),
+        builder.getInt64(chunk_rows), "begin");
+    llvm::Value *end = builder.CreateAdd(begin, builder.getInt64(chunk_rows));
+    end = builder.CreateSelect(builder.CreateICmpULT(end, fields[2]), end,
+                               fields[2], "end");
+    builder.CreateCall(rows, {fields[0], fields[1], begin, end});
+    builder.CreateRet(llvm::ConstantFP::get(double_type, 0));
+    end_body(codegen_context, chunk);
+
+    // A single chunk is run directly, sparing the pool a wake up.
+    begin_body(codegen_context, kernel, prototype);
+    llvm::Value *chunks = builder.CreateUDiv(
+        builder.CreateAdd(n, builder.getInt64(chunk_rows - 1)),
+        builder.getInt64(chunk_rows), "chunks");
+    llvm::BasicBlock *direct_block =
+        llvm::BasicBlock::Create(context, "direct", kernel);
+    llvm::BasicBlock *parallel_block =
+        llvm::BasicBlock::Create(context, "parallel", kernel);
+    builder.CreateCondBr(builder.CreateICmpULE(chunks, builder.getInt64(1)),
+                         direct_block, parallel_block);
+
+    builder.SetInsertPoint(direct_block);
+    builder.CreateCall(rows, {cols, out, builder.getInt64(0), n});
+    builder.CreateRetVoid();
+
+    // double kl_parallel_for(double start, double end, double step,
+    //                        double (*body)(const double *, double),
+    //                        const double *env, int reduction)
+    builder.SetInsertPoint(parallel_block);
+    llvm::AllocaInst *env_alloca =
+        llvm::IRBuilder<>(&kernel->getEntryBlock(),
+                          kernel->getEntryBlock().begin())
+            .CreateAlloca(env_type, nullptr, "env");
+    llvm::Value *values[] = {cols, out, n};
+    for (unsigned i = 0; i < 3; i++) {
+      builder.CreateStore(values[i],
+                          builder.CreateStructGEP(env_type, env_alloca, i));
+    }
+    llvm::FunctionCallee parallel_for = module.getOrInsertFunction(
+        "kl_parallel_for", double_type, double_type, double_type, double_type,
+        chunk->getType(), env_pointer_type, builder.getInt32Ty());
+    builder.CreateCall(
+        parallel_for,
+        {llvm::ConstantFP::get(double_type, 0),
+         builder.CreateUIToFP(chunks, double_type),
+         llvm::ConstantFP::get(double_type, 1), chunk,
+         builder.CreatePointerCast(env_alloca, env_pointer_type),
+         builder.getInt32(static_cast<int>(Reduction::none))});
+    builder.CreateRetVoid();
+    end_body(codegen_context, kernel);
+  }
+  builder.restoreIP(insert_point);
+
+  // A recursive fn is inlined a level deep, the rest of it calling itself.
+  llvm::InlineFunctionInfo inline_info;
+  llvm::InlineFunction(*call, inline_info);
+  return kernel;
+}
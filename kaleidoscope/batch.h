@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+
+#include "ast.h"
+#include "codegen_context.h"
+
+/// Batch kernels: a def of f64 arguments evaluated over columns of rows in
+/// one call, for hosts applying it to many values,
+///
+///     void name_batch(const double *const *cols, double *out, size_t n)
+///
+/// which sets out[i] to name(cols[0][i], cols[1][i], ...) for i below n. The
+/// def is inlined into the loop over rows, which the loop vectorizer widens,
+/// so rows are evaluated a vector at a time rather than a call at a time. out
+/// may not overlap the columns.
+
+/// batch_name - The name of the batch kernel of the def name.
+std::string batch_name(const std::string &name);
+
+/// batch_codegen - Defines the batch kernel of the function of prototype in
+/// the module of codegen_context. With chunk_rows, the rows are split into
+/// chunks of that many, which the threads of the parfor pool run
+/// (kl_parallel_for); else they all run on the calling thread. Returns nullptr
+/// if the function was not generated, or is typed.
+llvm::Function *batch_codegen(CodegenContext &codegen_context,
+                              const function::Prototype &prototype,
+                              uint64_t chunk_rows = 0);
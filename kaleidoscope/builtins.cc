@@ -0,0 +1,27 @@
+#include "builtins.h"
+
+#include <map>
+
+const Builtin *lookup_builtin(const std::string &name) {
+  // clang-format off
+  static const std::map<std::string, Builtin> builtins = {
+    {"sqrt",  {llvm::Intrinsic::sqrt,   1}},
+    {"sin",   {llvm::Intrinsic::sin,    1}},
+    {"cos",   {llvm::Intrinsic::cos,    1}},
+    {"exp",   {llvm::Intrinsic::exp,    1}},
+    {"log",   {llvm::Intrinsic::log,    1}},
+    {"pow",   {llvm::Intrinsic::pow,    2}},
+    {"fabs",  {llvm::Intrinsic::fabs,   1}},
+    {"floor", {llvm::Intrinsic::floor,  1}},
+    {"fma",   {llvm::Intrinsic::fma,    3}},
+    {"min",   {llvm::Intrinsic::minnum, 2}},
+    {"max",   {llvm::Intrinsic::maxnum, 2}},
+  };
+  // clang-format on
+
+  auto query = builtins.find(name);
+  if (query == builtins.end()) {
+    return nullptr;
+  }
+  return &query->second;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#include "llvm/IR/Intrinsics.h"
+
+/// A library function which Call::codegen lowers to an LLVM intrinsic instead
+/// of an opaque call to an external symbol. Intrinsics carry the memory and
+/// side-effect attributes the optimizer needs to constant-fold, hoist and
+/// vectorize them.
+struct Builtin {
+  llvm::Intrinsic::ID id;
+  size_t arity;
+};
+
+/// lookup_builtin - Returns the builtin registered under name, or nullptr.
+const Builtin *lookup_builtin(const std::string &name);
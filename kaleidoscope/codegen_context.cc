@@ -1,16 +1,32 @@
 #include "codegen_context.h"
 
-DebugInfo::DebugInfo(const std::string &name, llvm::Module &module)
+#include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+DebugInfo::DebugInfo(const std::string &name, llvm::Module &module,
+                     bool enabled)
     : debug_info_builder_(module) {
+  if (!enabled) return;
   compile_unit_ = debug_info_builder_.createCompileUnit(
       llvm::dwarf::DW_LANG_C, debug_info_builder_.createFile(name, "."), "kali",
       false, "", 0);
-  type_ = debug_info_builder_.createBasicType("double", 64,
-                                              llvm::dwarf::DW_ATE_float);
+  // In the order of ValueType.
+  types_ = {
+      debug_info_builder_.createBasicType("double", 64,
+                                          llvm::dwarf::DW_ATE_float),
+      debug_info_builder_.createBasicType("float", 32,
+                                          llvm::dwarf::DW_ATE_float),
+      debug_info_builder_.createBasicType("long", 64,
+                                          llvm::dwarf::DW_ATE_signed),
+      debug_info_builder_.createBasicType("unsigned long", 64,
+                                          llvm::dwarf::DW_ATE_unsigned),
+      debug_info_builder_.createBasicType("bool", 8,
+                                          llvm::dwarf::DW_ATE_boolean),
+  };
 }
 
 void DebugInfo::emit_location(const Expr *expr, llvm::IRBuilder<> &builder) {
-  if (!expr) {
+  if (!expr || !compile_unit_) {
     return builder.SetCurrentDebugLocation(llvm::DebugLoc());
   }
 
@@ -26,26 +42,78 @@ void DebugInfo::emit_location(const Expr *expr, llvm::IRBuilder<> &builder) {
       scope->getContext(), location.line, location.column, scope));
 }
 
-llvm::DIType *DebugInfo::type() { return type_; }
+llvm::DIType *DebugInfo::type(ValueType type) {
+  return types_[static_cast<size_t>(type)];
+}
 llvm::DIBuilder &DebugInfo::debug_info_builder() { return debug_info_builder_; }
 
-CodegenContext::CodegenContext(const std::string &name)
-    : module_(name, context_), builder_(context_), debug_info_(name, module_) {}
+CodegenContext::CodegenContext(const std::string &name, bool debug_info)
+    : owned_context_(std::make_unique<llvm::LLVMContext>()),
+      context_(*owned_context_),
+      module_(std::make_unique<llvm::Module>(name, context_)),
+      builder_(context_),
+      debug_info_(name, *module_, debug_info) {}
+
+CodegenContext::CodegenContext(const std::string &name,
+                               llvm::LLVMContext &context, bool debug_info)
+    : context_(context),
+      module_(std::make_unique<llvm::Module>(name, context_)),
+      builder_(context_),
+      debug_info_(name, *module_, debug_info) {}
+
+std::unique_ptr<llvm::Module> CodegenContext::release_module() {
+  return std::move(module_);
+}
 
 llvm::LLVMContext &CodegenContext::context() { return context_; }
-llvm::Module &CodegenContext::module() { return module_; };
+llvm::Module &CodegenContext::module() { return *module_; };
 llvm::IRBuilder<> &CodegenContext::builder() { return builder_; }
 
-llvm::AllocaInst *CodegenContext::lookup(const std::string &name) {
+llvm::Function *CodegenContext::function(const std::string &name) {
+  ++lookups_.functions;
+  if (llvm::Function *fn = module_->getFunction(name)) {
+    return fn;
+  }
+  if (!externals_) return nullptr;
+  auto query = externals_->find(name);
+  if (query == externals_->end()) {
+    return nullptr;
+  }
+  return query->second.prototype->codegen(*this);
+}
+
+const function::Prototype *CodegenContext::prototype(
+    const std::string &name) const {
+  auto query = prototypes_.find(name);
+  if (query == prototypes_.end()) {
+    return nullptr;
+  }
+  return &query->second;
+}
+
+void CodegenContext::declare(const function::Prototype &prototype) {
+  prototypes_.insert_or_assign(prototype.name(), prototype);
+}
+
+bool CodegenContext::defines(const std::string &name) const {
+  llvm::Function *fn = module_->getFunction(name);
+  if (fn && !fn->isDeclaration()) return true;
+  if (!externals_) return false;
+  auto query = externals_->find(name);
+  return query != externals_->end() && query->second.defined;
+}
+
+CodegenContext::Binding CodegenContext::lookup(const std::string &name) {
+  ++lookups_.variables;
   auto query = named_values_.find(name);
   if (query == named_values_.end()) {
-    return nullptr;
+    return Binding();
   }
   return query->second;
 }
 
-void CodegenContext::set(const std::string &name, llvm::AllocaInst *value) {
-  named_values_[name] = value;
+void CodegenContext::set(const std::string &name, Binding binding) {
+  named_values_[name] = binding;
 }
 
 void CodegenContext::erase(const std::string &name) {
@@ -54,12 +122,19 @@ void CodegenContext::erase(const std::string &name) {
 
 void CodegenContext::clear() { named_values_.clear(); }
 
-llvm::AllocaInst *CodegenContext::create_entry_block_alloca(
-    llvm::Function *fn, const std::string &variable) {
-  llvm::IRBuilder<> temp_builder(&fn->getEntryBlock(),
-                                 fn->getEntryBlock().begin());
-  return temp_builder.CreateAlloca(llvm::Type::getDoubleTy(context_), nullptr,
-                                   variable);
+llvm::Type *CodegenContext::type(ValueType type) {
+  switch (type) {
+    case ValueType::f64:
+      return llvm::Type::getDoubleTy(context_);
+    case ValueType::f32:
+      return llvm::Type::getFloatTy(context_);
+    case ValueType::i64:
+    case ValueType::u64:
+      return llvm::Type::getInt64Ty(context_);
+    case ValueType::bool_:
+      return llvm::Type::getInt1Ty(context_);
+  }
+  return nullptr;
 }
 
 llvm::DIBuilder &CodegenContext::debug_info_builder() {
@@ -70,37 +145,202 @@ void CodegenContext::emit_location(const Expr *expr) {
   debug_info_.emit_location(expr, builder_);
 }
 
+void CodegenContext::verify(llvm::Function &fn) const {
+  if (verify_) llvm::verifyFunction(fn);
+}
+
 void DebugInfo::push_subprogram(const std::string &name,
                                 const function::Definition *definition,
                                 llvm::Function *fn) {
+  push_subprogram(name, definition->location(),
+                  create_function_type(*definition->prototype()), fn);
+}
+
+void DebugInfo::push_subprogram(const std::string &name,
+                                const SourceLocation &location, size_t args,
+                                llvm::Function *fn) {
+  push_subprogram(name, location, create_function_type(args), fn);
+}
+
+void DebugInfo::push_subprogram(const std::string &name,
+                                const SourceLocation &location,
+                                llvm::DISubroutineType *type,
+                                llvm::Function *fn) {
+  if (!compile_unit_) return;
+
   // Create a subprogram DIE for this function.
   llvm::DIFile *unit = debug_info_builder_.createFile(
       compile_unit_->getFilename(), compile_unit_->getDirectory());
   llvm::DIScope *scope = unit;
-  const SourceLocation &location = definition->location();
 
-  const function::Prototype *prototype = definition->prototype();
   llvm::DISubprogram *subprogram = debug_info_builder_.createFunction(
-      scope, name, llvm::StringRef(), unit, location.line,
-      create_function_type(prototype->args().size()), location.line,
+      scope, name, llvm::StringRef(), unit, location.line, type, location.line,
       llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
   fn->setSubprogram(subprogram);
   lexical_blocks_.push_back(subprogram);
 }
 
-void DebugInfo::pop_subprogram() { lexical_blocks_.pop_back(); }
+void DebugInfo::pop_subprogram() {
+  if (compile_unit_) lexical_blocks_.pop_back();
+}
 
 llvm::DISubroutineType *DebugInfo::create_function_type(size_t args) {
+  return create_function_type(
+      function::Prototype("", function::Args(args), SourceLocation()));
+}
+
+llvm::DISubroutineType *DebugInfo::create_function_type(
+    const function::Prototype &prototype) {
+  if (!compile_unit_) return nullptr;
   llvm::SmallVector<llvm::Metadata *, 8> type_signature;
 
   // Add the result type.
-  type_signature.push_back(type_);
+  type_signature.push_back(type(prototype.return_type()));
 
-  for (size_t i = 0; i < args; ++i) {
-    type_signature.push_back(type_);
+  for (size_t i = 0; i < prototype.args().size(); ++i) {
+    type_signature.push_back(type(prototype.types()[i]));
   }
   auto type_array = debug_info_builder_.getOrCreateTypeArray(type_signature);
   return debug_info_builder_.createSubroutineType(type_array);
 }
 
 DebugInfo &CodegenContext::debug_info() { return debug_info_; }
+
+void CodegenContext::instrument_profile(const std::string &path) {
+  instrument_profile_ = true;
+  profile_path_ = path;
+}
+
+void CodegenContext::use_profile(const Profile *profile) {
+  profile_ = profile;
+  profile->annotate(*module_);
+}
+
+void CodegenContext::begin_profile(llvm::Function *fn) {
+  counters_size_ = 0;
+  function_profile_ = nullptr;
+  weighted_branches_.clear();
+
+  if (instrument_profile_) {
+    counters_ = new llvm::GlobalVariable(
+        *module_, builder_.getInt64Ty(), /*isConstant=*/false,
+        llvm::GlobalValue::ExternalLinkage, nullptr, "__kl_prof_placeholder");
+  }
+
+  // A function the profile has no record of, say one added since, is left
+  // unannotated: that is no data, not no calls.
+  if (profile_) {
+    function_profile_ = profile_->lookup(fn->getName().str());
+  }
+  if (function_profile_) {
+    uint64_t entry_count = function_profile_->front();
+    fn->setEntryCount(entry_count);
+    if (entry_count == 0) {
+      fn->addFnAttr(llvm::Attribute::Cold);
+    }
+  }
+
+  // The entry counter.
+  count();
+}
+
+size_t CodegenContext::count() {
+  size_t counter = counters_size_++;
+  if (counters_) {
+    llvm::Type *type = builder_.getInt64Ty();
+    llvm::Value *address =
+        builder_.CreateConstInBoundsGEP1_64(type, counters_, counter);
+    llvm::Value *value = builder_.CreateLoad(type, address, "prof.count");
+    builder_.CreateStore(builder_.CreateAdd(value, builder_.getInt64(1)),
+                         address);
+  }
+  return counter;
+}
+
+llvm::Optional<uint64_t> CodegenContext::profile_count(size_t counter) const {
+  if (!function_profile_ || counter >= function_profile_->size()) {
+    return llvm::None;
+  }
+  return (*function_profile_)[counter];
+}
+
+void CodegenContext::set_branch_weights(llvm::Instruction *branch,
+                                        uint64_t taken, uint64_t not_taken) {
+  branch->setMetadata(llvm::LLVMContext::MD_prof,
+                      branch_weights(context_, taken, not_taken));
+  weighted_branches_.push_back(branch);
+}
+
+void CodegenContext::end_profile(llvm::Function *fn) {
+  if (fn && function_profile_ &&
+      function_profile_->size() != counters_size_) {
+    fprintf(stderr,
+            "Warning: Profile of %s does not match its code; ignoring its "
+            "branch counts.\n",
+            fn->getName().str().c_str());
+    // The weights came from counters out of step with the branches.
+    for (llvm::Instruction *branch : weighted_branches_) {
+      branch->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+    }
+  }
+  function_profile_ = nullptr;
+  weighted_branches_.clear();
+
+  if (!counters_) return;
+
+  if (fn) {
+    auto *type = llvm::ArrayType::get(builder_.getInt64Ty(), counters_size_);
+    auto *counters = new llvm::GlobalVariable(
+        *module_, type, /*isConstant=*/false,
+        llvm::GlobalValue::PrivateLinkage, llvm::Constant::getNullValue(type),
+        "__kl_prof_" + fn->getName());
+    counters_->replaceAllUsesWith(
+        llvm::ConstantExpr::getBitCast(counters, counters_->getType()));
+    instrumented_.emplace_back(fn, counters);
+  }
+
+  counters_->eraseFromParent();
+  counters_ = nullptr;
+}
+
+void CodegenContext::finalize_profile() {
+  if (!instrument_profile_) return;
+
+  llvm::Type *void_type = builder_.getVoidTy();
+  llvm::Type *int_type = builder_.getInt64Ty();
+  llvm::Type *string_type = builder_.getInt8PtrTy();
+  llvm::FunctionCallee register_fn = module_->getOrInsertFunction(
+      "kl_profile_register", void_type, string_type, string_type,
+      int_type->getPointerTo(), int_type);
+
+  llvm::Function *init = llvm::Function::Create(
+      llvm::FunctionType::get(void_type, false),
+      llvm::Function::InternalLinkage, "__kl_profile_init", *module_);
+  builder_.SetInsertPoint(llvm::BasicBlock::Create(context_, "entry", init));
+  builder_.SetCurrentDebugLocation(llvm::DebugLoc());
+
+  llvm::Value *path = builder_.CreateGlobalStringPtr(profile_path_);
+  for (const auto &instrumented : instrumented_) {
+    llvm::Value *fn = instrumented.first;
+    llvm::GlobalVariable *counters = instrumented.second;
+
+    // Anonymous expressions are erased after codegen, leaving their counters
+    // unused, unless kept for main (--emit=exe) under names of their own.
+    if (!fn) {
+      counters->eraseFromParent();
+      continue;
+    }
+
+    uint64_t size = counters->getValueType()->getArrayNumElements();
+    builder_.CreateCall(
+        register_fn,
+        {path, builder_.CreateGlobalStringPtr(fn->getName()),
+         builder_.CreateConstInBoundsGEP2_64(counters->getValueType(),
+                                             counters, 0, 0),
+         builder_.getInt64(size)});
+  }
+  builder_.CreateRetVoid();
+  instrumented_.clear();
+
+  llvm::appendToGlobalCtors(*module_, init, /*Priority=*/65535);
+}
@@ -12,31 +12,60 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/ValueHandle.h"
+#include "profile.h"
 
+/// DebugInfo - The DWARF of a module: a compile unit, and a subprogram for
+/// each function, with the source locations of its instructions. When not
+/// enabled, there is no compile unit, and subprograms and locations are not
+/// created.
 class DebugInfo {
  public:
-  DebugInfo(const std::string &name, llvm::Module &module);
+  DebugInfo(const std::string &name, llvm::Module &module, bool enabled);
   llvm::DICompileUnit *compile_unit();
-  llvm::DIType *type();
+  llvm::DIType *type(ValueType type = ValueType::f64);
   llvm::DIBuilder &debug_info_builder();
   void emit_location(const Expr *expr, llvm::IRBuilder<> &builder);
   void push_subprogram(const std::string &name,
                        const function::Definition *definition,
                        llvm::Function *fn);
+  /// For functions the compiler creates itself, say the outlined body of a
+  /// parfor, at location.
+  void push_subprogram(const std::string &name, const SourceLocation &location,
+                       size_t args, llvm::Function *fn);
+  /// The type of a function of args f64 arguments, returning f64.
   llvm::DISubroutineType *create_function_type(size_t args);
+  llvm::DISubroutineType *create_function_type(
+      const function::Prototype &prototype);
   void pop_subprogram();
 
  private:
-  llvm::DICompileUnit *compile_unit_;
-  llvm::DIType *type_;
+  void push_subprogram(const std::string &name, const SourceLocation &location,
+                       llvm::DISubroutineType *type, llvm::Function *fn);
+
+  llvm::DICompileUnit *compile_unit_ = nullptr;
+  /// By ValueType.
+  std::vector<llvm::DIType *> types_;
   llvm::DIBuilder debug_info_builder_;
   std::vector<llvm::DIScope *> lexical_blocks_;
 };
 
 class CodegenContext {
  public:
-  explicit CodegenContext(const std::string &name);
+  /// Generates code into a module named name, in a context of its own. With
+  /// debug_info, functions carry DWARF subprograms and source locations.
+  explicit CodegenContext(const std::string &name, bool debug_info = true);
+
+  /// Generates code into a module named name, in context, which the caller
+  /// keeps alive and does not use concurrently.
+  CodegenContext(const std::string &name, llvm::LLVMContext &context,
+                 bool debug_info = true);
+
+  /// Hands over the module, say to a JIT. Finalize debug info first; the
+  /// CodegenContext may not be used for codegen afterwards.
+  std::unique_ptr<llvm::Module> release_module();
 
   llvm::LLVMContext &context();
   llvm::Module &module();
@@ -45,34 +74,146 @@ class CodegenContext {
 
   // Used to handle instructions for named values.
 
-  /// create_entry_block_alloca - Create an alloca instruction in the entry
-  /// block of the function.  This is used for mutable variables etc.
-  llvm::AllocaInst *create_entry_block_alloca(llvm::Function *fn,
-                                              const std::string &variable);
+  /// The LLVM type of values of type: i64 for both i64 and u64, and i1 for
+  /// bool.
+  llvm::Type *type(ValueType type);
+
+  /// A variable: its value, and its type. Variables are bound once and never
+  /// assigned, and their scopes are dominated by where they are bound, so the
+  /// value is the SSA value itself; there is no alloca for mem2reg to promote.
+  /// Where a loop changes a variable (for), it binds the PHI of the loop
+  /// header.
+  struct Binding {
+    llvm::Value *value = nullptr;
+    ValueType type = ValueType::f64;
+  };
 
-  void set(const std::string &name, llvm::AllocaInst *value);
-  llvm::AllocaInst *lookup(const std::string &name);
+  void set(const std::string &name, Binding binding);
+  /// lookup - The variable name, with a null value if there is none.
+  Binding lookup(const std::string &name);
+
+  /// How many times lookup() and function() were called, for kali --stats.
+  struct Lookups {
+    uint64_t variables = 0;
+    uint64_t functions = 0;
+  };
+  const Lookups &lookups() const { return lookups_; }
   void erase(const std::string &name);
   void clear();
 
+  /// The variables in scope, for saving and restoring them around code
+  /// generated into another function.
+  using Scope = std::map<std::string, Binding>;
+  const Scope &scope() const { return named_values_; }
+  void set_scope(Scope scope) { named_values_ = std::move(scope); }
+
   llvm::DIBuilder &debug_info_builder();
   void emit_location(const Expr *expr);
 
+  /// Whether verify() checks functions; they are by default.
+  void set_verify(bool verify) { verify_ = verify; }
+  /// verify - Checks fn, once it is generated, for malformed IR.
+  void verify(llvm::Function &fn) const;
+
+  // Functions of other modules. When code is generated into a module per
+  // function (kali --cache-dir), calls to the functions of earlier modules
+  // declare them in this one on first use.
+  struct External {
+    const function::Prototype *prototype;
+    bool defined;
+  };
+  using Externals = std::map<std::string, External>;
+  void set_externals(const Externals *externals) { externals_ = externals; }
+
+  /// function - The function name, of this module or declared from externals,
+  /// or nullptr if there is none.
+  llvm::Function *function(const std::string &name);
+
+  /// defines - Whether this module or another has a body for name.
+  bool defines(const std::string &name) const;
+
+  /// prototype - The prototype function() declared name from, or nullptr if
+  /// it has not.
+  const function::Prototype *prototype(const std::string &name) const;
+  /// Records the prototype of a function declared in this module.
+  void declare(const function::Prototype &prototype);
+
+  // Profile-guided optimization. Every function has an entry counter, and
+  // branches allocate further counters through count() as they are generated.
+
+  /// Instrument functions with counters, which the libkl runtime appends to
+  /// the file at path on exit (--profile-generate).
+  void instrument_profile(const std::string &path);
+
+  /// Annotate functions and branches with the counts in profile
+  /// (--profile-use).
+  void use_profile(const Profile *profile);
+
+  /// begin_profile - Starts the counters of fn, at the insert point in its
+  /// entry block.
+  void begin_profile(llvm::Function *fn);
+
+  /// count - Allocates the next counter of the current function, and
+  /// increments it at the insert point if instrumenting.
+  size_t count();
+
+  /// Count recorded for counter of the current function by the profile in
+  /// use, if any.
+  llvm::Optional<uint64_t> profile_count(size_t counter) const;
+
+  /// set_branch_weights - Annotates branch of the current function with
+  /// counts from the profile in use, to be dropped by end_profile if the
+  /// profile turns out not to match the function.
+  void set_branch_weights(llvm::Instruction *branch, uint64_t taken,
+                          uint64_t not_taken);
+
+  /// end_profile - Finishes the counters of the current function. fn is
+  /// nullptr if codegen failed and the function was erased.
+  void end_profile(llvm::Function *fn);
+
+  /// Emits a constructor registering all counters with the libkl runtime.
+  void finalize_profile();
+
  private:
-  /// Global context for LLVM book-keeping.
-  llvm::LLVMContext context_;
+  /// Global context for LLVM book-keeping, if not supplied by the caller.
+  std::unique_ptr<llvm::LLVMContext> owned_context_;
+  llvm::LLVMContext &context_;
 
   /// Entity housing created LLVM entities (say an LLVM::Value) or something.
   /// Externally we only supply pointers to objects owned by the Module.
   /// In some sense, contains the code we build using C++ constructs to be
   /// generated as LLVM IR later.
-  llvm::Module module_;
+  std::unique_ptr<llvm::Module> module_;
 
   /// Convenience class to build LLVM IR objects by means of composition.
   llvm::IRBuilder<> builder_;
 
   // std::map<std::string, llvm::Value *> named_values_;
-  std::map<std::string, llvm::AllocaInst *> named_values_;
+  Scope named_values_;
 
   DebugInfo debug_info_;
+  bool verify_ = true;
+  Lookups lookups_;
+
+  const Externals *externals_ = nullptr;
+
+  /// Prototypes of the functions declared in this module, by name. Copies:
+  /// the declarations of a session (Engine) outlive the ASTs they came from.
+  std::map<std::string, function::Prototype> prototypes_;
+
+  std::string profile_path_;
+  bool instrument_profile_ = false;
+  const Profile *profile_ = nullptr;
+
+  /// Counters of the function being generated: a placeholder global while
+  /// instrumenting, which end_profile replaces with an array of the final
+  /// size, and the profile's counts when using one.
+  llvm::GlobalVariable *counters_ = nullptr;
+  size_t counters_size_ = 0;
+  const std::vector<uint64_t> *function_profile_ = nullptr;
+  std::vector<llvm::Instruction *> weighted_branches_;
+
+  /// Counter arrays of the functions generated so far. Functions may be
+  /// renamed or erased after codegen, which the handles follow.
+  std::vector<std::pair<llvm::WeakVH, llvm::GlobalVariable *>> instrumented_;
 };
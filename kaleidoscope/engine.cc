@@ -0,0 +1,790 @@
+#include "engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "batch.h"
+#include "codegen_context.h"
+#include "lexer.h"
+#include "libkl.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "parser.h"
+#include "passes.h"
+
+namespace orc = llvm::orc;
+
+namespace {
+
+void initialize_native_target() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+}
+
+/// The libkl runtime, which code compiled by the engine may extern.
+orc::SymbolMap runtime_symbols(orc::MangleAndInterner &mangle) {
+  orc::SymbolMap symbols;
+  auto add = [&](const char *name, auto *fn) {
+    symbols[mangle(name)] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(fn),
+        llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+  };
+  add("putchard", &putchard);
+  add("printd", &printd);
+  add("flushd", &flushd);
+  add("outputd", &outputd);
+  add("kl_parallel_for", &kl_parallel_for);
+  return symbols;
+}
+
+/// Tiered mode records the tier of the modules it adds in a module flag;
+/// modules without one are compiled as in untiered mode.
+enum class Tier { none, unoptimized, optimized };
+
+constexpr const char *kTierFlag = "kl.tier";
+
+void set_tier(llvm::Module &module, Tier tier) {
+  llvm::Type *type = llvm::Type::getInt32Ty(module.getContext());
+  module.setModuleFlag(llvm::Module::Error, kTierFlag,
+                       llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(
+                           type, static_cast<uint32_t>(tier))));
+}
+
+Tier module_tier(const llvm::Module &module) {
+  auto *tier = llvm::mdconst::extract_or_null<llvm::ConstantInt>(
+      module.getModuleFlag(kTierFlag));
+  return tier ? static_cast<Tier>(tier->getZExtValue()) : Tier::none;
+}
+
+/// Like orc::ConcurrentIRCompiler, with the codegen optimization level picked
+/// by tier. Unoptimized code gets FastISel, which is what -O0 selects.
+class TieredCompiler : public orc::IRCompileLayer::IRCompiler {
+ public:
+  explicit TieredCompiler(orc::JITTargetMachineBuilder builder)
+      : IRCompiler(orc::irManglingOptionsFromTargetOptions(builder.getOptions())),
+        builder_(std::move(builder)) {}
+
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(
+      llvm::Module &module) override {
+    orc::JITTargetMachineBuilder builder = builder_;
+    switch (module_tier(module)) {
+      case Tier::none:
+        break;
+      case Tier::unoptimized:
+        builder.setCodeGenOptLevel(llvm::CodeGenOpt::None);
+        break;
+      case Tier::optimized:
+        builder.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+        break;
+    }
+
+    auto machine = builder.createTargetMachine();
+    if (!machine) {
+      return machine.takeError();
+    }
+    return orc::SimpleCompiler(**machine)(module);
+  }
+
+ private:
+  orc::JITTargetMachineBuilder builder_;
+};
+
+/// add_tier_up_counter - Counts calls to fn and iterations of its loops, and
+/// calls tier_up(engine, id) when the count reaches threshold. Loads and
+/// stores of the counter are relaxed atomics, plain moves on x86; racing
+/// threads may lose counts, which only delays the tier up.
+void add_tier_up_counter(llvm::Function &fn, llvm::FunctionCallee tier_up,
+                         llvm::Constant *engine, uint64_t id,
+                         uint64_t threshold) {
+  llvm::LLVMContext &context = fn.getContext();
+  llvm::Type *counter_type = llvm::Type::getInt64Ty(context);
+  auto *counter = new llvm::GlobalVariable(
+      *fn.getParent(), counter_type, false, llvm::GlobalValue::PrivateLinkage,
+      llvm::ConstantInt::get(counter_type, 0), fn.getName() + ".counter");
+
+  // Count on entry, past the allocas, and on each back-edge.
+  std::vector<llvm::Instruction *> sites;
+  llvm::BasicBlock::iterator entry = fn.getEntryBlock().begin();
+  while (llvm::isa<llvm::AllocaInst>(*entry)) ++entry;
+  sites.push_back(&*entry);
+
+  llvm::DominatorTree dominators(fn);
+  for (llvm::BasicBlock &block : fn) {
+    for (llvm::BasicBlock *successor : llvm::successors(&block)) {
+      if (dominators.dominates(successor, &block)) {
+        sites.push_back(block.getTerminator());
+        break;
+      }
+    }
+  }
+
+  llvm::MDNode *unlikely =
+      llvm::MDBuilder(context).createBranchWeights(1, (1U << 20) - 1);
+  for (llvm::Instruction *site : sites) {
+    llvm::IRBuilder<> builder(site);
+    llvm::LoadInst *count = builder.CreateLoad(counter_type, counter);
+    count->setAtomic(llvm::AtomicOrdering::Monotonic);
+    count->setAlignment(llvm::Align(8));
+    llvm::Value *next = builder.CreateAdd(count, builder.getInt64(1));
+    llvm::StoreInst *store = builder.CreateStore(next, counter);
+    store->setAtomic(llvm::AtomicOrdering::Monotonic);
+    store->setAlignment(llvm::Align(8));
+
+    llvm::Value *hot = builder.CreateICmpEQ(next, builder.getInt64(threshold));
+    llvm::Instruction *then =
+        llvm::SplitBlockAndInsertIfThen(hot, site, false, unlikely);
+    llvm::IRBuilder<>(then).CreateCall(tier_up,
+                                       {engine, builder.getInt64(id)});
+  }
+}
+
+}  // namespace
+
+/// A function compiled in tiered mode. It is called through the stub, which
+/// jumps to name.tier0 until name.tier1 has been compiled from module.
+struct Engine::TieredFunction {
+  std::string name;
+  std::string stub;
+  orc::JITDylib *dylib;
+  std::shared_ptr<orc::ThreadSafeModule> module;
+  bool queued = false;
+};
+
+Engine::Handle::Handle(std::map<std::string, uint64_t> addresses,
+                       std::function<void()> release)
+    : addresses_(std::move(addresses)), release_(std::move(release)) {}
+
+Engine::Handle::~Handle() {
+  if (release_) release_();
+}
+
+uint64_t Engine::Handle::address(const std::string &name) const {
+  auto query = addresses_.find(name);
+  if (query == addresses_.end()) {
+    return 0;
+  }
+  return query->second;
+}
+
+Engine::Engine(EngineOptions options) : options_(options) {
+  initialize_native_target();
+  llvm::ExitOnError exit_on_error("Error: ");
+
+  size_t contexts = options_.contexts;
+  if (contexts == 0) {
+    contexts = std::max(1U, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < contexts; i++) {
+    contexts_.emplace_back(std::make_unique<llvm::LLVMContext>());
+  }
+
+  jit_ = exit_on_error(
+      orc::LLJITBuilder()
+          .setCompileFunctionCreator(
+              [](orc::JITTargetMachineBuilder builder)
+                  -> llvm::Expected<
+                      std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                // A TargetMachine per compile, so that threads looking up
+                // symbols can compile at the same time.
+                return std::make_unique<TieredCompiler>(std::move(builder));
+              })
+          .create());
+
+  // The host's cost model, so that loops are vectorized for it.
+  orc::JITTargetMachineBuilder host =
+      exit_on_error(orc::JITTargetMachineBuilder::detectHost());
+  jit_->getIRTransformLayer().setTransform(
+      [host](orc::ThreadSafeModule module,
+             const orc::MaterializationResponsibility & /*responsibility*/)
+          -> llvm::Expected<orc::ThreadSafeModule> {
+        llvm::Error error = module.withModuleDo([&](llvm::Module &m)
+                                                    -> llvm::Error {
+          Tier tier = module_tier(m);
+          // Compile latency is what tier 0 is for.
+          if (tier == Tier::unoptimized) return llvm::Error::success();
+
+          auto machine =
+              orc::JITTargetMachineBuilder(host).createTargetMachine();
+          if (!machine) return machine.takeError();
+          if (tier == Tier::optimized) {
+            run_default_pipeline(m, llvm::OptimizationLevel::O3,
+                                 machine->get());
+          } else {
+            llvm::legacy::PassManager pass;
+            pass.add(llvm::createTargetTransformInfoWrapperPass(
+                (*machine)->getTargetIRAnalysis()));
+            add_optimization_passes(pass);
+            pass.run(m);
+          }
+          return llvm::Error::success();
+        });
+        if (error) return error;
+        return module;
+      });
+
+  // Externs resolve to the libkl runtime, then to anything in the process,
+  // say libm.
+  orc::JITDylib &main = jit_->getMainJITDylib();
+  orc::MangleAndInterner mangle(jit_->getExecutionSession(),
+                                jit_->getDataLayout());
+  exit_on_error(main.define(orc::absoluteSymbols(runtime_symbols(mangle))));
+  main.addGenerator(
+      exit_on_error(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          jit_->getDataLayout().getGlobalPrefix())));
+
+  if (options_.tier_up_threshold) {
+    exit_on_error(main.define(orc::absoluteSymbols(
+        {{mangle("__kl_tier_up"),
+          llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&tier_up),
+                                   llvm::JITSymbolFlags::Exported |
+                                       llvm::JITSymbolFlags::Callable)}})));
+    stubs_ = orc::createLocalIndirectStubsManagerBuilder(
+        jit_->getTargetTriple())();
+    tier_up_worker_ = std::thread(&Engine::run_tier_up_worker, this);
+  }
+}
+
+Engine::~Engine() {
+  {
+    // Handles dropped from now on leave their code to the JIT's destructor.
+    std::lock_guard<std::mutex> lock(lifetime_->mutex);
+    lifetime_->alive = false;
+  }
+  if (tier_up_worker_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(tiers_mutex_);
+      stopping_ = true;
+    }
+    tier_up_queued_.notify_one();
+    tier_up_worker_.join();
+  }
+}
+
+Engine::HandlePtr Engine::compile(const std::string &source) {
+  std::promise<HandlePtr> promise;
+  std::shared_future<HandlePtr> result;
+  // Dropped once the cache is unlocked, since freeing code locks the JIT.
+  std::vector<std::shared_future<HandlePtr>> evicted;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto query = cache_.find(source);
+    if (query != cache_.end()) {
+      result = query->second.handle;
+      recent_.splice(recent_.begin(), recent_, query->second.position);
+    } else {
+      result = promise.get_future().share();
+      query = cache_.emplace(source, CacheEntry{result, {}}).first;
+      recent_.push_front(&query->first);
+      query->second.position = recent_.begin();
+      owner = true;
+
+      while (options_.cache_size && cache_.size() > options_.cache_size) {
+        auto oldest = cache_.find(*recent_.back());
+        evicted.push_back(std::move(oldest->second.handle));
+        recent_.pop_back();
+        cache_.erase(oldest);
+      }
+    }
+  }
+
+  if (owner) {
+    HandlePtr handle = compile_uncached(source);
+    promise.set_value(handle);
+    if (!handle) {
+      // Failures are not cached, so that their errors are logged each time.
+      // The entry is another compile's if this one was evicted meanwhile.
+      std::lock_guard<std::mutex> lock(cache_mutex_);
+      auto query = cache_.find(source);
+      if (query != cache_.end() &&
+          query->second.handle.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready &&
+          !query->second.handle.get()) {
+        recent_.erase(query->second.position);
+        cache_.erase(query);
+      }
+    }
+  }
+
+  return result.get();
+}
+
+orc::ThreadSafeContext &Engine::acquire_context() {
+  return contexts_[next_context_++ % contexts_.size()];
+}
+
+orc::JITDylib *Engine::create_dylib() {
+  std::string name = "kl." + std::to_string(next_dylib_++);
+  llvm::Expected<orc::JITDylib &> dylib = jit_->createJITDylib(name);
+  if (!dylib) {
+    llvm::logAllUnhandledErrors(dylib.takeError(), llvm::errs(), "Error: ");
+    return nullptr;
+  }
+  dylib->addToLinkOrder(jit_->getMainJITDylib());
+  return &*dylib;
+}
+
+void Engine::remove_dylib(orc::JITDylib &dylib) {
+  std::lock_guard<std::mutex> recompile_lock(recompile_mutex_);
+  if (options_.tier_up_threshold) {
+    // Ids index tiered_, so the functions stay, without a JITDylib to
+    // recompile into.
+    std::lock_guard<std::mutex> lock(tiers_mutex_);
+    for (std::unique_ptr<TieredFunction> &function : tiered_) {
+      if (function->dylib != &dylib) continue;
+      function->dylib = nullptr;
+      function->module.reset();
+    }
+  }
+  if (llvm::Error error = jit_->getExecutionSession().removeJITDylib(dylib)) {
+    llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "Error: ");
+  }
+}
+
+Engine::HandlePtr Engine::compile_uncached(const std::string &source) {
+  orc::ThreadSafeContext &context = acquire_context();
+
+  std::vector<std::string> names;
+  std::unique_ptr<llvm::Module> module;
+  {
+    // The context is shared with other compiles, and with the JIT compiling
+    // modules created in it.
+    auto lock = context.getLock();
+    CodegenContext codegen_context("engine", *context.getContext());
+
+    Lexer lexer(std::make_unique<std::istringstream>(source));
+    Parser parser;
+    Program program = parser.program(lexer);
+    if (parser.errors()) {
+      return nullptr;
+    }
+
+    for (const TopLevel &item : program) {
+      llvm::Function *fn = item.codegen(codegen_context);
+      if (!fn) {
+        return nullptr;
+      }
+
+      if (item.kind() == TopLevel::Kind::expression) {
+        fn->eraseFromParent();
+      } else if (item.kind() == TopLevel::Kind::definition) {
+        names.push_back(item.prototype()->name());
+      }
+    }
+
+    if (options_.batch_kernels) {
+      for (const TopLevel &item : program) {
+        if (item.kind() == TopLevel::Kind::definition &&
+            batch_codegen(codegen_context, *item.prototype(),
+                          options_.batch_chunk_rows)) {
+          names.push_back(batch_name(item.prototype()->name()));
+        }
+      }
+    }
+
+    codegen_context.debug_info_builder().finalize();
+    module = codegen_context.release_module();
+    module->setDataLayout(jit_->getDataLayout());
+    module->setTargetTriple(jit_->getTargetTriple().str());
+  }
+
+  // Each source gets a JITDylib of its own, so that sources may define
+  // functions of the same name.
+  orc::JITDylib *dylib = create_dylib();
+  if (!dylib) {
+    return nullptr;
+  }
+
+  if (llvm::Error error =
+          add_module(dylib->getDefaultResourceTracker(),
+                     orc::ThreadSafeModule(std::move(module), context), names)) {
+    llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "Error: ");
+    remove_dylib(*dylib);
+    return nullptr;
+  }
+
+  // Compile everything now, so that handles only ever do a map lookup.
+  orc::ExecutionSession &session = jit_->getExecutionSession();
+  orc::MangleAndInterner mangle(session, jit_->getDataLayout());
+  orc::SymbolLookupSet symbols;
+  for (const std::string &name : names) {
+    symbols.add(mangle(name));
+  }
+
+  auto found =
+      session.lookup(orc::makeJITDylibSearchOrder({dylib}), symbols);
+  if (!found) {
+    llvm::logAllUnhandledErrors(found.takeError(), llvm::errs(), "Error: ");
+    remove_dylib(*dylib);
+    return nullptr;
+  }
+
+  std::map<std::string, uint64_t> addresses;
+  for (const std::string &name : names) {
+    addresses[name] = (*found)[mangle(name)].getAddress();
+  }
+  std::shared_ptr<Lifetime> lifetime = lifetime_;
+  return std::make_shared<const Handle>(
+      std::move(addresses), [this, lifetime, dylib]() {
+        std::lock_guard<std::mutex> lock(lifetime->mutex);
+        if (lifetime->alive) remove_dylib(*dylib);
+      });
+}
+
+llvm::Error Engine::add_module(const orc::ResourceTrackerSP &tracker,
+                               orc::ThreadSafeModule module,
+                               const std::vector<std::string> &definitions) {
+  if (!options_.tier_up_threshold) {
+    return jit_->addIRModule(tracker, std::move(module));
+  }
+
+  orc::JITDylib &dylib = tracker->getJITDylib();
+  orc::ExecutionSession &session = jit_->getExecutionSession();
+  orc::MangleAndInterner mangle(session, jit_->getDataLayout());
+
+  // Bodies are renamed name.tier0, and calls go to a declaration of name,
+  // which resolves to the stub.
+  auto saved = std::make_shared<orc::ThreadSafeModule>();
+  std::vector<std::string> stubs;
+  module.withModuleDo([&](llvm::Module &m) {
+    for (const std::string &name : definitions) {
+      llvm::Function *fn = m.getFunction(name);
+      fn->setName(name + ".tier0");
+      fn->replaceAllUsesWith(llvm::Function::Create(
+          fn->getFunctionType(), llvm::Function::ExternalLinkage, name, m));
+    }
+    set_tier(m, Tier::unoptimized);
+
+    // Tier 1 is compiled from the code as it is before counting.
+    *saved = orc::ThreadSafeModule(llvm::CloneModule(m), module.getContext());
+
+    llvm::LLVMContext &context = m.getContext();
+    llvm::FunctionCallee tier_up_fn = m.getOrInsertFunction(
+        "__kl_tier_up", llvm::Type::getVoidTy(context),
+        llvm::Type::getInt8PtrTy(context), llvm::Type::getInt64Ty(context));
+    llvm::Constant *engine = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(context),
+                               reinterpret_cast<uintptr_t>(this)),
+        llvm::Type::getInt8PtrTy(context));
+
+    std::lock_guard<std::mutex> lock(tiers_mutex_);
+    for (const std::string &name : definitions) {
+      // Stubs are global to the engine, and names only to a JITDylib.
+      std::string stub = dylib.getName() + "/" + name;
+      add_tier_up_counter(*m.getFunction(name + ".tier0"), tier_up_fn, engine,
+                          tiered_.size(), options_.tier_up_threshold);
+      tiered_.push_back(std::make_unique<TieredFunction>(
+          TieredFunction{name, stub, &dylib, saved}));
+      stubs.push_back(stub);
+    }
+  });
+
+  orc::SymbolMap stub_symbols;
+  for (size_t i = 0; i < definitions.size(); i++) {
+    if (llvm::Error error = stubs_->createStub(
+            stubs[i], 0,
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable)) {
+      return error;
+    }
+    stub_symbols[mangle(definitions[i])] = stubs_->findStub(stubs[i], false);
+  }
+  if (llvm::Error error =
+          dylib.define(orc::absoluteSymbols(std::move(stub_symbols)), tracker)) {
+    return error;
+  }
+
+  if (llvm::Error error = jit_->addIRModule(tracker, std::move(module))) {
+    return error;
+  }
+
+  // The stubs must point at tier 0 before anything calls them.
+  orc::SymbolLookupSet bodies;
+  for (const std::string &name : definitions) {
+    bodies.add(mangle(name + ".tier0"));
+  }
+  auto found = session.lookup(orc::makeJITDylibSearchOrder({&dylib}), bodies);
+  if (!found) {
+    return found.takeError();
+  }
+  for (size_t i = 0; i < definitions.size(); i++) {
+    if (llvm::Error error = stubs_->updatePointer(
+            stubs[i], (*found)[mangle(definitions[i] + ".tier0")].getAddress())) {
+      return error;
+    }
+  }
+  return llvm::Error::success();
+}
+
+void Engine::tier_up(Engine *engine, uint64_t id) {
+  std::lock_guard<std::mutex> lock(engine->tiers_mutex_);
+  TieredFunction &function = *engine->tiered_[id];
+  if (function.queued) {
+    return;
+  }
+  function.queued = true;
+  engine->tier_up_queue_.push_back(id);
+  engine->tier_up_queued_.notify_one();
+}
+
+void Engine::run_tier_up_worker() {
+  while (true) {
+    TieredFunction *function = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(tiers_mutex_);
+      tier_up_queued_.wait(
+          lock, [this]() { return stopping_ || !tier_up_queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      function = tiered_[tier_up_queue_.front()].get();
+      tier_up_queue_.pop_front();
+    }
+    std::lock_guard<std::mutex> lock(recompile_mutex_);
+    // Unless its code was freed since it was queued.
+    if (function->dylib) recompile(*function);
+  }
+}
+
+void Engine::recompile(TieredFunction &function) {
+  std::string tier0 = function.name + ".tier0";
+  std::string tier1 = function.name + ".tier1";
+
+  // Only the function itself, and the internal functions it may call, say
+  // parfor bodies, are recompiled; what else it calls is declared and resolves
+  // to the stubs, except that recursive calls are made direct.
+  orc::ThreadSafeModule module =
+      function.module->withModuleDo([&](llvm::Module &m) {
+        llvm::ValueToValueMapTy values;
+        std::unique_ptr<llvm::Module> clone = llvm::CloneModule(
+            m, values, [&](const llvm::GlobalValue *value) {
+              return value->getName() == tier0 || value->hasLocalLinkage();
+            });
+        llvm::Function *fn = clone->getFunction(tier0);
+        fn->setName(tier1);
+        if (llvm::Function *self = clone->getFunction(function.name)) {
+          self->replaceAllUsesWith(fn);
+          self->eraseFromParent();
+        }
+        set_tier(*clone, Tier::optimized);
+        return orc::ThreadSafeModule(std::move(clone),
+                                     function.module->getContext());
+      });
+
+  orc::ExecutionSession &session = jit_->getExecutionSession();
+  orc::MangleAndInterner mangle(session, jit_->getDataLayout());
+  llvm::Error error = jit_->addIRModule(*function.dylib, std::move(module));
+  if (!error) {
+    auto found = session.lookup({function.dylib}, mangle(tier1));
+    if (found) {
+      error = stubs_->updatePointer(function.stub, found->getAddress());
+    } else {
+      error = found.takeError();
+    }
+  }
+  if (error) {
+    // Calls keep going to tier 0.
+    llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "Error: ");
+  }
+}
+
+std::unique_ptr<Engine::Session> Engine::create_session() {
+  orc::JITDylib *dylib = create_dylib();
+  if (!dylib) {
+    return nullptr;
+  }
+  return std::make_unique<Session>(*this, *dylib);
+}
+
+Engine::Session::Session(Engine &engine, orc::JITDylib &dylib)
+    : engine_(engine), dylib_(dylib) {}
+
+bool Engine::Session::evaluate(const std::string &source,
+                               std::vector<double> &values) {
+  Lexer lexer(std::make_unique<std::istringstream>(source));
+  Parser parser;
+  Program program = parser.program(lexer);
+  if (parser.errors()) {
+    return false;
+  }
+
+  orc::LLJIT &jit = *engine_.jit_;
+  orc::ResourceTrackerSP definitions_tracker = dylib_.createResourceTracker();
+  orc::ResourceTrackerSP expressions_tracker = dylib_.createResourceTracker();
+  std::vector<std::string> expressions;
+  std::vector<uint64_t> addresses;
+  {
+    std::lock_guard<std::mutex> session_lock(mutex_);
+
+    for (const TopLevel &item : program) {
+      if (item.kind() == TopLevel::Kind::definition &&
+          defined_.count(item.prototype()->name())) {
+        LogErrorV("Function cannot be redefined.");
+        return false;
+      }
+    }
+
+    // Definitions and externs go in one module, kept for later sources, and
+    // expressions in another, removed once they have run. Both start with
+    // declarations of everything defined so far.
+    std::unique_ptr<llvm::Module> definitions;
+    std::unique_ptr<llvm::Module> anonymous;
+    orc::ThreadSafeContext &context = engine_.acquire_context();
+    {
+      auto lock = context.getLock();
+      CodegenContext definitions_context("session", *context.getContext());
+      CodegenContext expressions_context("session", *context.getContext());
+      for (const auto &prototype : prototypes_) {
+        prototype.second.codegen(definitions_context);
+      }
+
+      // Both modules only declare the defs, so that calls to a def named
+      // like a builtin, say max, call it rather than lower to the builtin.
+      CodegenContext::Externals externals;
+      for (const auto &prototype : prototypes_) {
+        externals.emplace(
+            prototype.first,
+            CodegenContext::External{&prototype.second,
+                                     defined_.count(prototype.first) > 0});
+      }
+      definitions_context.set_externals(&externals);
+      expressions_context.set_externals(&externals);
+
+      for (const TopLevel &item : program) {
+        if (item.kind() == TopLevel::Kind::expression) continue;
+        const std::string &name = item.prototype()->name();
+        if (item.kind() == TopLevel::Kind::extern_ &&
+            definitions_context.module().getFunction(name)) {
+          continue;
+        }
+        if (!item.codegen(definitions_context)) {
+          return false;
+        }
+        if (item.kind() == TopLevel::Kind::definition) {
+          externals.insert_or_assign(
+              name, CodegenContext::External{item.prototype(), true});
+        }
+      }
+
+      // From the prototypes, since the types of a function are more than
+      // its LLVM type tells: an i64 argument may be a u64.
+      for (const llvm::Function &fn : definitions_context.module()) {
+        const function::Prototype *prototype =
+            definitions_context.prototype(fn.getName().str());
+        if (!prototype) continue;
+        prototype->codegen(expressions_context);
+      }
+
+      for (const TopLevel &item : program) {
+        if (item.kind() != TopLevel::Kind::expression) continue;
+        llvm::Function *fn = item.codegen(expressions_context);
+        if (!fn) {
+          return false;
+        }
+        // Anonymous expressions are all called main; make them unique.
+        std::string name = "__kl_expr." + std::to_string(next_expression_++);
+        fn->setName(name);
+        expressions.push_back(name);
+      }
+
+      for (CodegenContext *codegen_context :
+           {&definitions_context, &expressions_context}) {
+        codegen_context->debug_info_builder().finalize();
+        llvm::Module &module = codegen_context->module();
+        module.setDataLayout(jit.getDataLayout());
+        module.setTargetTriple(jit.getTargetTriple().str());
+      }
+      if (engine_.options_.tier_up_threshold) {
+        // Expressions run once, so they are not worth optimizing.
+        set_tier(expressions_context.module(), Tier::unoptimized);
+      }
+      definitions = definitions_context.release_module();
+      anonymous = expressions_context.release_module();
+    }
+
+    std::vector<std::string> names;
+    for (const TopLevel &item : program) {
+      if (item.kind() == TopLevel::Kind::definition) {
+        names.push_back(item.prototype()->name());
+      }
+    }
+    llvm::Error error = engine_.add_module(
+        definitions_tracker,
+        orc::ThreadSafeModule(std::move(definitions), context), names);
+    if (!error) {
+      error = jit.addIRModule(
+          expressions_tracker,
+          orc::ThreadSafeModule(std::move(anonymous), context));
+    }
+
+    // Compile all of it, so that errors such as unresolved externs surface
+    // before this source's definitions become visible to others.
+    orc::ExecutionSession &session = jit.getExecutionSession();
+    orc::MangleAndInterner mangle(session, jit.getDataLayout());
+    orc::SymbolLookupSet symbols;
+    for (const std::string &name : names) {
+      symbols.add(mangle(name));
+    }
+    for (const std::string &name : expressions) {
+      symbols.add(mangle(name));
+    }
+
+    orc::SymbolMap found;
+    if (!error) {
+      auto result =
+          session.lookup(orc::makeJITDylibSearchOrder({&dylib_}), symbols);
+      if (result) {
+        found = std::move(*result);
+      } else {
+        error = result.takeError();
+      }
+    }
+
+    if (error) {
+      llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "Error: ");
+      llvm::consumeError(definitions_tracker->remove());
+      llvm::consumeError(expressions_tracker->remove());
+      return false;
+    }
+
+    for (const TopLevel &item : program) {
+      const function::Prototype *prototype = item.prototype();
+      if (item.kind() == TopLevel::Kind::expression) continue;
+      prototypes_.insert_or_assign(prototype->name(), *prototype);
+      if (item.kind() == TopLevel::Kind::definition) {
+        defined_.insert(prototype->name());
+      }
+    }
+
+    for (const std::string &name : expressions) {
+      addresses.push_back(found[mangle(name)].getAddress());
+    }
+  }
+
+  // Run outside the lock, so that long running expressions do not hold up
+  // other clients of the session.
+  for (uint64_t address : addresses) {
+    auto *fn = reinterpret_cast<double (*)()>(address);
+    values.push_back(fn());
+  }
+  kl_flush();
+
+  llvm::consumeError(expressions_tracker->remove());
+  return true;
+}
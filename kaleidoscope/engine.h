@@ -0,0 +1,213 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+
+namespace llvm::orc {
+class IndirectStubsManager;
+class LLJIT;
+}  // namespace llvm::orc
+
+struct EngineOptions {
+  /// LLVMContexts to generate code in; at most that many compiles generate
+  /// code at the same time. 0 for one per hardware thread.
+  size_t contexts = 0;
+
+  /// With a threshold, compilation is tiered: functions are first compiled
+  /// unoptimized, with a counter of calls and loop iterations, and recompiled
+  /// at -O3 on a background thread once the counter reaches the threshold.
+  /// With 0, functions are compiled optimized up front.
+  uint64_t tier_up_threshold = 0;
+
+  /// Also compile, for each def of f64 arguments, its batch kernel (batch.h),
+  /// which handles look up as an Engine::BatchKernel named name_batch.
+  bool batch_kernels = false;
+
+  /// Rows per chunk, when batch kernels split their rows between the threads
+  /// of the parfor pool; 0 to run them all on the calling thread.
+  uint64_t batch_chunk_rows = 0;
+
+  /// Sources whose compiles are cached. Past that many, the least recently
+  /// compiled leaves the cache, and its code is freed once the last handle to
+  /// it is dropped. 0 for no bound.
+  size_t cache_size = 1024;
+};
+
+/// Compiles Kaleidoscope source in-process and hands out pointers to the
+/// compiled functions, for using Kaleidoscope as an expression language from
+/// C++:
+///
+///     Engine engine;
+///     Engine::HandlePtr handle = engine.compile("def average(x y) ...");
+///     auto *average = handle->lookup<double(double, double)>("average");
+///
+/// With EngineOptions::batch_kernels, a def may be evaluated over columns of
+/// rows in a single call, vectorized across rows:
+///
+///     auto *batch = handle->lookup<Engine::BatchKernel>("average_batch");
+///     const double *cols[] = {xs.data(), ys.data()};
+///     batch(cols, out.data(), out.size());
+///
+/// compile() may be called concurrently from any number of threads. Codegen
+/// runs on the calling thread in one of a pool of LLVMContexts, and the result
+/// is added to a JIT shared by all threads. Results are cached by source, so
+/// compiling the same source again costs a hash lookup, for up to
+/// EngineOptions::cache_size sources.
+///
+/// In tiered mode (EngineOptions::tier_up_threshold), functions are called
+/// through stubs, whose target is swapped to the optimized code once that is
+/// ready; addresses handed out stay valid across the swap.
+class Engine {
+ public:
+  /// Functions compiled from one source. The function pointers a handle hands
+  /// out stay valid while a handle to the source is kept, and no longer than
+  /// the Engine: the code of a source is freed once it has left the cache and
+  /// its last handle is dropped.
+  class Handle {
+   public:
+    /// release is called on destruction, to free the code.
+    Handle(std::map<std::string, uint64_t> addresses,
+           std::function<void()> release);
+    ~Handle();
+
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+
+    /// Address of the function name, or nullptr if the source did not
+    /// define it.
+    template <class Signature>
+    Signature *lookup(const std::string &name) const {
+      return reinterpret_cast<Signature *>(address(name));
+    }
+
+    uint64_t address(const std::string &name) const;
+
+   private:
+    std::map<std::string, uint64_t> addresses_;
+    std::function<void()> release_;
+  };
+
+  using HandlePtr = std::shared_ptr<const Handle>;
+
+  /// A batch kernel: out[i] = name(cols[0][i], cols[1][i], ...) for i below
+  /// n.
+  using BatchKernel = void(const double *const *cols, double *out, size_t n);
+
+  /// An interactive session: definitions and externs of each evaluated source
+  /// stay available to the sources evaluated after it, and top-level
+  /// expressions are run. May be used from several threads; compiles are
+  /// serialized, but running expressions is not.
+  class Session {
+   public:
+    explicit Session(Engine &engine, llvm::orc::JITDylib &dylib);
+
+    /// evaluate - Compiles source and runs its top-level expressions,
+    /// appending their values to values. Returns false, after logging, if
+    /// source has errors, in which case none of its definitions are kept.
+    bool evaluate(const std::string &source, std::vector<double> &values);
+
+   private:
+    Engine &engine_;
+    llvm::orc::JITDylib &dylib_;
+
+    std::mutex mutex_;
+    std::map<std::string, function::Prototype> prototypes_;
+    std::set<std::string> defined_;
+    size_t next_expression_ = 0;
+  };
+
+  /// create_session - Starts a Session with no definitions.
+  std::unique_ptr<Session> create_session();
+
+  explicit Engine(EngineOptions options = EngineOptions());
+  ~Engine();
+
+  /// compile - Compiles the definitions in source. Top-level expressions are
+  /// not evaluated. Returns nullptr, after logging, if source has errors.
+  HandlePtr compile(const std::string &source);
+
+ private:
+  HandlePtr compile_uncached(const std::string &source);
+
+  /// The next context of the pool, round-robin.
+  llvm::orc::ThreadSafeContext &acquire_context();
+
+  /// Creates a JITDylib linked against the runtime, with a unique name.
+  llvm::orc::JITDylib *create_dylib();
+
+  /// Removes dylib from the JIT, freeing its code, and in tiered mode takes
+  /// its functions off the recompile queue.
+  void remove_dylib(llvm::orc::JITDylib &dylib);
+
+  /// add_module - Adds module, which defines the functions definitions, to
+  /// the JITDylib of tracker and compiles it. In tiered mode, the functions are
+  /// compiled at tier 0, behind stubs of their names.
+  llvm::Error add_module(const llvm::orc::ResourceTrackerSP &tracker,
+                         llvm::orc::ThreadSafeModule module,
+                         const std::vector<std::string> &definitions);
+
+  /// Called by tier 0 code when the counter of function id reaches the
+  /// threshold; queues it for the background recompile.
+  static void tier_up(Engine *engine, uint64_t id);
+
+  /// Recompiles queued functions at tier 1 until the engine is destroyed.
+  void run_tier_up_worker();
+
+  struct TieredFunction;
+  void recompile(TieredFunction &function);
+
+  EngineOptions options_;
+  std::unique_ptr<llvm::orc::LLJIT> jit_;
+
+  std::vector<llvm::orc::ThreadSafeContext> contexts_;
+  std::atomic<size_t> next_context_{0};
+  std::atomic<size_t> next_dylib_{0};
+
+  /// Whether the Engine is still alive, for handles that outlive it: their
+  /// code goes with the JIT.
+  struct Lifetime {
+    std::mutex mutex;
+    bool alive = true;
+  };
+  std::shared_ptr<Lifetime> lifetime_ = std::make_shared<Lifetime>();
+
+  /// In-flight and finished compiles, keyed by source, and the sources from
+  /// most to least recently compiled. Concurrent compiles of the same source
+  /// wait for the first.
+  struct CacheEntry {
+    std::shared_future<HandlePtr> handle;
+    std::list<const std::string *>::iterator position;
+  };
+  std::mutex cache_mutex_;
+  std::unordered_map<std::string, CacheEntry> cache_;
+  std::list<const std::string *> recent_;
+
+  /// Tiered mode: the stubs through which tiered functions are called, the
+  /// functions by id, and the ids queued for recompiling.
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_;
+  std::mutex tiers_mutex_;
+  std::condition_variable tier_up_queued_;
+  std::vector<std::unique_ptr<TieredFunction>> tiered_;
+  std::deque<uint64_t> tier_up_queue_;
+  bool stopping_ = false;
+  std::thread tier_up_worker_;
+
+  /// Held while recompiling, so that a JITDylib is not removed under it.
+  std::mutex recompile_mutex_;
+};
@@ -20,6 +20,8 @@ std::string debug_atom(const Atom &atom) {
     case Atom::keyword_then   : return "keyword_then";
     case Atom::keyword_else   : return "keyword_else";
     case Atom::keyword_for    : return "keyword_for";
+    case Atom::keyword_parfor : return "keyword_parfor";
+    case Atom::keyword_reduce : return "keyword_reduce";
     case Atom::keyword_in     : return "keyword_in";
     case Atom::keyword_var    : return "keyword_var";
     case Atom::number         : return "number";
@@ -36,7 +38,9 @@ std::string debug_atom(const Atom &atom) {
 }
 
 Lexer::Lexer(std::string source)
-    : source_(std::move(source)), source_file_(source_) {}
+    : Lexer(std::make_unique<std::ifstream>(source)) {}
+
+Lexer::Lexer(std::unique_ptr<std::istream> input) : input_(std::move(input)) {}
 
 Atom Lexer::read() {
   // fprintf(stderr, "[lexer] Moving past %s\n", atom().c_str());
@@ -78,6 +82,14 @@ Atom Lexer::read() {
       return produce(Atom::keyword_for);
     }
 
+    if (atom_ == "parfor") {
+      return produce(Atom::keyword_parfor);
+    }
+
+    if (atom_ == "reduce") {
+      return produce(Atom::keyword_reduce);
+    }
+
     if (atom_ == "in") {
       return produce(Atom::keyword_in);
     }
@@ -163,7 +175,7 @@ char Lexer::step() {
   } else {
     ++source_location_.column;
   }
-  lookback_ = source_file_.get();
+  lookback_ = input_->get();
   return lookback_;
 }
 
@@ -16,6 +16,8 @@ enum class Atom {
   keyword_then,
   keyword_else,
   keyword_for,
+  keyword_parfor,
+  keyword_reduce,
   keyword_in,
   keyword_var,
   number,
@@ -38,7 +40,10 @@ struct SourceLocation {
 
 class Lexer {
  public:
+  /// Lexes the file at path source.
   explicit Lexer(std::string source);
+  /// Lexes from input, say a std::istringstream over source text in memory.
+  explicit Lexer(std::unique_ptr<std::istream> input);
   Atom read();
   const std::string &atom() const { return atom_; }
   char next() const { return next_; }
@@ -60,8 +65,7 @@ class Lexer {
   char lookback_ = ' ';
 
   SourceLocation source_location_;
-  std::string source_;
-  std::fstream source_file_;
+  std::unique_ptr<std::istream> input_;
 };
 
 static std::map<char, int> op_precedence = {{'=', 2},  {'<', 10}, {'+', 20},
@@ -1,15 +1,150 @@
 #include "libkl.h"
 
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+/// Destination of all output; stderr unless changed through outputd.
+std::atomic<int> output_fd{STDERR_FILENO};
+
+void write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+/// Per-thread output buffer. Threads never contend on it, and each flush is a
+/// single write so lines from different threads do not interleave mid-buffer.
+class OutputBuffer {
+ public:
+  ~OutputBuffer() { flush(); }
+
+  void put(char c) {
+    if (size_ == sizeof(data_)) flush();
+    data_[size_++] = c;
+  }
+
+  /// Reserve room for at least `count` characters, returning where to write.
+  char *reserve(size_t count) {
+    if (sizeof(data_) - size_ < count) flush();
+    return data_ + size_;
+  }
+
+  void commit(char *end) { size_ = end - data_; }
+
+  void flush() {
+    write_all(output_fd.load(std::memory_order_relaxed), data_, size_);
+    size_ = 0;
+  }
+
+ private:
+  char data_[8192];
+  size_t size_ = 0;
+};
+
+// Destroyed (and hence flushed) on thread exit; for the main thread, on exit.
+thread_local OutputBuffer output_buffer;
+
+struct ProfileCounters {
+  const char *path;
+  const char *function;
+  const uint64_t *counters;
+  uint64_t size;
+};
+
+struct ProfileRegistry {
+  std::mutex mutex;
+  std::vector<ProfileCounters> entries;
+};
+
+/// Registration runs from constructors, possibly before this file's own
+/// globals are initialized, so the registry is created on first use. That also
+/// orders its destruction after write_profiles, which is registered later.
+ProfileRegistry &profile_registry() {
+  static ProfileRegistry registry;
+  return registry;
+}
+
+void write_profiles() {
+  ProfileRegistry &registry = profile_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (const ProfileCounters &entry : registry.entries) {
+    FILE *file = fopen(entry.path, "a");
+    if (!file) {
+      fprintf(stderr, "Error: Could not write profile %s\n", entry.path);
+      continue;
+    }
+    fprintf(file, "%s %llu", entry.function,
+            static_cast<unsigned long long>(entry.size));
+    for (uint64_t i = 0; i < entry.size; i++) {
+      fprintf(file, " %llu",
+              static_cast<unsigned long long>(entry.counters[i]));
+    }
+    fputc('\n', file);
+    fclose(file);
+  }
+}
+
+}  // namespace
 
 /// putchard - putchar that takes a double and returns 0.
 extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+  output_buffer.put(static_cast<char>(X));
   return 0;
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
+/// printd - prints a double followed by a newline, returning 0. The value is
+/// written as the shortest string that round-trips to the same double.
 extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
+  // Longest shortest-form double, e.g. "-2.2250738585072014e-308", plus '\n'.
+  constexpr size_t kMaxLength = 32;
+  char *begin = output_buffer.reserve(kMaxLength);
+  std::to_chars_result result = std::to_chars(begin, begin + kMaxLength, X);
+  *result.ptr = '\n';
+  output_buffer.commit(result.ptr + 1);
+  return 0;
+}
+
+extern "C" DLLEXPORT double flushd() {
+  kl_flush();
   return 0;
 }
+
+extern "C" DLLEXPORT double outputd(double fd) {
+  return kl_set_output(static_cast<int>(fd));
+}
+
+extern "C" DLLEXPORT void kl_flush() { output_buffer.flush(); }
+
+extern "C" DLLEXPORT int kl_set_output(int fd) {
+  // Anything already buffered by this thread belongs to the old destination.
+  output_buffer.flush();
+  return output_fd.exchange(fd);
+}
+
+extern "C" DLLEXPORT void kl_profile_register(const char *path,
+                                              const char *function,
+                                              uint64_t *counters,
+                                              uint64_t size) {
+  ProfileRegistry &registry = profile_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  if (registry.entries.empty()) {
+    atexit(write_profiles);
+  }
+  registry.entries.push_back({path, function, counters, size});
+}
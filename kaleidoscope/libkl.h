@@ -1,13 +1,57 @@
-
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
 
+#include <cstdint>
+
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
 #else
 #define DLLEXPORT
 #endif
 
+// Output from putchard and printd is collected in a per-thread buffer, which
+// is written out with a single write(2) when it fills up, on flushd(), when
+// the thread exits and at program exit.
+
 extern "C" DLLEXPORT double putchard(double X);
 extern "C" DLLEXPORT double printd(double X);
+
+/// flushd - writes out the calling thread's buffered output, returning 0.
+extern "C" DLLEXPORT double flushd();
+
+/// outputd - selects the file descriptor output is written to (1 for stdout,
+/// 2 for stderr, or any open descriptor), returning the previous one.
+extern "C" DLLEXPORT double outputd(double fd);
+
+// Host-side equivalents of the above, for C/C++ code linking against libkl.
+extern "C" DLLEXPORT void kl_flush();
+extern "C" DLLEXPORT int kl_set_output(int fd);
+
+/// kl_profile_register - Called from the constructors of --profile-generate
+/// builds; the counters of function are appended to the file at path on exit.
+extern "C" DLLEXPORT void kl_profile_register(const char *path,
+                                              const char *function,
+                                              uint64_t *counters,
+                                              uint64_t size);
+
+// Reductions of kl_parallel_for, matching enum class Reduction of ast.h.
+enum KlReduction {
+  KL_REDUCE_NONE = 0,
+  KL_REDUCE_SUM = 1,
+  KL_REDUCE_PRODUCT = 2,
+  KL_REDUCE_MIN = 3,
+  KL_REDUCE_MAX = 4,
+};
+
+/// kl_parallel_for - Runs body(env, start + k * step) for the iterations k
+/// with the value below end (above, if step is negative), spread over a pool
+/// of threads with work stealing, and returns their values combined by
+/// reduction (0 for KL_REDUCE_NONE). Called by parfor. Runs sequentially on
+/// the calling thread if it is nested in another parallel loop, or if the
+/// pool is busy with one. The pool has a thread per core, or KL_THREADS.
+extern "C" DLLEXPORT double kl_parallel_for(double start, double end,
+                                            double step,
+                                            double (*body)(const double *env,
+                                                           double i),
+                                            const double *env, int reduction);
@@ -0,0 +1,265 @@
+// The work-stealing thread pool behind parfor (kl_parallel_for).
+//
+// The iterations of a loop are split evenly between the workers up front.
+// Each worker runs its range a chunk at a time from the front; a worker that
+// runs out steals the back half of the range of another. A worker's partial
+// reduction lives in a slot of its own, and the slots are combined once all
+// workers are done.
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "libkl.h"
+
+namespace {
+
+using Body = double (*)(const double *env, double i);
+
+double identity(int reduction) {
+  switch (reduction) {
+    case KL_REDUCE_PRODUCT:
+      return 1;
+    case KL_REDUCE_MIN:
+      return std::numeric_limits<double>::infinity();
+    case KL_REDUCE_MAX:
+      return -std::numeric_limits<double>::infinity();
+    default:
+      return 0;
+  }
+}
+
+double combine(int reduction, double accumulated, double value) {
+  switch (reduction) {
+    case KL_REDUCE_SUM:
+      return accumulated + value;
+    case KL_REDUCE_PRODUCT:
+      return accumulated * value;
+    case KL_REDUCE_MIN:
+      return std::fmin(accumulated, value);
+    case KL_REDUCE_MAX:
+      return std::fmax(accumulated, value);
+    default:
+      return accumulated;
+  }
+}
+
+/// A worker's share of a loop: the iterations [begin, end) it has yet to run,
+/// and its partial reduction. On a cache line of its own, so that workers do
+/// not contend on each other's.
+struct alignas(64) Share {
+  std::mutex mutex;
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  double partial = 0;
+};
+
+struct Loop {
+  double start;
+  double step;
+  Body body;
+  const double *env;
+  int reduction;
+  // Set once the iterations are counted.
+  uint64_t chunk = 1;
+  std::unique_ptr<Share[]> shares = nullptr;
+  size_t workers = 1;
+
+  /// Runs iterations [begin, end) into the partial reduction of worker.
+  void run(size_t worker, uint64_t begin, uint64_t end) {
+    double accumulated = shares[worker].partial;
+    for (uint64_t k = begin; k < end; k++) {
+      accumulated = combine(reduction, accumulated,
+                            body(env, start + static_cast<double>(k) * step));
+    }
+    shares[worker].partial = accumulated;
+  }
+
+  /// Takes the next chunk of worker's own share, into begin and end.
+  bool take(size_t worker, uint64_t &begin, uint64_t &end) {
+    Share &share = shares[worker];
+    std::lock_guard<std::mutex> lock(share.mutex);
+    if (share.begin == share.end) return false;
+    begin = share.begin;
+    end = std::min(share.end, begin + chunk);
+    share.begin = end;
+    return true;
+  }
+
+  /// Moves the back half of another worker's share to worker's own.
+  bool steal(size_t worker) {
+    for (size_t i = 1; i < workers; i++) {
+      Share &victim = shares[(worker + i) % workers];
+      uint64_t begin, end;
+      {
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        uint64_t remaining = victim.end - victim.begin;
+        // Not worth it for the victim's last chunk.
+        if (remaining <= chunk) continue;
+        begin = victim.begin + remaining / 2;
+        end = victim.end;
+        victim.end = begin;
+      }
+      Share &share = shares[worker];
+      std::lock_guard<std::mutex> lock(share.mutex);
+      share.begin = begin;
+      share.end = end;
+      return true;
+    }
+    return false;
+  }
+
+  void work(size_t worker) {
+    uint64_t begin, end;
+    do {
+      while (take(worker, begin, end)) {
+        run(worker, begin, end);
+      }
+    } while (steal(worker));
+  }
+};
+
+thread_local bool in_parallel_loop = false;
+
+class ThreadPool {
+ public:
+  ThreadPool() {
+    size_t threads = std::max(1U, std::thread::hardware_concurrency());
+    if (const char *value = getenv("KL_THREADS")) {
+      threads = std::max(1L, strtol(value, nullptr, 10));
+    }
+    // The thread calling run() is a worker as well.
+    for (size_t i = 1; i < threads; i++) {
+      threads_.emplace_back(&ThreadPool::serve, this, i);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    started_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  size_t workers() const { return threads_.size() + 1; }
+
+  /// Runs loop on all workers. Returns false, without running it, if the pool
+  /// is busy with another loop.
+  bool run(Loop &loop) {
+    std::unique_lock<std::mutex> busy(busy_, std::try_to_lock);
+    if (!busy.owns_lock()) return false;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      loop_ = &loop;
+      active_ = threads_.size();
+      ++generation_;
+    }
+    started_.notify_all();
+
+    in_parallel_loop = true;
+    loop.work(0);
+    in_parallel_loop = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this]() { return active_ == 0; });
+    loop_ = nullptr;
+    return true;
+  }
+
+ private:
+  void serve(size_t worker) {
+    in_parallel_loop = true;
+    uint64_t generation = 0;
+    while (true) {
+      Loop *loop;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        started_.wait(lock, [&]() {
+          return stopping_ || generation_ != generation;
+        });
+        if (stopping_) return;
+        generation = generation_;
+        loop = loop_;
+      }
+
+      loop->work(worker);
+      // Output of the body should not sit in this thread's buffer until the
+      // next loop.
+      kl_flush();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--active_ == 0) finished_.notify_one();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+
+  /// Held for the duration of a loop.
+  std::mutex busy_;
+
+  std::mutex mutex_;
+  std::condition_variable started_;
+  std::condition_variable finished_;
+  Loop *loop_ = nullptr;
+  uint64_t generation_ = 0;
+  size_t active_ = 0;
+  bool stopping_ = false;
+};
+
+ThreadPool &thread_pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+}  // namespace
+
+extern "C" DLLEXPORT double kl_parallel_for(double start, double end,
+                                            double step, Body body,
+                                            const double *env, int reduction) {
+  // A zero step, or a range too large to count, runs nothing.
+  double span = (end - start) / step;
+  uint64_t iterations = 0;
+  if (span > 0 && span < 0x1p63) {
+    iterations = static_cast<uint64_t>(std::ceil(span));
+  }
+
+  bool parallel = !in_parallel_loop && iterations > 1;
+  Loop loop{start, step, body, env, reduction};
+  loop.workers = parallel ? thread_pool().workers() : 1;
+  // Several chunks per worker, so that stealing can even out the load.
+  loop.chunk = std::max<uint64_t>(1, iterations / (loop.workers * 16));
+  loop.shares = std::make_unique<Share[]>(loop.workers);
+  uint64_t share_size = iterations / loop.workers;
+  uint64_t remainder = iterations % loop.workers;
+  for (size_t i = 0; i < loop.workers; i++) {
+    Share &share = loop.shares[i];
+    share.begin = share_size * i + std::min<uint64_t>(i, remainder);
+    share.end = share.begin + share_size + (i < remainder ? 1 : 0);
+    share.partial = identity(reduction);
+  }
+
+  if (!parallel || !thread_pool().run(loop)) {
+    // Nested, or another thread's loop has the pool: run it all here.
+    loop.shares[0].partial = identity(reduction);
+    loop.run(0, 0, iterations);
+    return loop.shares[0].partial;
+  }
+
+  double result = identity(reduction);
+  for (size_t i = 0; i < loop.workers; i++) {
+    result = combine(reduction, result, loop.shares[i].partial);
+  }
+  return result;
+}
@@ -23,156 +23,481 @@ ExprPtr Parser::number(Lexer &lexer) {
   return result;
 }
 
-// paranthesisExpr = '(' expression ')'
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::paranthesis(Lexer &lexer) {
-  // Consume the '('
-  lexer.read();
+namespace {
+
+/// Reads an optional type annotation, `: type`, into type. Returns false,
+/// after logging, if the colon is not followed by a type.
+bool annotation(Lexer &lexer, std::optional<ValueType> &type) {
+  if (lexer.current() != ':') return true;
+  lexer.read();  // Consume ':'
+  std::optional<ValueType> parsed;
+  if (lexer.type() == Atom::identifier) {
+    parsed = parse_type(lexer.atom());
+  }
+  if (!parsed) {
+    LogError(("Expected a type after ':', found {" + lexer.atom() + "}")
+                 .c_str());
+    return false;
+  }
+  type = parsed;
+  lexer.read();  // Consume the type.
+  return true;
+}
 
-  auto expr = expression(lexer);
-  if (expr == nullptr) {
-    return nullptr;
+/// Parses an expression with explicit stacks instead of recursion: the
+/// operators whose right operand is still to come, the operands they are
+/// waiting on, and the constructs (parentheses, calls, `if`, loops, `var`)
+/// whose subexpressions are being parsed. An expression nested inside a
+/// construct has its operators above those of the expression around it, from
+/// operators_base_ on. Deeply nested input costs heap, linear in its depth,
+/// rather than native stack.
+class ExpressionParser {
+ public:
+  explicit ExpressionParser(Lexer &lexer) : lexer_(lexer) {}
+
+  ExprPtr parse();
+
+ private:
+  // NOLINTNEXTLINE
+  enum class State { primary, operator_, done, error };
+
+  struct Construct {
+    // NOLINTNEXTLINE
+    enum class Kind {
+      paranthesis,
+      call,
+      if_then_else,
+      for_,
+      parfor,
+      reduce,
+      var,
+    };
+
+    Kind kind;
+    SourceLocation location;
+    /// The callee, or the loop variable.
+    std::string name;
+    /// The type of the loop variable of a for, if annotated.
+    std::optional<ValueType> type;
+    Reduction reduction = Reduction::none;
+    /// The subexpressions parsed so far. A loop without a step, or a variable
+    /// without an initializer, has nullptr in its place.
+    std::vector<ExprPtr> parts;
+    /// The variables of a var, and their types, if annotated.
+    std::vector<std::string> names;
+    std::vector<std::optional<ValueType>> types;
+    /// operators_base_ of the expression around.
+    size_t operators_base;
+  };
+
+  struct Operator {
+    char op;
+    SourceLocation location;
+  };
+
+  /// Reads a primary: pushes it onto operands_ if it is a whole one, or opens
+  /// its construct. Returns what to read next.
+  State primary();
+  State identifier();
+  /// for, parfor and reduce, up to the start value.
+  State loop(Construct::Kind kind, SourceLocation location,
+             Reduction reduction);
+  State var();
+
+  /// Reads a binary operator, or ends the expression: into the construct it
+  /// belongs to, if any.
+  State operator_();
+
+  /// Takes the expression just parsed as the next part of the innermost
+  /// construct, and reads on to the next one.
+  State resume(ExprPtr expr);
+  State resume_loop(Construct &loop);
+  /// Reads the variables of var up to one with an initializer, or the body.
+  /// With first, the first one is next; otherwise a variable just read.
+  State resume_var(Construct &var, bool first);
+
+  Construct &open(Construct::Kind kind, SourceLocation location,
+                  std::string name = "");
+  /// Closes the innermost construct, which evaluates to expr.
+  State close(ExprPtr expr);
+
+  /// Applies the pending operators of the expression being parsed, of
+  /// precedence at least that.
+  void reduce(int precedence);
+
+  State error(const std::string &message) {
+    LogError(message.c_str());
+    return State::error;
   }
 
-  if (lexer.current() != ')') {
-    return LogError("expected )");
+  Lexer &lexer_;
+  std::vector<Construct> constructs_;
+  std::vector<ExprPtr> operands_;
+  std::vector<Operator> operators_;
+  size_t operators_base_ = 0;
+};
+
+ExprPtr ExpressionParser::parse() {
+  State state = State::primary;
+  while (state == State::primary || state == State::operator_) {
+    state = state == State::primary ? primary() : operator_();
   }
+  if (state == State::error) return nullptr;
+  return std::move(operands_.back());
+}
 
-  // Consume the ')'
-  lexer.read();
-  return expr;
+ExpressionParser::State ExpressionParser::primary() {
+  SourceLocation location = lexer_.locate();
+  switch (lexer_.type()) {
+    default:
+      return error("Unknown token {" + lexer_.atom() + "}");
+    case Atom::identifier:
+      return identifier();
+    case Atom::number:
+      operands_.push_back(Parser::number(lexer_));
+      return State::operator_;
+    case Atom::open:
+      lexer_.read();  // Consume the '('
+      open(Construct::Kind::paranthesis, location);
+      return State::primary;
+    case Atom::keyword_if:
+      lexer_.read();  // Consume `if`.
+      open(Construct::Kind::if_then_else, location);
+      return State::primary;
+    case Atom::keyword_for:
+      lexer_.read();  // Consume `for`.
+      return loop(Construct::Kind::for_, location, Reduction::none);
+    case Atom::keyword_parfor:
+      lexer_.read();  // Consume `parfor`.
+      return loop(Construct::Kind::parfor, location, Reduction::none);
+    case Atom::keyword_var:
+      return var();
+  }
 }
 
 // identifierExpr =
 //        | identifierName
 //        | identifierName '(' expression* ')'
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::identifier(Lexer &lexer) {
-  SourceLocation location = lexer.locate();
-  std::string identifier = lexer.atom();
-  lexer.read();  // Consume identifier
+//        | reduceExpr
+ExpressionParser::State ExpressionParser::identifier() {
+  SourceLocation location = lexer_.locate();
+  std::string identifier = lexer_.atom();
+  lexer_.read();  // Consume identifier
+
+  // Not keywords: sum and prod are fine variable names, and min and max are
+  // builtins. An identifier can only follow one in a reduction.
+  if (lexer_.type() == Atom::identifier) {
+    const std::pair<const char *, Reduction> reductions[] = {
+        {"sum", Reduction::sum},
+        {"prod", Reduction::product},
+        {"min", Reduction::min},
+        {"max", Reduction::max}};
+    for (const auto &reduction : reductions) {
+      if (identifier == reduction.first) {
+        return loop(Construct::Kind::reduce, std::move(location),
+                    reduction.second);
+      }
+    }
+  }
 
-  if (lexer.current() != '(') {
-    return std::make_unique<Variable>(identifier, std::move(location));
+  if (lexer_.current() != '(') {
+    operands_.push_back(
+        std::make_unique<Variable>(identifier, std::move(location)));
+    return State::operator_;
   }
 
-  lexer.read();  // Consume '('
+  lexer_.read();  // Consume '('
+  if (lexer_.current() == ')') {
+    lexer_.read();  // Consume ')'
+    operands_.push_back(std::make_unique<function::Call>(
+        identifier, function::ArgExprs(), std::move(location)));
+    return State::operator_;
+  }
 
-  function::ArgExprs args;
-  if (lexer.current() != ')') {
-    while (true) {
-      if (auto arg = expression(lexer)) {
-        args.push_back(std::move(arg));
-      } else {
-        return nullptr;
-      }
+  open(Construct::Kind::call, std::move(location), identifier);
+  return State::primary;
+}
 
-      if (lexer.current() == ')') {
-        lexer.read();  // Consume ')'
-        break;
-      }
+ExpressionParser::State ExpressionParser::loop(Construct::Kind kind,
+                                               SourceLocation location,
+                                               Reduction reduction) {
+  // The keyword, or the reduction's name, has been consumed.
+  std::string what = kind == Construct::Kind::for_      ? "for"
+                     : kind == Construct::Kind::parfor ? "parfor"
+                                                       : "reduction";
+  if (lexer_.type() != Atom::identifier) {
+    return error("expected identifier after `" + what + "`");
+  }
 
-      if (lexer.current() != ',') {
-        return LogError("Expected ')' or ',' in argument list");
-      }
-      lexer.read();  // Consume ','
+  std::string identifier = lexer_.atom();
+  lexer_.read();  // consume identifier.
 
-      // fprintf(stderr, "FnArg: %s", lexer.atom().c_str());
-    }
+  // Only the variable of a for has a type of its own; the others are f64.
+  std::optional<ValueType> type;
+  if (kind == Construct::Kind::for_ && !annotation(lexer_, type)) {
+    return State::error;
   }
 
-  return std::make_unique<function::Call>(identifier, std::move(args),
-                                          std::move(location));
+  if (lexer_.current() != '=') return error("expected '=' after " + what);
+  lexer_.read();  // consume '='.
+
+  Construct &loop = open(kind, std::move(location), identifier);
+  loop.reduction = reduction;
+  loop.type = type;
+  return State::primary;
 }
 
-// primary =
-//       | identifierExpr
-//       | numberExpr
-//       | paranthesisExpr
-//       | ifExpr
-//       | forExpr
-//       | varExpr
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::primary(Lexer &lexer) {
-  switch (lexer.type()) {
-    default:
-      // fprintf(stderr, "Unknown token {%s}\n", lexer.atom().c_str());
-      char error_buffer[100];
-      snprintf(error_buffer, 100, "Unknown token {%s}", lexer.atom().c_str());
-      return LogError(error_buffer);
-    case Atom::identifier:
-      return identifier(lexer);
-    case Atom::number:
-      return number(lexer);
-    case Atom::open:
-      return paranthesis(lexer);
-    case Atom::keyword_if:
-      return if_then_else(lexer);
-    case Atom::keyword_for:
-      return for_in(lexer);
-    case Atom::keyword_var:
-      return var(lexer);
+ExpressionParser::State ExpressionParser::var() {
+  SourceLocation location = lexer_.locate();
+  lexer_.read();  // consume `var`.
+
+  if (lexer_.type() != Atom::identifier) {
+    return error("Expected at least one identifier.");
   }
+
+  return resume_var(open(Construct::Kind::var, std::move(location)),
+                    /*first=*/true);
 }
 
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::expression(Lexer &lexer) {
-  auto lhs = primary(lexer);
-  if (lhs == nullptr) {
-    return nullptr;
+ExpressionParser::State ExpressionParser::operator_() {
+  SourceLocation location = lexer_.locate();
+  char op = lexer_.current();
+  int precedence = resolve_precedence(op);
+  if (precedence >= 0) {
+    // Operators of the same precedence group to the left.
+    reduce(precedence);
+    operators_.push_back({op, std::move(location)});
+    lexer_.read();  // Consume the operator.
+    return State::primary;
   }
 
-  return binOpRHS(lexer, 0, std::move(lhs));
+  // The end of the expression.
+  reduce(0);
+  if (constructs_.empty()) return State::done;
+  ExprPtr expr = std::move(operands_.back());
+  operands_.pop_back();
+  return resume(std::move(expr));
 }
 
-int resolve_precedence(char op) {
-  auto query = op_precedence.find(op);
-  if (query != op_precedence.end()) {
-    return query->second;
+void ExpressionParser::reduce(int precedence) {
+  while (operators_.size() > operators_base_ &&
+         resolve_precedence(operators_.back().op) >= precedence) {
+    Operator pending = std::move(operators_.back());
+    operators_.pop_back();
+    ExprPtr rhs = std::move(operands_.back());
+    operands_.pop_back();
+    ExprPtr lhs = std::move(operands_.back());
+    operands_.pop_back();
+    operands_.push_back(std::make_unique<BinaryOp>(
+        op_from_keyword(pending.op), std::move(lhs), std::move(rhs),
+        std::move(pending.location)));
   }
-  return -1;
 }
 
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::binOpRHS(Lexer &lexer, int expr_precedence, ExprPtr lhs) {
-  while (true) {
-    SourceLocation location = lexer.locate();
-    char bin_op = lexer.current();
-    // fprintf(stderr, "binOp: %c\n", binOp);
-    int precedence = resolve_precedence(bin_op);
-    // fprintf(stderr, "binOp-prec: %d, expr-prec: %d\n", precedence,
-    //         expr_precedence);
-    if (precedence < expr_precedence) {
-      // Case of -1, when we can return just the primary expression.
-      return lhs;
+ExpressionParser::Construct &ExpressionParser::open(Construct::Kind kind,
+                                                    SourceLocation location,
+                                                    std::string name) {
+  Construct construct;
+  construct.kind = kind;
+  construct.location = std::move(location);
+  construct.name = std::move(name);
+  construct.operators_base = operators_base_;
+  constructs_.push_back(std::move(construct));
+  operators_base_ = operators_.size();
+  return constructs_.back();
+}
+
+ExpressionParser::State ExpressionParser::close(ExprPtr expr) {
+  operators_base_ = constructs_.back().operators_base;
+  constructs_.pop_back();
+  operands_.push_back(std::move(expr));
+  return State::operator_;
+}
+
+ExpressionParser::State ExpressionParser::resume(ExprPtr expr) {
+  Construct &construct = constructs_.back();
+  std::vector<ExprPtr> &parts = construct.parts;
+  parts.push_back(std::move(expr));
+
+  switch (construct.kind) {
+    case Construct::Kind::paranthesis:
+      if (lexer_.current() != ')') return error("expected )");
+      lexer_.read();  // Consume the ')'
+      return close(std::move(parts[0]));
+
+    case Construct::Kind::call:
+      if (lexer_.current() == ')') {
+        lexer_.read();  // Consume ')'
+        return close(std::make_unique<function::Call>(
+            construct.name, std::move(parts), construct.location));
+      }
+      if (lexer_.current() != ',') {
+        return error("Expected ')' or ',' in argument list");
+      }
+      lexer_.read();  // Consume ','
+      return State::primary;
+
+    case Construct::Kind::if_then_else:
+      if (parts.size() == 1) {
+        if (lexer_.type() != Atom::keyword_then) {
+          return error("Expected `then`");
+        }
+        lexer_.read();  // Consume `then`.
+        return State::primary;
+      }
+      if (parts.size() == 2) {
+        if (lexer_.type() != Atom::keyword_else) {
+          return error("Expected `else`");
+        }
+        lexer_.read();  // Consume `else`.
+        return State::primary;
+      }
+      return close(std::make_unique<IfThenElse>(
+          std::move(parts[0]), std::move(parts[1]), std::move(parts[2]),
+          construct.location));
+
+    case Construct::Kind::for_:
+    case Construct::Kind::parfor:
+    case Construct::Kind::reduce:
+      return resume_loop(construct);
+
+    case Construct::Kind::var:
+      if (parts.size() > construct.names.size()) {
+        // The body.
+        ExprPtr body = std::move(parts.back());
+        parts.pop_back();
+        std::vector<VarIn::Assignment> assignments;
+        for (size_t i = 0; i < parts.size(); i++) {
+          assignments.push_back({construct.names[i], construct.types[i],
+                                 std::move(parts[i])});
+        }
+        return close(std::make_unique<VarIn>(
+            std::move(assignments), std::move(body), construct.location));
+      }
+      return resume_var(construct, /*first=*/false);
+  }
+  return State::error;
+}
+
+ExpressionParser::State ExpressionParser::resume_loop(Construct &loop) {
+  std::vector<ExprPtr> &parts = loop.parts;
+  std::string what = loop.kind == Construct::Kind::for_      ? "for"
+                     : loop.kind == Construct::Kind::parfor ? "parfor"
+                                                            : "reduction";
+  switch (parts.size()) {
+    case 1:  // The start value.
+      if (lexer_.current() != ',') {
+        return error("expected ',' after " + what + " start value");
+      }
+      lexer_.read();
+      return State::primary;
+
+    case 2:  // The end value. The step value is optional.
+      if (lexer_.current() == ',') {
+        lexer_.read();
+        return State::primary;
+      }
+      parts.push_back(nullptr);
+      break;
+
+    case 3:  // The step value.
+      break;
+
+    default: {  // The body.
+      ExprPtr expr;
+      if (loop.kind == Construct::Kind::for_) {
+        expr = std::make_unique<For>(
+            loop.name, loop.type, std::move(parts[0]), std::move(parts[1]),
+            std::move(parts[2]), std::move(parts[3]), loop.location);
+      } else if (loop.kind == Construct::Kind::parfor) {
+        expr = std::make_unique<ParallelFor>(
+            loop.name, std::move(parts[0]), std::move(parts[1]),
+            std::move(parts[2]), loop.reduction, std::move(parts[3]),
+            loop.location);
+      } else {
+        expr = std::make_unique<Reduce>(
+            loop.reduction, loop.name, std::move(parts[0]),
+            std::move(parts[1]), std::move(parts[2]), std::move(parts[3]),
+            loop.location);
+      }
+      return close(std::move(expr));
     }
+  }
 
-    // Consume the pending binOp. If there is no binOp, the expression above
-    // would have returned.
-    lexer.read();
+  // So is the reduction of a parfor.
+  if (loop.kind == Construct::Kind::parfor &&
+      lexer_.type() == Atom::keyword_reduce) {
+    lexer_.read();  // consume `reduce`.
+    const std::string &op = lexer_.atom();
+    if (op == "+") {
+      loop.reduction = Reduction::sum;
+    } else if (op == "*") {
+      loop.reduction = Reduction::product;
+    } else if (op == "min") {
+      loop.reduction = Reduction::min;
+    } else if (op == "max") {
+      loop.reduction = Reduction::max;
+    } else {
+      return error("expected one of + * min max after `reduce`");
+    }
+    lexer_.read();  // consume the operator.
+  }
+
+  if (lexer_.type() != Atom::keyword_in) {
+    return error("expected 'in' after " + what);
+  }
+  lexer_.read();  // consume 'in'.
+  return State::primary;
+}
 
-    // See what rhs has for us. Attempt to parse again.
-    ExprPtr rhs = primary(lexer);
-    if (rhs == nullptr) {
-      return nullptr;
+ExpressionParser::State ExpressionParser::resume_var(Construct &var,
+                                                     bool first) {
+  while (true) {
+    if (!first) {
+      // Do we have more comma separated variables?
+      if (lexer_.current() != ',') break;
+      lexer_.read();  // Consume the `,`
+      if (lexer_.type() != Atom::identifier) {
+        return error("Expected identifier list after `var`.");
+      }
     }
+    first = false;
+
+    var.names.push_back(lexer_.atom());
+    lexer_.read();  // consume identifier.
 
-    // Do we have a binOp behind the rhs?
-    char next_bin_op = lexer.current();
-    int next_precedence = resolve_precedence(next_bin_op);
-    // fprintf(stderr, "nextBinOp: %c\n", nextBinOp);
-    // fprintf(stderr, "binOp-prec: %d, nextBinOp-prec: %d\n", precedence,
-    //         next_precedence);
-
-    if (precedence < next_precedence) {
-      // Recursive call, should take care of (op, operand)*
-      rhs = binOpRHS(lexer, precedence + 1, std::move(rhs));
-      if (rhs == nullptr) return nullptr;
+    std::optional<ValueType> type;
+    if (!annotation(lexer_, type)) return State::error;
+    var.types.push_back(type);
+
+    // Optional initializer.
+    if (lexer_.current() == '=') {
+      lexer_.read();  // Consume `=`
+      return State::primary;
     }
+    var.parts.push_back(nullptr);
+  }
+
+  // Read `in` expression to follow.
+  if (lexer_.type() != Atom::keyword_in) {
+    return error("Expected `in` keyword after `var`");
+  }
+  lexer_.read();  // Consume `in`.
+  return State::primary;
+}
 
-    lhs = std::make_unique<BinaryOp>(op_from_keyword(bin_op), std::move(lhs),
-                                     std::move(rhs), std::move(location));
+}  // namespace
+
+ExprPtr Parser::expression(Lexer &lexer) {
+  return ExpressionParser(lexer).parse();
+}
+
+int resolve_precedence(char op) {
+  auto query = op_precedence.find(op);
+  if (query != op_precedence.end()) {
+    return query->second;
   }
+  return -1;
 }
 
 Op op_from_keyword(char op) {
@@ -219,12 +544,17 @@ PrototypePtr Parser::prototype(Lexer &lexer) {
   lexer.read();
 
   std::vector<std::string> args;
+  std::vector<ValueType> types;
 
   while (lexer.type() == Atom::identifier) {
     std::string arg = lexer.atom();
     args.push_back(arg);
     // fprintf(stderr, "arg: %s\n", arg.c_str());
     lexer.read();
+
+    std::optional<ValueType> type;
+    if (!annotation(lexer, type)) return nullptr;
+    types.push_back(type.value_or(ValueType::f64));
   }
 
   if (lexer.current() != ')') {
@@ -232,8 +562,12 @@ PrototypePtr Parser::prototype(Lexer &lexer) {
   }
   lexer.read();  // Consume ')'
 
-  return std::make_unique<function::Prototype>(identifier, std::move(args),
-                                               std::move(location));
+  std::optional<ValueType> return_type;
+  if (!annotation(lexer, return_type)) return nullptr;
+
+  return std::make_unique<function::Prototype>(
+      identifier, std::move(args), std::move(location), std::move(types),
+      return_type.value_or(ValueType::f64));
 }
 
 DefinitionPtr Parser::definition(Lexer &lexer) {
@@ -265,159 +599,59 @@ DefinitionPtr Parser::top(Lexer &lexer) {
   return nullptr;
 }
 
-PrototypePtr Parser::extern_(Lexer &lexer) {
-  lexer.read();
-  return prototype(lexer);
-}
-
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::if_then_else(Lexer &lexer) {
-  SourceLocation location = lexer.locate();
-  lexer.read();  // Consume `if`.
-  ExprPtr condition = expression(lexer);
-
-  if (!condition) {
-    return nullptr;
-  }
-
-  if (lexer.type() != Atom::keyword_then) {
-    return LogError("Expected `then`");
-  }
-
-  lexer.read();  // Consume `then`.
-  ExprPtr then = expression(lexer);
-  if (!then) {
-    return nullptr;
-  }
-
-  if (lexer.type() != Atom::keyword_else) {
-    return LogError("Expected `else`");
-  }
-
-  lexer.read();  // Consume `else`.
-
-  ExprPtr otherwise = expression(lexer);
-
-  if (!otherwise) {
-    return nullptr;
-  }
-
-  return std::make_unique<IfThenElse>(std::move(condition), std::move(then),
-                                      std::move(otherwise),
-                                      std::move(location));
+Program Parser::program(Lexer &lexer) {
+  Program program;
+  this->program(lexer,
+                [&](TopLevel item) { program.push_back(std::move(item)); });
+  return program;
 }
 
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::for_in(Lexer &lexer) {
-  SourceLocation location = lexer.locate();
-  lexer.read();  // consume `for`.
-
-  if (lexer.type() != Atom::identifier) {
-    return LogError("expected identifier after `for`");
-  }
-
-  std::string identifier = lexer.atom();
-  lexer.read();  // consume identifier.
-
-  if (lexer.current() != '=') return LogError("expected '=' after for");
-  lexer.read();  // consume '='.
-
-  auto start = expression(lexer);
-  if (!start) {
-    return nullptr;
-  }
-
-  if (lexer.current() != ',') {
-    return LogError("expected ',' after for start value");
-  }
-
-  lexer.read();
-
-  auto end = expression(lexer);
-  if (!end) {
-    return nullptr;
-  }
-
-  // The step value is optional.
-  ExprPtr step = nullptr;
-  if (lexer.current() == ',') {
-    lexer.read();
-    step = expression(lexer);
-    if (!step) {
-      return nullptr;
+void Parser::program(Lexer &lexer,
+                     const std::function<void(TopLevel)> &consume) {
+  Atom symbol = lexer.read();
+  while (symbol != Atom::eof) {
+    switch (symbol) {
+      case Atom::keyword_def: {
+        if (DefinitionPtr def = definition(lexer)) {
+          consume(TopLevel(TopLevel::Kind::definition, std::move(def)));
+        } else {
+          ++errors_;
+          lexer.read();
+        }
+      } break;
+
+      case Atom::keyword_extern: {
+        if (PrototypePtr prototype_expr = extern_(lexer)) {
+          consume(TopLevel(std::move(prototype_expr)));
+        } else {
+          ++errors_;
+          lexer.read();
+        }
+      } break;
+
+      case Atom::kComment:
+      case Atom::unknown: {
+      } break;
+
+      case Atom::semicolon: {
+        lexer.read();
+      } break;
+
+      default: {
+        if (DefinitionPtr expr = top(lexer)) {
+          consume(TopLevel(TopLevel::Kind::expression, std::move(expr)));
+        } else {
+          ++errors_;
+          lexer.read();
+        }
+      } break;
     }
-  }
-
-  if (lexer.type() != Atom::keyword_in) {
-    return LogError("expected 'in' after for");
-  }
-  lexer.read();  // consume 'in'.
 
-  auto body = expression(lexer);
-  if (!body) {
-    return nullptr;
+    symbol = lexer.read();
   }
-
-  return std::make_unique<For>(identifier, std::move(start), std::move(end),
-                               std::move(step), std::move(body),
-                               std::move(location));
 }
 
-// NOLINTNEXTLINE(misc-no-recursion)
-ExprPtr Parser::var(Lexer &lexer) {
-  SourceLocation source_location = lexer.locate();
-  lexer.read();  // consume `var`.
-  std::vector<VarIn::Assignment> assignments;
-
-  if (lexer.type() != Atom::identifier) {
-    return LogError("Expected at least one identifier.");
-  }
-
-  // Read the variable name and assignment list.
-  while (true) {
-    std::string identifier = lexer.atom();
-    lexer.read();  // consume identifier.
-
-    // Optional initializer.
-    ExprPtr init;
-    if (lexer.current() == '=') {
-      // Consume `=`
-      lexer.read();
-      init = expression(lexer);
-
-      if (!init) {
-        return nullptr;
-      }
-    }
-
-    assignments.emplace_back(identifier, std::move(init));
-
-    // Do we have more comma separated variables?
-    // If not, break.
-    if (lexer.current() != ',') {
-      break;
-    }
-
-    lexer.read();  // Consume the `,`
-    if (lexer.type() != Atom::identifier) {
-      return LogError("Expected identifier list after `var`.");
-    }
-  }
-
-  // Read `in` expression to follow.
-  if (lexer.type() != Atom::keyword_in) {
-    return LogError("Expected `in` keyword after `var`");
-  }
-
-  lexer.read();  // Consume `in`.
-
-  ExprPtr body = expression(lexer);
-  if (!body) {
-    return nullptr;
-  }
-
-  return std::make_unique<VarIn>(std::move(assignments), std::move(body),
-                                 std::move(source_location));
-
-  return nullptr;
+PrototypePtr Parser::extern_(Lexer &lexer) {
+  lexer.read();
+  return prototype(lexer);
 }
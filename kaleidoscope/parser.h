@@ -1,4 +1,6 @@
 #pragma once
+#include <functional>
+
 #include "ast.h"
 #include "lexer.h"
 
@@ -14,29 +16,35 @@ class Parser {
   // numberExpr = number
   static ExprPtr number(Lexer &lexer);
 
-  // paranthesisExpr = '(' expression ')'
-  ExprPtr paranthesis(Lexer &lexer);
-
-  // identifierExpr =
-  //        | identifierName
-  //        | identifierName '(' expression* ')'
-  ExprPtr identifier(Lexer &lexer);
-
-  // primary =
-  //       | identifierExpr
-  //       | numberExpr
-  //       | paranthesisExpr
-  ExprPtr primary(Lexer &lexer);
-
-  // expression =
-  //       | primary
-  //       | primary `op` expression
+  /// expression = primary (op primary)*
+  ///
+  /// primary =
+  ///       | number
+  ///       | identifier
+  ///       | identifier '(' (expression (',' expression)*)? ')'
+  ///       | '(' expression ')'
+  ///       | `if` expression `then` expression `else` expression
+  ///       | `for` identifier (':' type)? '=' expression ',' expression
+  ///             (',' expression)? `in` expression
+  ///       | `parfor` identifier '=' expression ',' expression
+  ///             (',' expression)? (`reduce` (`+` | `*` | `min` | `max`))?
+  ///             `in` expression
+  ///       | (`sum` | `prod` | `min` | `max`) identifier '=' expression
+  ///             ',' expression (',' expression)? `in` expression
+  ///       | `var` identifier (':' type)? ('=' expression)?
+  ///             (',' identifier (':' type)? ('=' expression)?)*
+  ///             `in` expression
+  ///
+  /// type = `f64` | `f32` | `i64` | `u64` | `bool`
+  ///
+  /// Binary operators group by op_precedence, and to the left.
+  ///
+  /// Parsed with explicit stacks rather than recursion, so that however deep
+  /// the nesting, of parentheses, operators, or anything else, it costs heap
+  /// in proportion, not native stack.
   ExprPtr expression(Lexer &lexer);
 
-  // binOpRHS = ('+' primary)*
-  ExprPtr binOpRHS(Lexer &lexer, int expr_precedence, ExprPtr lhs);
-
-  // prototype = id '(' id* ')'
+  // prototype = id '(' (id (':' type)?)* ')' (':' type)?
   static PrototypePtr prototype(Lexer &lexer);
 
   /// definition = 'def' prototype expression
@@ -48,17 +56,17 @@ class Parser {
   /// top = expression
   DefinitionPtr top(Lexer &lexer);
 
-  /// if = `if` expression `then` expression `else` expression
-  ExprPtr if_then_else(Lexer &lexer);
+  /// program = (definition | external | top | ';')*
+  Program program(Lexer &lexer);
 
-  /// for =
-  ///     | `for` identifier = expr, expr [, expr]  `in` expr
-  ///
-  ExprPtr for_in(Lexer &lexer);
+  /// Parses a program as program(lexer) does, handing each item to consume as
+  /// soon as it is parsed, for consumers that get to work on the items while
+  /// the rest of the file is still being read.
+  void program(Lexer &lexer, const std::function<void(TopLevel)> &consume);
+
+  /// Number of items program() skipped because they failed to parse.
+  size_t errors() const { return errors_; }
 
-  /// varExpr := `var` identifer
-  ///               ('=' expression)?
-  ///               (',' identifier '=' expression)?*
-  ///               `in` expression
-  ExprPtr var(Lexer &lexer);
+ private:
+  size_t errors_ = 0;
 };
@@ -0,0 +1,115 @@
+#include "passes.h"
+
+#include <functional>
+
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/IPO/ArgumentPromotion.h"
+#include "llvm/Transforms/IPO/DeadArgumentElimination.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/GlobalOpt.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Vectorize.h"
+
+void add_optimization_passes(llvm::legacy::PassManagerBase &pass) {
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  pass.add(llvm::createInstructionCombiningPass());
+  // Reassociate expressions.
+  pass.add(llvm::createReassociatePass());
+  // Eliminate Common SubExpressions.
+  pass.add(llvm::createGVNPass());
+  // Hoist loop invariant computations, including math builtins.
+  pass.add(llvm::createLICMPass());
+  // Vectorize loops, calling into the vector math library if one was chosen.
+  // Of reductions, only those allowed to reassociate (sum, prod) qualify.
+  pass.add(llvm::createLoopVectorizePass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  pass.add(llvm::createCFGSimplificationPass());
+}
+
+namespace {
+
+/// Runs the pipeline build makes over module, with the analyses of
+/// target_machine and library_info where given.
+void run_module_pipeline(
+    llvm::Module &module, llvm::TargetMachine *target_machine,
+    const llvm::TargetLibraryInfoImpl *library_info,
+    const std::function<llvm::ModulePassManager(llvm::PassBuilder &)> &build) {
+  llvm::LoopAnalysisManager loop_analyses;
+  llvm::FunctionAnalysisManager function_analyses;
+  llvm::CGSCCAnalysisManager cgscc_analyses;
+  llvm::ModuleAnalysisManager module_analyses;
+
+  llvm::PassBuilder builder(target_machine);
+  // Registered first, as the builder does not replace analyses already there.
+  if (library_info) {
+    function_analyses.registerPass(
+        [&] { return llvm::TargetLibraryAnalysis(*library_info); });
+  }
+  builder.registerModuleAnalyses(module_analyses);
+  builder.registerCGSCCAnalyses(cgscc_analyses);
+  builder.registerFunctionAnalyses(function_analyses);
+  builder.registerLoopAnalyses(loop_analyses);
+  builder.crossRegisterProxies(loop_analyses, function_analyses, cgscc_analyses,
+                               module_analyses);
+
+  build(builder).run(module, module_analyses);
+}
+
+}  // namespace
+
+void run_default_pipeline(llvm::Module &module, llvm::OptimizationLevel level,
+                          llvm::TargetMachine *target_machine,
+                          const llvm::TargetLibraryInfoImpl *library_info) {
+  run_module_pipeline(module, target_machine, library_info,
+                      [&](llvm::PassBuilder &builder) {
+                        return builder.buildPerModuleDefaultPipeline(level);
+                      });
+}
+
+void internalize(llvm::Module &module, const std::set<std::string> &kept) {
+  llvm::internalizeModule(module, [&](const llvm::GlobalValue &value) {
+    return kept.count(value.getName().str()) > 0;
+  });
+
+  for (llvm::Function &fn : module) {
+    // Calls through a pointer, say by kl_parallel_for, expect the C
+    // convention.
+    if (fn.isDeclaration() || !fn.hasLocalLinkage() || fn.hasAddressTaken()) {
+      continue;
+    }
+    fn.setCallingConv(llvm::CallingConv::Fast);
+    for (llvm::User *user : fn.users()) {
+      auto *call = llvm::dyn_cast<llvm::CallBase>(user);
+      if (call && call->getCalledOperand() == &fn) {
+        call->setCallingConv(llvm::CallingConv::Fast);
+      }
+    }
+  }
+}
+
+void run_interprocedural_passes(
+    llvm::Module &module, llvm::TargetMachine *target_machine,
+    const llvm::TargetLibraryInfoImpl *library_info) {
+  run_module_pipeline(
+      module, target_machine, library_info, [](llvm::PassBuilder &) {
+        llvm::ModulePassManager passes;
+        passes.addPass(llvm::IPSCCPPass());
+        passes.addPass(llvm::GlobalOptPass());
+        passes.addPass(llvm::DeadArgumentEliminationPass());
+        passes.addPass(llvm::createModuleToPostOrderCGSCCPassAdaptor(
+            llvm::ArgumentPromotionPass()));
+        // With the thresholds of -O3.
+        passes.addPass(llvm::ModuleInlinerWrapperPass(
+            llvm::getInlineParams(/*OptLevel=*/3, /*SizeOptLevel=*/0)));
+        passes.addPass(llvm::GlobalDCEPass());
+        return passes;
+      });
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <set>
+#include <string>
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// add_optimization_passes - Adds the optimization pipeline run on generated
+/// code, ahead-of-time by kali and in the JIT by Engine. Loops are vectorized
+/// for the target only if the caller adds its TargetTransformInfo; for calls
+/// into a vector math library, its TargetLibraryInfo as well.
+void add_optimization_passes(llvm::legacy::PassManagerBase &pass);
+
+/// run_default_pipeline - Runs LLVM's standard pipeline for level over module,
+/// the one clang -O<level> runs. Slower than the above, and better on hot code.
+/// Without target_machine, costs are those of a generic target; without
+/// library_info, only the scalar math library is known.
+void run_default_pipeline(
+    llvm::Module &module, llvm::OptimizationLevel level,
+    llvm::TargetMachine *target_machine = nullptr,
+    const llvm::TargetLibraryInfoImpl *library_info = nullptr);
+
+/// internalize - Readies module for whole-program optimization: the functions
+/// and globals it defines, other than those named in kept, become internal,
+/// and the internal functions only ever called directly use fastcc. Unused
+/// defs can then be dropped, and the signatures of the others specialized.
+void internalize(llvm::Module &module, const std::set<std::string> &kept);
+
+/// run_interprocedural_passes - Runs the interprocedural passes that pay off
+/// once module is internalized, ahead of add_optimization_passes: constant
+/// propagation across calls, argument promotion, aggressive inlining and
+/// removal of dead functions. LLVM's standard pipelines have these already.
+void run_interprocedural_passes(
+    llvm::Module &module, llvm::TargetMachine *target_machine = nullptr,
+    const llvm::TargetLibraryInfoImpl *library_info = nullptr);
@@ -0,0 +1,80 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+
+std::unique_ptr<Profile> Profile::read(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Error: Could not open profile %s\n", path.c_str());
+    return nullptr;
+  }
+
+  auto profile = std::make_unique<Profile>();
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') continue;
+
+    std::istringstream fields(line);
+    std::string function;
+    size_t size = 0;
+    fields >> function >> size;
+    std::vector<uint64_t> counters(size);
+    for (uint64_t &counter : counters) {
+      fields >> counter;
+    }
+
+    if (!fields) {
+      fprintf(stderr, "Error: Malformed profile %s: %s\n", path.c_str(),
+              line.c_str());
+      return nullptr;
+    }
+
+    // Every instrumented run appends to the file; sum the runs.
+    std::vector<uint64_t> &existing = profile->functions_[function];
+    if (existing.empty()) {
+      existing = std::move(counters);
+    } else if (existing.size() == counters.size()) {
+      for (size_t i = 0; i < counters.size(); i++) {
+        existing[i] += counters[i];
+      }
+    }
+  }
+
+  return profile;
+}
+
+const std::vector<uint64_t> *Profile::lookup(
+    const std::string &function) const {
+  auto query = functions_.find(function);
+  if (query == functions_.end()) {
+    return nullptr;
+  }
+  return &query->second;
+}
+
+void Profile::annotate(llvm::Module &module) const {
+  llvm::InstrProfSummaryBuilder builder(
+      llvm::ProfileSummaryBuilder::DefaultCutoffs);
+  for (const auto &function : functions_) {
+    builder.addRecord(llvm::InstrProfRecord(function.second));
+  }
+
+  std::unique_ptr<llvm::ProfileSummary> summary = builder.getSummary();
+  module.setProfileSummary(summary->getMD(module.getContext()),
+                           llvm::ProfileSummary::PSK_Instr);
+}
+
+llvm::MDNode *branch_weights(llvm::LLVMContext &context, uint64_t taken,
+                             uint64_t not_taken) {
+  uint64_t scale = std::max(taken, not_taken) / UINT32_MAX + 1;
+  return llvm::MDBuilder(context).createBranchWeights(
+      static_cast<uint32_t>(taken / scale),
+      static_cast<uint32_t>(not_taken / scale));
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+
+/// Counters collected by a --profile-generate build, read back for
+/// --profile-use. Each function has its entry count at index 0, followed by
+/// the counters of its branches in the order codegen visits them.
+///
+/// The file format is text, one function per line, where each instrumented
+/// run appends its lines and counters of a function are summed on reading:
+///
+///     <function> <number of counters> <counter>...
+///
+class Profile {
+ public:
+  /// read - Loads the profile at path, logging and returning nullptr on error.
+  static std::unique_ptr<Profile> read(const std::string &path);
+
+  /// Counters recorded for function, or nullptr if the profile has no record
+  /// of it. Functions that never ran have a record of zeros.
+  const std::vector<uint64_t> *lookup(const std::string &function) const;
+
+  /// Attaches a profile summary to module, from which the optimizer and
+  /// backend classify functions and blocks as hot or cold.
+  void annotate(llvm::Module &module) const;
+
+ private:
+  std::map<std::string, std::vector<uint64_t>> functions_;
+};
+
+/// branch_weights - `!prof` metadata for a conditional branch, scaling the
+/// counts down to the 32-bit weights LLVM expects.
+llvm::MDNode *branch_weights(llvm::LLVMContext &context, uint64_t taken,
+                             uint64_t not_taken);
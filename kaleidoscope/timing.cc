@@ -0,0 +1,58 @@
+#include "timing.h"
+
+#include <sys/resource.h>
+
+#include "llvm/Support/Format.h"
+
+long peak_rss_kb() {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+size_t TimeReport::begin(const std::string &name, const std::string &detail) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.push_back(
+      {name, detail, depths_[std::this_thread::get_id()]++, 0, 0, 0});
+  return entries_.size() - 1;
+}
+
+void TimeReport::end(size_t index, double wall, double cpu) {
+  long peak = peak_rss_kb();
+  std::lock_guard<std::mutex> lock(mutex_);
+  --depths_[std::this_thread::get_id()];
+  Entry &entry = entries_[index];
+  entry.wall = wall;
+  entry.cpu = cpu;
+  entry.peak_rss_kb = peak;
+}
+
+void TimeReport::print(llvm::raw_ostream &out) const {
+  out << "===" << std::string(70, '-') << "===\n";
+  out << "                        kali compile time report\n";
+  out << "===" << std::string(70, '-') << "===\n";
+  out << "    Wall (s)     CPU (s)  Peak RSS (KiB)  Phase\n";
+  for (const Entry &entry : entries_) {
+    out << llvm::format("  %10.6f  %10.6f  %14ld  ", entry.wall, entry.cpu,
+                        entry.peak_rss_kb)
+        << std::string(2 * entry.depth, ' ') << entry.name;
+    if (!entry.detail.empty()) {
+      out << " (" << entry.detail << ')';
+    }
+    out << '\n';
+  }
+}
+
+TimeScope::TimeScope(TimeReport *report, const std::string &name,
+                     const std::string &detail)
+    : report_(report), trace_(name, detail) {
+  if (report_) index_ = report_->begin(name, detail);
+  start_ = llvm::TimeRecord::getCurrentTime(/*Start=*/true);
+}
+
+TimeScope::~TimeScope() {
+  if (!report_) return;
+  llvm::TimeRecord end = llvm::TimeRecord::getCurrentTime(/*Start=*/false);
+  report_->end(index_, end.getWallTime() - start_.getWallTime(),
+               end.getProcessTime() - start_.getProcessTime());
+}
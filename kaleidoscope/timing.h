@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// peak_rss_kb - The peak resident set size of the process so far, in KiB.
+long peak_rss_kb();
+
+/// Collects wall time, CPU time and peak resident set size of compiler phases
+/// for --time-report. Phases may be timed from several threads at once; those
+/// of a thread nest within each other, not within those of other threads.
+class TimeReport {
+ public:
+  struct Entry {
+    std::string name;
+    std::string detail;
+    int depth;
+    double wall;
+    double cpu;
+    long peak_rss_kb;
+  };
+
+  /// Opens an entry nested in the one open on this thread, returning its
+  /// index.
+  size_t begin(const std::string &name, const std::string &detail);
+  void end(size_t index, double wall, double cpu);
+
+  void print(llvm::raw_ostream &out) const;
+
+ private:
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  std::map<std::thread::id, int> depths_;
+};
+
+/// TimeScope - Times the enclosing scope as a phase (name) of some item
+/// (detail, say a function name). The scope is added to report if one is
+/// given, and to the Chrome trace if llvm::timeTraceProfilerInitialize has
+/// been called, alongside the scopes LLVM records for its own passes.
+class TimeScope {
+ public:
+  TimeScope(TimeReport *report, const std::string &name,
+            const std::string &detail = "");
+  ~TimeScope();
+
+  TimeScope(const TimeScope &) = delete;
+  TimeScope &operator=(const TimeScope &) = delete;
+
+ private:
+  TimeReport *report_;
+  size_t index_ = 0;
+  llvm::TimeRecord start_;
+  llvm::TimeTraceScope trace_;
+};
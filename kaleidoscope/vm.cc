@@ -0,0 +1,918 @@
+#include "vm.h"
+
+#include <dlfcn.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include "libkl.h"
+
+// Threaded dispatch: each handler jumps straight to the next one through a
+// table of label addresses (a GNU extension), instead of back to a switch.
+// Each jump gets a branch predictor entry of its own.
+#if defined(__GNUC__)
+#define KL_VM_THREADED 1
+#endif
+
+namespace vm {
+
+namespace {
+
+constexpr size_t kMaxRegisters = std::numeric_limits<Register>::max();
+
+template <class... Args>
+Native::Address address(double (*fn)(Args...)) {
+  return reinterpret_cast<Native::Address>(fn);
+}
+
+/// Natives known without a lookup: the libkl runtime, and the math library
+/// functions the LLVM backend lowers to intrinsics (builtins.h).
+const Native *lookup_known_native(const std::string &name) {
+  static const std::vector<Native> natives = {
+      {"putchard", 1, address(&putchard)},
+      {"printd", 1, address(&printd)},
+      {"flushd", 0, address(&flushd)},
+      {"outputd", 1, address(&outputd)},
+      {"sqrt", 1, address(+[](double x) { return std::sqrt(x); })},
+      {"sin", 1, address(+[](double x) { return std::sin(x); })},
+      {"cos", 1, address(+[](double x) { return std::cos(x); })},
+      {"exp", 1, address(+[](double x) { return std::exp(x); })},
+      {"log", 1, address(+[](double x) { return std::log(x); })},
+      {"pow", 2, address(+[](double x, double y) { return std::pow(x, y); })},
+      {"fabs", 1, address(+[](double x) { return std::fabs(x); })},
+      {"floor", 1, address(+[](double x) { return std::floor(x); })},
+      {"fma", 3,
+       address(+[](double x, double y, double z) { return std::fma(x, y, z); })},
+      {"min", 2, address(+[](double x, double y) { return std::fmin(x, y); })},
+      {"max", 2, address(+[](double x, double y) { return std::fmax(x, y); })},
+  };
+  for (const Native &native : natives) {
+    if (native.name == name) return &native;
+  }
+  return nullptr;
+}
+
+const char *opcode_name(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::load_constant:
+      return "load_constant";
+    case Opcode::move:
+      return "move";
+    case Opcode::add:
+      return "add";
+    case Opcode::sub:
+      return "sub";
+    case Opcode::mul:
+      return "mul";
+    case Opcode::div:
+      return "div";
+    case Opcode::less:
+      return "less";
+    case Opcode::min:
+      return "min";
+    case Opcode::max:
+      return "max";
+    case Opcode::jump:
+      return "jump";
+    case Opcode::jump_if_false:
+      return "jump_if_false";
+    case Opcode::jump_if_true:
+      return "jump_if_true";
+    case Opcode::call:
+      return "call";
+    case Opcode::call_native:
+      return "call_native";
+    case Opcode::ret:
+      return "ret";
+  }
+  return "unknown";
+}
+
+/// Kaleidoscope conditions are true when ordered and not equal to 0.
+bool truthy(double value) { return value < 0 || value > 0; }
+
+}  // namespace
+
+int64_t Bytecode::lookup(const std::string &name) const {
+  for (size_t i = 0; i < functions.size(); i++) {
+    if (functions[i].defined && functions[i].name == name) return i;
+  }
+  return -1;
+}
+
+void Bytecode::print(llvm::raw_ostream &out) const {
+  for (const Function &function : functions) {
+    if (!function.defined) continue;
+    out << function.name << '/' << function.arity << " ("
+        << function.registers << " registers):\n";
+    for (size_t pc = 0; pc < function.code.size(); pc++) {
+      const Instruction &instruction = function.code[pc];
+      out << "  " << pc << '\t' << opcode_name(instruction.opcode) << ' ';
+      switch (instruction.opcode) {
+        case Opcode::load_constant:
+          out << 'r' << instruction.a << ", "
+              << constants[instruction.b];
+          break;
+        case Opcode::move:
+          out << 'r' << instruction.a << ", r" << instruction.b;
+          break;
+        case Opcode::jump:
+          out << instruction.target();
+          break;
+        case Opcode::jump_if_false:
+        case Opcode::jump_if_true:
+          out << 'r' << instruction.a << ", " << instruction.target();
+          break;
+        case Opcode::call:
+          out << 'r' << instruction.a << ", "
+              << functions[instruction.b].name << "(r" << instruction.c
+              << "...)";
+          break;
+        case Opcode::call_native:
+          out << 'r' << instruction.a << ", " << natives[instruction.b].name
+              << "(r" << instruction.c << "...)";
+          break;
+        case Opcode::ret:
+          out << 'r' << instruction.a;
+          break;
+        default:
+          out << 'r' << instruction.a << ", r" << instruction.b << ", r"
+              << instruction.c;
+          break;
+      }
+      out << '\n';
+    }
+  }
+}
+
+std::unique_ptr<Bytecode> Compiler::compile(const Program &program) {
+  Compiler compiler;
+  for (const TopLevel &item : program) {
+    // Registers hold doubles, and nothing else.
+    if (item.prototype()->typed()) {
+      LogErrorV("The VM does not support type annotations");
+      return nullptr;
+    }
+    switch (item.kind()) {
+      case TopLevel::Kind::extern_:
+        compiler.declare(*item.prototype());
+        break;
+      case TopLevel::Kind::definition:
+      case TopLevel::Kind::expression:
+        if (!compiler.define(*item.definition(),
+                             item.kind() == TopLevel::Kind::expression)) {
+          return nullptr;
+        }
+        break;
+    }
+  }
+
+  if (!compiler.link()) {
+    return nullptr;
+  }
+  return std::move(compiler.bytecode_);
+}
+
+Register Compiler::allocate() {
+  if (next_register_ == kMaxRegisters) {
+    overflow_ = true;
+    return 0;
+  }
+  Register r = next_register_++;
+  function_->registers =
+      std::max<size_t>(function_->registers, next_register_);
+  return r;
+}
+
+Register Compiler::result(size_t mark, Register value) {
+  release(mark);
+  if (value < mark) {
+    return value;
+  }
+  Register r = allocate();
+  if (r != value) {
+    emit(Opcode::move, r, value);
+  }
+  return r;
+}
+
+size_t Compiler::emit(Opcode opcode, Register a, Register b, Register c) {
+  function_->code.push_back(Instruction{opcode, a, b, c});
+  return function_->code.size() - 1;
+}
+
+Register Compiler::constant(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  auto query = constants_.find(bits);
+  Register index;
+  if (query != constants_.end()) {
+    index = query->second;
+  } else {
+    if (bytecode_->constants.size() == kMaxRegisters) {
+      overflow_ = true;
+    }
+    index = bytecode_->constants.size();
+    bytecode_->constants.push_back(value);
+    constants_.emplace(bits, index);
+  }
+
+  Register r = allocate();
+  emit(Opcode::load_constant, r, index);
+  return r;
+}
+
+size_t Compiler::emit_jump(Opcode opcode, Register a, uint32_t target) {
+  size_t jump = emit(opcode, a);
+  function_->code[jump].set_target(target);
+  return jump;
+}
+
+void Compiler::patch(size_t jump) { function_->code[jump].set_target(here()); }
+
+std::optional<Register> Compiler::lookup(const std::string &name) const {
+  auto query = scope_.find(name);
+  if (query == scope_.end()) {
+    return std::nullopt;
+  }
+  return query->second;
+}
+
+std::optional<Register> Compiler::bind(const std::string &name, Register r) {
+  std::optional<Register> previous = lookup(name);
+  scope_[name] = r;
+  return previous;
+}
+
+void Compiler::unbind(const std::string &name,
+                      std::optional<Register> previous) {
+  if (previous) {
+    scope_[name] = *previous;
+  } else {
+    scope_.erase(name);
+  }
+}
+
+std::optional<Compiler::Callee> Compiler::callee(const std::string &name,
+                                                 size_t arity) {
+  auto query = functions_.find(name);
+  if (query != functions_.end()) {
+    if (bytecode_->functions[query->second].arity != arity) {
+      LogErrorV("Incorrect # arguments passed");
+      return std::nullopt;
+    }
+    // Calls to externs are turned into native calls by link().
+    return Callee{Opcode::call, static_cast<Register>(query->second)};
+  }
+
+  // As with the LLVM backend, math functions need no extern.
+  const Native *known = lookup_known_native(name);
+  if (!known) {
+    LogErrorV("Unknown function referenced");
+    return std::nullopt;
+  }
+  if (known->arity != arity) {
+    LogErrorV("Incorrect # arguments passed");
+    return std::nullopt;
+  }
+  std::optional<Register> index = native(name, arity);
+  if (!index) {
+    return std::nullopt;
+  }
+  return Callee{Opcode::call_native, *index};
+}
+
+std::optional<Register> Compiler::native(const std::string &name,
+                                         size_t arity) {
+  auto query = natives_.find(name);
+  if (query != natives_.end()) {
+    return query->second;
+  }
+
+  Native native{name, static_cast<uint16_t>(arity)};
+  if (const Native *known = lookup_known_native(name)) {
+    native.address = known->address;
+  } else {
+    // Anything else in the process, as the JIT would find it.
+    native.address =
+        reinterpret_cast<Native::Address>(dlsym(RTLD_DEFAULT, name.c_str()));
+  }
+
+  if (!native.address) {
+    fprintf(stderr, "Error: Unresolved extern %s\n", name.c_str());
+    return std::nullopt;
+  }
+  if (arity > 4) {
+    fprintf(stderr, "Error: Extern %s takes more than 4 arguments\n",
+            name.c_str());
+    return std::nullopt;
+  }
+
+  Register index = bytecode_->natives.size();
+  bytecode_->natives.push_back(std::move(native));
+  natives_.emplace(name, index);
+  return index;
+}
+
+void Compiler::declare(const function::Prototype &prototype) {
+  if (functions_.count(prototype.name())) {
+    return;
+  }
+  Function function;
+  function.name = prototype.name();
+  function.arity = prototype.args().size();
+  functions_.emplace(prototype.name(), bytecode_->functions.size());
+  bytecode_->functions.push_back(std::move(function));
+}
+
+bool Compiler::define(const function::Definition &definition,
+                      bool expression) {
+  const function::Prototype &prototype = *definition.prototype();
+
+  size_t index;
+  bool declared = false;
+  if (expression) {
+    // Expressions are all called main; each gets a function of its own.
+    index = bytecode_->functions.size();
+    bytecode_->functions.push_back(Function{prototype.name()});
+    bytecode_->expressions.push_back(index);
+  } else {
+    declared = functions_.count(prototype.name());
+    declare(prototype);
+    index = functions_[prototype.name()];
+    if (bytecode_->functions[index].defined) {
+      LogErrorV("Function cannot be redefined.");
+      return false;
+    }
+  }
+
+  function_ = &bytecode_->functions[index];
+  function_->arity = prototype.args().size();
+  scope_.clear();
+  next_register_ = 0;
+  overflow_ = false;
+
+  // Arguments arrive in the first registers.
+  for (const std::string &arg : prototype.args()) {
+    bind(arg, allocate());
+  }
+
+  std::optional<Register> value = definition.body()->compile(*this);
+  if (value && overflow_) {
+    fprintf(stderr, "Error: Function %s too large\n",
+            prototype.name().c_str());
+    value = std::nullopt;
+  }
+
+  if (!value) {
+    // As with codegen, a function that failed is removed.
+    function_->code.clear();
+    if (!declared && !expression) {
+      functions_.erase(prototype.name());
+    }
+    if (expression) {
+      bytecode_->expressions.pop_back();
+    }
+    function_ = nullptr;
+    return false;
+  }
+
+  emit(Opcode::ret, *value);
+  function_->defined = true;
+  function_ = nullptr;
+  return true;
+}
+
+bool Compiler::link() {
+  // Only externs that are called need resolving, as with the JIT.
+  std::vector<std::optional<Register>> natives(bytecode_->functions.size());
+  for (Function &function : bytecode_->functions) {
+    for (Instruction &instruction : function.code) {
+      if (instruction.opcode != Opcode::call) continue;
+      const Function &callee = bytecode_->functions[instruction.b];
+      if (callee.defined) continue;
+
+      std::optional<Register> &index = natives[instruction.b];
+      if (!index) {
+        index = native(callee.name, callee.arity);
+        if (!index) return false;
+      }
+      instruction.opcode = Opcode::call_native;
+      instruction.b = *index;
+    }
+  }
+  return true;
+}
+
+Machine::Machine(const Bytecode &bytecode, size_t stack_size)
+    : bytecode_(bytecode),
+      stack_(new double[stack_size]),
+      stack_size_(stack_size) {}
+
+bool Machine::call(size_t function, const std::vector<double> &args,
+                   double &result) {
+  const Function &callee = bytecode_.functions[function];
+  if (args.size() != callee.arity) {
+    LogErrorV("Incorrect # arguments passed");
+    return false;
+  }
+  if (callee.registers > stack_size_) {
+    LogErrorV("Stack overflow");
+    return false;
+  }
+  std::copy(args.begin(), args.end(), stack_.get());
+  return execute(callee, stack_.get(), result);
+}
+
+bool Machine::run() {
+  for (size_t expression : bytecode_.expressions) {
+    double value;
+    if (!call(expression, {}, value)) {
+      return false;
+    }
+  }
+  kl_flush();
+  return true;
+}
+
+bool Machine::execute(const Function &function, double *registers,
+                      double &result) {
+  const Function *functions = bytecode_.functions.data();
+  const Native *natives = bytecode_.natives.data();
+  const double *constants = bytecode_.constants.data();
+  const double *limit = stack_.get() + stack_size_;
+
+  const Instruction *code = function.code.data();
+  const Instruction *pc = code;
+  double *r = registers;
+  frames_.clear();
+
+#ifdef KL_VM_THREADED
+  // In Opcode order.
+  static void *const handlers[] = {
+      &&op_load_constant, &&op_move,          &&op_add,
+      &&op_sub,           &&op_mul,           &&op_div,
+      &&op_less,          &&op_min,           &&op_max,
+      &&op_jump,          &&op_jump_if_false, &&op_jump_if_true,
+      &&op_call,          &&op_call_native,   &&op_ret,
+  };
+#define DISPATCH() goto *handlers[static_cast<uint8_t>(pc->opcode)]
+#define HANDLER(name) op_##name:
+#else
+#define DISPATCH() goto dispatch
+#define HANDLER(name) case Opcode::name:
+#endif
+
+  DISPATCH();
+
+#ifndef KL_VM_THREADED
+dispatch:
+  switch (pc->opcode) {
+#endif
+
+    HANDLER(load_constant) {
+      r[pc->a] = constants[pc->b];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(move) {
+      r[pc->a] = r[pc->b];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(add) {
+      r[pc->a] = r[pc->b] + r[pc->c];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(sub) {
+      r[pc->a] = r[pc->b] - r[pc->c];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(mul) {
+      r[pc->a] = r[pc->b] * r[pc->c];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(div) {
+      r[pc->a] = r[pc->b] / r[pc->c];
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(less) {
+      // Unordered or less than, as fcmp ult.
+      r[pc->a] = !(r[pc->b] >= r[pc->c]) ? 1.0 : 0.0;
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(min) {
+      r[pc->a] = std::fmin(r[pc->b], r[pc->c]);
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(max) {
+      r[pc->a] = std::fmax(r[pc->b], r[pc->c]);
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(jump) {
+      pc = code + pc->target();
+      DISPATCH();
+    }
+
+    HANDLER(jump_if_false) {
+      pc = truthy(r[pc->a]) ? pc + 1 : code + pc->target();
+      DISPATCH();
+    }
+
+    HANDLER(jump_if_true) {
+      pc = truthy(r[pc->a]) ? code + pc->target() : pc + 1;
+      DISPATCH();
+    }
+
+    HANDLER(call) {
+      const Function &callee = functions[pc->b];
+      double *callee_registers = r + pc->c;
+      if (callee_registers + callee.registers > limit) {
+        LogErrorV("Stack overflow");
+        return false;
+      }
+      frames_.push_back(Frame{code, pc, r});
+      code = callee.code.data();
+      pc = code;
+      r = callee_registers;
+      DISPATCH();
+    }
+
+    HANDLER(call_native) {
+      const Native &native = natives[pc->b];
+      const double *args = r + pc->c;
+      double value = 0;
+      switch (native.arity) {
+        case 0:
+          value = reinterpret_cast<double (*)()>(native.address)();
+          break;
+        case 1:
+          value = reinterpret_cast<double (*)(double)>(native.address)(args[0]);
+          break;
+        case 2:
+          value = reinterpret_cast<double (*)(double, double)>(native.address)(
+              args[0], args[1]);
+          break;
+        case 3:
+          value = reinterpret_cast<double (*)(double, double, double)>(
+              native.address)(args[0], args[1], args[2]);
+          break;
+        case 4:
+          value = reinterpret_cast<double (*)(double, double, double, double)>(
+              native.address)(args[0], args[1], args[2], args[3]);
+          break;
+      }
+      r[pc->a] = value;
+      ++pc;
+      DISPATCH();
+    }
+
+    HANDLER(ret) {
+      double value = r[pc->a];
+      if (frames_.empty()) {
+        result = value;
+        return true;
+      }
+      const Frame &frame = frames_.back();
+      code = frame.code;
+      pc = frame.pc;
+      r = frame.registers;
+      frames_.pop_back();
+      r[pc->a] = value;
+      ++pc;
+      DISPATCH();
+    }
+
+#ifndef KL_VM_THREADED
+  }
+#endif
+
+#undef DISPATCH
+#undef HANDLER
+  return false;
+}
+
+}  // namespace vm
+
+// The compile() methods of the AST, kept here next to the bytecode they emit.
+
+std::optional<vm::Register> Number::compile(vm::Compiler &compiler) const {
+  return compiler.constant(value_);
+}
+
+std::optional<vm::Register> Variable::compile(vm::Compiler &compiler) const {
+  std::optional<vm::Register> r = compiler.lookup(name_);
+  if (!r) {
+    LogErrorV("Unknown variable name");
+  }
+  // Variables only change in the increment of their own for loop, so their
+  // register can be used directly.
+  return r;
+}
+
+std::optional<vm::Register> VarIn::compile(vm::Compiler &compiler) const {
+  size_t mark = compiler.mark();
+  std::vector<std::optional<vm::Register>> previous;
+  for (const auto &assignment : assignments_) {
+    if (assignment.type) {
+      LogErrorV("The VM does not support type annotations");
+      return std::nullopt;
+    }
+    const Expr *init = assignment.value.get();
+    std::optional<vm::Register> value =
+        init ? init->compile(compiler) : compiler.constant(0);
+    if (!value) {
+      return std::nullopt;
+    }
+    previous.push_back(compiler.bind(assignment.name, *value));
+  }
+
+  std::optional<vm::Register> body = body_->compile(compiler);
+  if (!body) {
+    return std::nullopt;
+  }
+
+  for (size_t i = assignments_.size(); i-- > 0;) {
+    compiler.unbind(assignments_[i].name, previous[i]);
+  }
+  return compiler.result(mark, *body);
+}
+
+namespace {
+
+/// Compiles a nest of operations, with Operation::post_order(). Each operand
+/// gets a register of its own from the mark on entry to the operation, as it
+/// is compiled, and its value is moved there unless it is a variable's. So
+/// the arguments of a call end up in consecutive registers, as it needs, and
+/// those of an operator wherever they already were.
+class OperationCompiler {
+ public:
+  explicit OperationCompiler(vm::Compiler &compiler) : compiler_(compiler) {}
+
+  void enter(const Operation * /*operation*/) {
+    marks_.push_back(compiler_.mark());
+  }
+
+  std::optional<vm::Register> leaf(const Expr *expr) {
+    return expr->compile(compiler_);
+  }
+
+  vm::Register operand(const Operation * /*operation*/, size_t index,
+                       vm::Register value) {
+    size_t mark = marks_.back();
+    compiler_.release(mark + index);
+    vm::Register slot = compiler_.allocate();
+    if (value < mark) {
+      return value;
+    }
+    if (value != slot) compiler_.emit(vm::Opcode::move, slot, value);
+    return slot;
+  }
+
+  std::optional<vm::Register> combine(const Operation *operation,
+                                      llvm::ArrayRef<vm::Register> operands) {
+    size_t mark = marks_.back();
+    marks_.pop_back();
+    return operation->combine(compiler_, mark, operands);
+  }
+
+ private:
+  vm::Compiler &compiler_;
+  std::vector<size_t> marks_;
+};
+
+}  // namespace
+
+std::optional<vm::Register> Operation::compile(vm::Compiler &compiler) const {
+  OperationCompiler operation_compiler(compiler);
+  return post_order<vm::Register>(operation_compiler);
+}
+
+std::optional<vm::Register> BinaryOp::combine(
+    vm::Compiler &compiler, vm::Register first,
+    llvm::ArrayRef<vm::Register> operands) const {
+  vm::Opcode opcode;
+  switch (op_) {
+    case Op::add:
+      opcode = vm::Opcode::add;
+      break;
+    case Op::sub:
+      opcode = vm::Opcode::sub;
+      break;
+    case Op::mul:
+      opcode = vm::Opcode::mul;
+      break;
+    case Op::div:
+      opcode = vm::Opcode::div;
+      break;
+    case Op::lt:
+      opcode = vm::Opcode::less;
+      break;
+    default:
+      LogErrorV("invalid binary operator");
+      return std::nullopt;
+  }
+
+  compiler.release(first);
+  vm::Register r = compiler.allocate();
+  compiler.emit(opcode, r, operands[0], operands[1]);
+  return r;
+}
+
+std::optional<vm::Register> IfThenElse::compile(vm::Compiler &compiler) const {
+  vm::Register r = compiler.allocate();
+  size_t mark = compiler.mark();
+
+  std::optional<vm::Register> condition = condition_->compile(compiler);
+  if (!condition) return std::nullopt;
+  size_t to_otherwise = compiler.emit_jump(vm::Opcode::jump_if_false, *condition);
+  compiler.release(mark);
+
+  std::optional<vm::Register> then = then_->compile(compiler);
+  if (!then) return std::nullopt;
+  if (*then != r) compiler.emit(vm::Opcode::move, r, *then);
+  compiler.release(mark);
+  size_t to_end = compiler.emit_jump(vm::Opcode::jump);
+
+  compiler.patch(to_otherwise);
+  std::optional<vm::Register> otherwise = otherwise_->compile(compiler);
+  if (!otherwise) return std::nullopt;
+  if (*otherwise != r) compiler.emit(vm::Opcode::move, r, *otherwise);
+  compiler.release(mark);
+
+  compiler.patch(to_end);
+  return r;
+}
+
+std::optional<vm::Register> For::compile(vm::Compiler &compiler) const {
+  if (type_) {
+    LogErrorV("The VM does not support type annotations");
+    return std::nullopt;
+  }
+  size_t mark = compiler.mark();
+  vm::Register variable = compiler.allocate();
+
+  // The start value, without the variable in scope.
+  std::optional<vm::Register> start = start_->compile(compiler);
+  if (!start) return std::nullopt;
+  if (*start != variable) compiler.emit(vm::Opcode::move, variable, *start);
+  compiler.release(mark + 1);
+
+  std::optional<vm::Register> previous = compiler.bind(var_, variable);
+
+  // As in codegen, the body runs before the end condition is first checked,
+  // and the condition sees the incremented variable.
+  uint32_t loop = compiler.here();
+  if (!body_->compile(compiler)) return std::nullopt;
+  compiler.release(mark + 1);
+
+  std::optional<vm::Register> step =
+      step_ ? step_->compile(compiler) : compiler.constant(1);
+  if (!step) return std::nullopt;
+  compiler.emit(vm::Opcode::add, variable, variable, *step);
+  compiler.release(mark + 1);
+
+  std::optional<vm::Register> end = end_->compile(compiler);
+  if (!end) return std::nullopt;
+  compiler.emit_jump(vm::Opcode::jump_if_true, *end, loop);
+
+  compiler.unbind(var_, previous);
+  compiler.release(mark);
+
+  // for expr always returns 0.0.
+  return compiler.constant(0);
+}
+
+namespace {
+
+/// Emits the loop of parfor and of the reductions, run sequentially: for
+/// k = 0, 1, ... while start + k * step is short of end, combining the values
+/// of body by reduction.
+// NOLINTNEXTLINE(misc-no-recursion)
+std::optional<vm::Register> compile_counted_loop(
+    vm::Compiler &compiler, const std::string &var, const ExprPtr &start_expr,
+    const ExprPtr &end_expr, const ExprPtr &step_expr, Reduction reduction,
+    const Expr &body) {
+  vm::Register r = compiler.constant(0);
+  size_t mark = compiler.mark();
+  vm::Register variable = compiler.allocate();
+  vm::Register end = compiler.allocate();
+  vm::Register step = compiler.allocate();
+
+  const std::pair<const ExprPtr &, vm::Register> bounds[] = {
+      {start_expr, variable}, {end_expr, end}, {step_expr, step}};
+  for (const auto &bound : bounds) {
+    std::optional<vm::Register> value =
+        bound.first ? bound.first->compile(compiler) : compiler.constant(1);
+    if (!value) return std::nullopt;
+    if (*value != bound.second) {
+      compiler.emit(vm::Opcode::move, bound.second, *value);
+    }
+    compiler.release(mark + 3);
+  }
+
+  vm::Opcode combine = vm::Opcode::add;
+  switch (reduction) {
+    case Reduction::none:
+    case Reduction::sum:
+      break;
+    case Reduction::product:
+      combine = vm::Opcode::mul;
+      compiler.emit(vm::Opcode::move, r, compiler.constant(1));
+      break;
+    case Reduction::min:
+      combine = vm::Opcode::min;
+      compiler.emit(vm::Opcode::move, r,
+                    compiler.constant(std::numeric_limits<double>::infinity()));
+      break;
+    case Reduction::max:
+      combine = vm::Opcode::max;
+      compiler.emit(vm::Opcode::move, r,
+                    compiler.constant(-std::numeric_limits<double>::infinity()));
+      break;
+  }
+  compiler.release(mark + 3);
+
+  // Short of end, whichever way step goes: (variable - end) * step < 0.
+  uint32_t loop = compiler.here();
+  vm::Register zero = compiler.constant(0);
+  vm::Register distance = compiler.allocate();
+  compiler.emit(vm::Opcode::sub, distance, variable, end);
+  compiler.emit(vm::Opcode::mul, distance, distance, step);
+  compiler.emit(vm::Opcode::less, distance, distance, zero);
+  size_t to_exit = compiler.emit_jump(vm::Opcode::jump_if_false, distance);
+  compiler.release(mark + 3);
+
+  std::optional<vm::Register> previous = compiler.bind(var, variable);
+  std::optional<vm::Register> value = body.compile(compiler);
+  if (!value) return std::nullopt;
+  if (reduction != Reduction::none) {
+    compiler.emit(combine, r, r, *value);
+  }
+  compiler.unbind(var, previous);
+  compiler.release(mark + 3);
+
+  compiler.emit(vm::Opcode::add, variable, variable, step);
+  compiler.emit_jump(vm::Opcode::jump, 0, loop);
+  compiler.patch(to_exit);
+
+  compiler.release(mark);
+  return r;
+}
+
+}  // namespace
+
+std::optional<vm::Register> ParallelFor::compile(vm::Compiler &compiler) const {
+  // The interpreter runs parfor sequentially, as the runtime does when nested.
+  return compile_counted_loop(compiler, var_, start_, end_, step_, reduction_,
+                              *body_);
+}
+
+std::optional<vm::Register> Reduce::compile(vm::Compiler &compiler) const {
+  return compile_counted_loop(compiler, var_, start_, end_, step_, reduction_,
+                              *body_);
+}
+
+namespace function {
+
+std::optional<vm::Register> Call::combine(
+    vm::Compiler &compiler, vm::Register first,
+    llvm::ArrayRef<vm::Register> operands) const {
+  std::optional<vm::Compiler::Callee> callee =
+      compiler.callee(name_, operands.size());
+  if (!callee) return std::nullopt;
+
+  // Arguments go in consecutive registers at the top of the frame, which
+  // become the first registers of the callee. Those of variables are not there
+  // yet.
+  for (size_t i = 0; i < operands.size(); i++) {
+    if (operands[i] != first + i) {
+      compiler.emit(vm::Opcode::move, first + i, operands[i]);
+    }
+  }
+
+  compiler.release(first);
+  vm::Register r = compiler.allocate();
+  compiler.emit(callee->opcode, r, callee->index, first);
+  return r;
+}
+
+}  // namespace function
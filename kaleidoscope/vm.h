@@ -0,0 +1,182 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// A register-based bytecode for Kaleidoscope, and an interpreter for it
+/// (kali --backend=vm). Lowering the AST takes a single pass, and running it
+/// needs no LLVM initialization or machine code generation, so for small
+/// one-shot scripts this gets to the first result well before the JIT does.
+namespace vm {
+
+// NOLINTNEXTLINE
+enum class Opcode : uint8_t {
+  load_constant,  // r[a] = constants[b]
+  move,           // r[a] = r[b]
+  add,            // r[a] = r[b] + r[c]
+  sub,            // r[a] = r[b] - r[c]
+  mul,            // r[a] = r[b] * r[c]
+  div,            // r[a] = r[b] / r[c]
+  less,           // r[a] = r[b] < r[c] or unordered ? 1 : 0
+  min,            // r[a] = fmin(r[b], r[c])
+  max,            // r[a] = fmax(r[b], r[c])
+  jump,           // pc = target
+  jump_if_false,  // if r[a] is 0 or NaN, pc = target
+  jump_if_true,   // unless r[a] is 0 or NaN, pc = target
+  call,           // r[a] = functions[b](r[c], ...)
+  call_native,    // r[a] = natives[b](r[c], ...)
+  ret,            // return r[a]
+};
+
+/// An instruction is 8 bytes. Jumps keep their target in b and c.
+struct Instruction {
+  Opcode opcode;
+  uint16_t a = 0;
+  uint16_t b = 0;
+  uint16_t c = 0;
+
+  uint32_t target() const { return b | (static_cast<uint32_t>(c) << 16); }
+  void set_target(uint32_t target) {
+    b = target & 0xffff;
+    c = target >> 16;
+  }
+};
+
+using Register = uint16_t;
+
+/// A function's arguments arrive in its first registers; calls put them at
+/// the top of the caller's frame, which is where the callee's frame starts.
+struct Function {
+  std::string name;
+  uint16_t arity = 0;
+  uint16_t registers = 0;
+  bool defined = false;
+  std::vector<Instruction> code = {};
+};
+
+/// A C function, from libkl, the math library or the process, taking arity
+/// doubles and returning a double.
+struct Native {
+  using Address = void (*)();
+
+  std::string name;
+  uint16_t arity = 0;
+  Address address = nullptr;
+};
+
+struct Bytecode {
+  std::vector<Function> functions;
+  std::vector<Native> natives;
+  std::vector<double> constants;
+
+  /// Top-level expressions, as indices into functions, in source order.
+  std::vector<size_t> expressions;
+
+  /// Index into functions of name, or -1.
+  int64_t lookup(const std::string &name) const;
+
+  void print(llvm::raw_ostream &out) const;
+};
+
+/// Lowers a Program to Bytecode. The AST nodes emit their own code through
+/// the compile() methods, as they do IR through codegen().
+class Compiler {
+ public:
+  /// compile - Returns nullptr, after logging, if program has errors.
+  static std::unique_ptr<Bytecode> compile(const Program &program);
+
+  // Used by the AST nodes.
+
+  /// A register for a temporary. release(mark()) frees it along with those
+  /// allocated after it.
+  Register allocate();
+  size_t mark() const { return next_register_; }
+  void release(size_t mark) { next_register_ = mark; }
+
+  /// result - Releases the temporaries from mark on, except for value, which
+  /// is moved down to mark if it is one of them. Returns its register.
+  Register result(size_t mark, Register value);
+
+  /// Emits an instruction, returning its index.
+  size_t emit(Opcode opcode, Register a = 0, Register b = 0, Register c = 0);
+  /// Loads value into a new register.
+  Register constant(double value);
+  /// Emits a jump to target, or to be patched if target is unknown yet.
+  size_t emit_jump(Opcode opcode, Register a = 0, uint32_t target = 0);
+  /// Points the jump at index to the next instruction emitted.
+  void patch(size_t jump);
+  uint32_t here() const { return function_->code.size(); }
+
+  /// Register of a variable in scope, or nullopt. bind returns the previous
+  /// binding, for restoring with unbind.
+  std::optional<Register> lookup(const std::string &name) const;
+  std::optional<Register> bind(const std::string &name, Register r);
+  void unbind(const std::string &name, std::optional<Register> previous);
+
+  /// The function or native a call to name with arity arguments goes to, or
+  /// nullopt after logging.
+  struct Callee {
+    Opcode opcode;
+    Register index;
+  };
+  std::optional<Callee> callee(const std::string &name, size_t arity);
+
+ private:
+  void declare(const function::Prototype &prototype);
+  /// Compiles definition into a function of its own if it is an expression.
+  bool define(const function::Definition &definition, bool expression);
+
+  /// Turns calls to functions declared extern and never defined into calls to
+  /// natives.
+  bool link();
+
+  std::optional<Register> native(const std::string &name, size_t arity);
+
+  std::unique_ptr<Bytecode> bytecode_ = std::make_unique<Bytecode>();
+  std::map<uint64_t, Register> constants_;
+  std::map<std::string, size_t> functions_;
+  std::map<std::string, Register> natives_;
+  std::map<std::string, Register> scope_;
+
+  Function *function_ = nullptr;
+  size_t next_register_ = 0;
+  bool overflow_ = false;
+};
+
+/// Runs bytecode. A Machine is not thread safe, but any number may run the
+/// same Bytecode.
+class Machine {
+ public:
+  explicit Machine(const Bytecode &bytecode, size_t stack_size = 1 << 20);
+
+  /// call - Calls function with args, storing its value in result. Returns
+  /// false, after logging, if the stack overflowed.
+  bool call(size_t function, const std::vector<double> &args, double &result);
+
+  /// run - Evaluates the top-level expressions in order. Returns false, after
+  /// logging, if one failed.
+  bool run();
+
+ private:
+  bool execute(const Function &function, double *registers, double &result);
+
+  struct Frame {
+    const Instruction *code;
+    const Instruction *pc;
+    double *registers;
+  };
+
+  const Bytecode &bytecode_;
+  // Left uninitialized, so that only the pages used are ever touched.
+  std::unique_ptr<double[]> stack_;
+  size_t stack_size_;
+  std::vector<Frame> frames_;
+};
+
+}  // namespace vm